@@ -0,0 +1,15 @@
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+// Counts every heap allocation made through operator new (which
+// AlignedAllocator goes through as well), so a benchmark can check that a
+// steady-state step allocates nothing, inside evalF included. The
+// counting operator new is only compiled in when the build defines
+// A3_COUNT_ALLOCATIONS (cmake -DA3_COUNT_ALLOCATIONS=ON); otherwise the
+// count stays at zero and countingAllocations() is false.
+bool countingAllocations();
+
+// allocations made so far, by all threads
+long heapAllocations();
+
+#endif
@@ -0,0 +1,704 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "allocationcounter.h"
+#include "blocksparsematrix.h"
+#include "clothsystem.h"
+#include "coupledworld.h"
+#include "particlesystem.h"
+#include "sphkernels.h"
+#include "surfacemesher.h"
+#include "threadpool.h"
+#include "timestepper.h"
+#include "watersystem.h"
+
+using namespace std;
+
+namespace
+{
+
+double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Undamped square mass-spring lattice with no external forces, so its
+// total energy is exactly conserved by the true dynamics. Counts evalF
+// calls so steppers can be compared by cost.
+class SpringLattice : public ParticleSystem
+{
+public:
+    SpringLattice(int side, float spacing, float stiffness)
+        : m_side(side), m_spacing(spacing), m_stiffness(stiffness), m_evaluations(0)
+    {
+        m_store.resize(side * side);
+        for (int i = 0; i < side * side; ++i) {
+            int col = i % side;
+            int row = i / side;
+            m_store.setPosition(i, Vector3f(col * spacing, row * spacing, 0));
+            // deterministic, zero-mean velocity kick
+            m_store.setVelocity(i, Vector3f(0.3f * sin(1.3f * i), 0.3f * cos(0.7f * i), 0.2f * sin(2.1f * i)));
+        }
+        for (int i = 0; i < side * side; ++i) {
+            if (i % side < side - 1) m_pairs.push_back(i), m_pairs.push_back(i + 1);
+            if (i / side < side - 1) m_pairs.push_back(i), m_pairs.push_back(i + side);
+        }
+    }
+
+    void evalF(const StateView& state, DerivativeView& f) override
+    {
+        ++m_evaluations;
+        const int n = state.numParticles();
+        vector<Vector3f>& acc = m_acceleration;
+        acc.assign(n, Vector3f());
+        for (size_t k = 0; k < m_pairs.size(); k += 2) {
+            int a = m_pairs[k], b = m_pairs[k + 1];
+            Vector3f d = state.positionAt(a) - state.positionAt(b);
+            float length = d.abs();
+            Vector3f force = -m_stiffness * (length - m_spacing) * (d / length);
+            acc[a] += force;
+            acc[b] -= force;
+        }
+        for (int i = 0; i < n; ++i) {
+            f.set(i, state.velocityAt(i), acc[i]);
+        }
+    }
+    using ParticleSystem::evalF;
+
+    double energy() const
+    {
+        StateView state = getStateView();
+        double e = 0;
+        for (int i = 0; i < state.numParticles(); ++i) {
+            e += 0.5 * state.velocityAt(i).absSquared();
+        }
+        for (size_t k = 0; k < m_pairs.size(); k += 2) {
+            double stretch = (state.positionAt(m_pairs[k]) - state.positionAt(m_pairs[k + 1])).abs() - m_spacing;
+            e += 0.5 * m_stiffness * stretch * stretch;
+        }
+        return e;
+    }
+
+    long evaluations() const { return m_evaluations; }
+
+private:
+    int m_side;
+    float m_spacing;
+    float m_stiffness;
+    long m_evaluations;
+    vector<int> m_pairs;
+    vector<Vector3f> m_acceleration;
+};
+
+// Runs every explicit stepper on the same undamped lattice and reports
+// how far each drifts from the initial energy, and at what cost.
+int benchmarkEnergyDrift(int argc, char** argv)
+{
+    float h = argc > 0 ? (float) atof(argv[0]) : 0.01f;
+    float seconds = argc > 1 ? (float) atof(argv[1]) : 20.0f;
+    int steps = (int) (seconds / h + 0.5f);
+
+    printf("energy drift: 16x16 undamped spring lattice, h = %g, %d steps\n", h, steps);
+    printf("%-22s %14s %14s %10s %10s\n", "integrator", "final drift", "max |drift|", "evalF", "ms");
+
+    const char* letters = "etravs";
+    const char* names[] = { "forward Euler", "trapezoidal", "RK4", "Dormand-Prince", "velocity Verlet", "symplectic Euler" };
+    for (int k = 0; letters[k]; ++k) {
+        SpringLattice lattice(16, 0.2f, 50.0f);
+        TimeStepper* stepper = createTimeStepper(letters[k]);
+        double e0 = lattice.energy();
+        double maxDrift = 0;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; ++s) {
+            stepper->takeStep(&lattice, h);
+            double drift = (lattice.energy() - e0) / e0;
+            // written so that a NaN (blown up stepper) sticks
+            if (!(fabs(drift) <= maxDrift)) {
+                maxDrift = fabs(drift);
+            }
+        }
+        double elapsed = secondsSince(start);
+
+        double drift = (lattice.energy() - e0) / e0;
+        printf("%-22s %13.4g%% %13.4g%% %10ld %10.1f\n", names[k], 100 * drift, 100 * maxDrift,
+               lattice.evaluations(), 1000 * elapsed);
+        delete stepper;
+    }
+    return 0;
+}
+
+// Builds and steps cloth sheets of growing size and reports the cost
+// per particle of construction, evalF and a whole RK4 step, which should
+// stay flat if everything scales linearly.
+int benchmarkClothScaling(int argc, char** argv)
+{
+    int maxSide = argc > 0 ? atoi(argv[0]) : 1000;
+    int evaluations = argc > 1 ? atoi(argv[1]) : 10;
+
+    printf("cloth scaling: square sheets up to %dx%d, %d evaluations each\n", maxSide, maxSide, evaluations);
+    printf("%10s %10s %12s %12s %12s %12s\n", "side", "particles", "springs",
+           "build ns/p", "evalF ns/p", "RK4 ns/p");
+
+    for (int side = 32; ; side *= 2) {
+        side = min(side, maxSide);
+        ClothParams params;
+        params.width = side;
+        params.height = side;
+        const double particles = (double) side * side;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        ClothSystem cloth(params);
+        double build = secondsSince(start);
+
+        AlignedFloats derivative(cloth.store().stateSize(), 0.0f);
+        DerivativeView f(derivative.data(), cloth.store().size(), cloth.store().stride());
+        start = chrono::steady_clock::now();
+        for (int k = 0; k < evaluations; ++k) {
+            cloth.evalF(cloth.getStateView(), f);
+        }
+        double eval = secondsSince(start) / evaluations;
+
+        TimeStepper* stepper = createTimeStepper('r');
+        // first step sizes the scratch arena
+        stepper->takeStep(&cloth, 1e-4f);
+        start = chrono::steady_clock::now();
+        for (int k = 0; k < evaluations; ++k) {
+            stepper->takeStep(&cloth, 1e-4f);
+        }
+        double step = secondsSince(start) / evaluations;
+        delete stepper;
+
+        printf("%10d %10.0f %12d %12.1f %12.1f %12.1f\n", side, particles, cloth.getSprings().size(),
+               1e9 * build / particles, 1e9 * eval / particles, 1e9 * step / particles);
+        if (side == maxSide) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// WaterSystem::calculateKernel as it was before the kernel functors,
+// kept as the reference for benchmarkKernels
+enum LegacyKernelType { LEGACY_POLY6, LEGACY_SPIKY, LEGACY_VISCOSITY };
+
+float legacyKernel(LegacyKernelType type, float r, float h)
+{
+    if (r < 0 || r > h) {
+        return 0;
+    }
+
+    float numerator = 0;
+    float denominator = 1;
+
+    if (type == LEGACY_POLY6) {
+        numerator = 315 * pow(pow(h, 2) - pow(r, 2), 3);
+        denominator = 64 * SPH_PI * pow(h, 9);
+    } else if (type == LEGACY_SPIKY) {
+        numerator = 15 * pow(h - r, 3);
+        denominator = SPH_PI * pow(h, 6);
+    } else if (type == LEGACY_VISCOSITY) {
+        float term1 = -pow(r, 3) / (2 * pow(h, 3));
+        float term2 = pow(r, 2) / pow(h, 2);
+        float term3 = h / (2 * r);
+
+        numerator = 15 * (term1 + term2 + term3 - 1);
+        denominator = 2 * SPH_PI * pow(h, 3);
+    }
+
+    return numerator / denominator;
+}
+
+// times one kernel over all sample distances, repeated; returns ns per
+// evaluation and accumulates the results into sink so nothing is elided
+template <typename Function>
+double timeKernel(const Function& kernel, const vector<float>& inputs, int repeats, double& sink)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    float sum = 0;
+    for (int k = 0; k < repeats; ++k) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            sum += kernel(inputs[i]);
+        }
+    }
+    sink += sum;
+    return 1e9 * secondsSince(start) / ((double) repeats * inputs.size());
+}
+
+// Compares the old pow()-based calculateKernel against the kernel
+// functors and the tabulated fast path on distances inside the water
+// neighbor radius, and reports the table's worst relative error.
+int benchmarkKernels(int argc, char** argv)
+{
+    int count = argc > 0 ? atoi(argv[0]) : 1 << 16;
+    int repeats = argc > 1 ? atoi(argv[1]) : 100;
+    const float h = 1.0f;
+    const float radius = 0.08f;
+
+    vector<float> r(count);
+    vector<float> r2(count);
+    for (int i = 0; i < count; ++i) {
+        // deterministic spread over (0, radius]
+        r[i] = radius * (0.5f + 0.5f * sin(12.9898f * i)) + 1e-4f;
+        r[i] = min(r[i], radius);
+        r2[i] = r[i] * r[i];
+    }
+
+    Poly6Kernel poly6(h);
+    SpikyGradientKernel spiky(h);
+    ViscosityLaplacianKernel viscosity(h);
+    TabulatedKernel viscosityTable(viscosity, radius);
+
+    double tableError = 0;
+    for (int i = 0; i < count; ++i) {
+        double exact = viscosity(r[i]);
+        tableError = max(tableError, fabs(viscosityTable(r2[i]) - exact) / exact);
+    }
+
+    double sink = 0;
+    printf("SPH kernels: %d distances in (0, %g], h = %g, %d repeats\n", count, radius, h, repeats);
+    printf("%-36s %10s\n", "kernel", "ns/eval");
+    printf("%-36s %10.2f\n", "poly6, legacy calculateKernel",
+           timeKernel([h](float x) { return legacyKernel(LEGACY_POLY6, x, h); }, r, repeats, sink));
+    printf("%-36s %10.2f\n", "poly6 functor (r^2)", timeKernel(poly6, r2, repeats, sink));
+    printf("%-36s %10.2f\n", "spiky, legacy calculateKernel",
+           timeKernel([h](float x) { return legacyKernel(LEGACY_SPIKY, x, h); }, r, repeats, sink));
+    printf("%-36s %10.2f\n", "spiky gradient functor (r)", timeKernel(spiky, r, repeats, sink));
+    printf("%-36s %10.2f\n", "viscosity, legacy calculateKernel",
+           timeKernel([h](float x) { return legacyKernel(LEGACY_VISCOSITY, x, h); }, r, repeats, sink));
+    printf("%-36s %10.2f\n", "viscosity laplacian functor (r)", timeKernel(viscosity, r, repeats, sink));
+    printf("%-36s %10.2f\n", "viscosity laplacian, sqrt of r^2",
+           timeKernel([&viscosity](float x) { return viscosity(sqrt(x)); }, r2, repeats, sink));
+    printf("%-36s %10.2f\n", "viscosity laplacian table (r^2)", timeKernel(viscosityTable, r2, repeats, sink));
+    printf("table max relative error: %g   (checksum %g)\n", tableError, sink);
+    return 0;
+}
+
+// Steps the water system with RK4 on 1, 2, 4, ... threads and reports
+// the time per step and whether the final state matches the serial run
+// bit for bit. Dimensions, spacing and depth select the scene; e.g.
+// "3 0.02 2" is a quarter million particles in 3D.
+int benchmarkThreads(int argc, char** argv)
+{
+    int maxThreads = argc > 0 ? atoi(argv[0]) : (int) thread::hardware_concurrency();
+    int steps = argc > 1 ? atoi(argv[1]) : 200;
+    WaterParams params;
+    if (argc > 2) params.dimensions = atoi(argv[2]) == 3 ? 3 : 2;
+    if (argc > 3) params.particleSpacing = (float) atof(argv[3]);
+    if (argc > 4) params.tankDepth = (float) atof(argv[4]);
+    const float h = 0.002f;
+
+    printf("threads: %dD water, spacing %g, RK4, h = %g, %d steps, up to %d threads\n",
+           params.dimensions, params.particleSpacing, h, steps, maxThreads);
+    printf("%10s %12s %10s %14s\n", "threads", "ms/step", "speedup", "matches serial");
+
+    vector<float> serial;
+    double serialTime = 0;
+    for (int threads = 1; ; threads *= 2) {
+        threads = min(threads, maxThreads);
+        setThreadCount(threads);
+        WaterSystem water(params);
+        TimeStepper* stepper = createTimeStepper('r');
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; ++s) {
+            water.beginStep(h);
+            stepper->takeStep(&water, h);
+        }
+        double perStep = secondsSince(start) / steps;
+        delete stepper;
+
+        const ParticleStore& store = water.store();
+        vector<float> state(store.data(), store.data() + store.stateSize());
+        if (threads == 1) {
+            serial = state;
+            serialTime = perStep;
+        }
+        printf("%10d %12.3f %10.2f %14s\n", threads, 1000 * perStep, serialTime / perStep,
+               state == serial ? "yes" : "NO");
+        if (threads >= maxThreads) {
+            break;
+        }
+    }
+    setThreadCount(1);
+    return 0;
+}
+
+// Times WCSPH water steps with each neighbor pair evaluated from both
+// sides (the default) and once from a half list, with the force pass
+// timed apart from the neighbor search both share, and reports how far
+// the first derivatives of the two differ.
+int benchmarkSymmetricForces(int argc, char** argv)
+{
+    int steps = argc > 0 ? atoi(argv[0]) : 200;
+    WaterParams params;
+    if (argc > 1) params.dimensions = atoi(argv[1]) == 3 ? 3 : 2;
+    if (argc > 2) params.particleSpacing = (float) atof(argv[2]);
+    if (argc > 3) params.tankDepth = (float) atof(argv[3]);
+    const float h = 0.002f;
+
+    printf("pairs: %dD water, spacing %g, RK4, h = %g, %d steps on %d thread(s)\n",
+           params.dimensions, params.particleSpacing, h, steps, threadCount());
+    printf("%12s %12s %10s %12s %12s %10s\n", "pairs", "ms/step", "speedup", "search ms", "forces ms", "speedup");
+
+    vector<float> derivatives[2];
+    double fullTime = 0;
+    double fullForceTime = 0;
+    for (int symmetric = 0; symmetric < 2; ++symmetric) {
+        WaterSystem water(params);
+        water.setSymmetricForces(symmetric != 0);
+        const ParticleStore& store = water.store();
+        derivatives[symmetric].resize(store.stateSize());
+        DerivativeView f(derivatives[symmetric].data(), store.size(), store.stride());
+        water.evalF(store.view(), f);
+
+        TimeStepper* stepper = createTimeStepper('r');
+        const double searchBefore = water.neighborSeconds();
+        const double forceBefore = water.forceSeconds();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; ++s) {
+            water.beginStep(h);
+            stepper->takeStep(&water, h);
+        }
+        double perStep = secondsSince(start) / steps;
+        double searchPerStep = (water.neighborSeconds() - searchBefore) / steps;
+        double forcePerStep = (water.forceSeconds() - forceBefore) / steps;
+        delete stepper;
+        if (!symmetric) {
+            fullTime = perStep;
+            fullForceTime = forcePerStep;
+        }
+        printf("%12s %12.3f %10.2f %12.3f %12.3f %10.2f\n", symmetric ? "half list" : "both sides", 1000 * perStep,
+               fullTime / perStep, 1000 * searchPerStep, 1000 * forcePerStep, fullForceTime / forcePerStep);
+    }
+
+    double largest = 0;
+    double difference = 0;
+    for (size_t k = 0; k < derivatives[0].size(); ++k) {
+        largest = max(largest, (double) fabs(derivatives[0][k]));
+        difference = max(difference, (double) fabs(derivatives[0][k] - derivatives[1][k]));
+    }
+    printf("first derivative max difference: %g (relative to largest %g)\n",
+           difference, largest > 0 ? difference / largest : 0.0);
+    return 0;
+}
+
+// Lets the water fall for a number of steps, then meshes its surface on
+// 1, 2, 4, ... threads and reports the time per mesh and whether the mesh
+// matches the serial one exactly.
+int benchmarkSurface(int argc, char** argv)
+{
+    int maxThreads = argc > 0 ? atoi(argv[0]) : (int) thread::hardware_concurrency();
+    int steps = argc > 1 ? atoi(argv[1]) : 100;
+    WaterParams params;
+    if (argc > 2) params.dimensions = atoi(argv[2]) == 3 ? 3 : 2;
+    if (argc > 3) params.particleSpacing = (float) atof(argv[3]);
+    if (argc > 4) params.tankDepth = (float) atof(argv[4]);
+    const float h = 0.002f;
+    const int builds = 10;
+
+    WaterSystem water(params);
+    TimeStepper* stepper = createTimeStepper('r');
+    for (int s = 0; s < steps; ++s) {
+        water.beginStep(h);
+        stepper->takeStep(&water, h);
+    }
+    delete stepper;
+
+    printf("surface: %dD water, spacing %g, %d particles after %d steps, up to %d threads\n",
+           params.dimensions, params.particleSpacing, water.store().size(), steps, maxThreads);
+    printf("%10s %12s %10s %10s %14s\n", "threads", "ms/mesh", "speedup", "triangles", "matches serial");
+
+    // configured like the one the water draws with
+    SurfaceMesher mesher = water.surface();
+    vector<Vector3f> serial;
+    double serialTime = 0;
+    for (int threads = 1; ; threads *= 2) {
+        threads = min(threads, maxThreads);
+        setThreadCount(threads);
+        mesher.build(water.store().view());
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int b = 0; b < builds; ++b) {
+            mesher.build(water.store().view());
+        }
+        double perBuild = secondsSince(start) / builds;
+        if (threads == 1) {
+            serial = mesher.positions();
+            serialTime = perBuild;
+        }
+        printf("%10d %12.3f %10.2f %10d %14s\n", threads, 1000 * perBuild, serialTime / perBuild,
+               mesher.numTriangles(), mesher.positions() == serial ? "yes" : "NO");
+        if (threads >= maxThreads) {
+            break;
+        }
+    }
+    printf("%d blocks, %d interior skipped, %zu KiB\n", mesher.numBlocks(), mesher.numInteriorBlocks(),
+           mesher.memoryBytes() / 1024);
+    setThreadCount(1);
+    return 0;
+}
+
+// ClothSystem::evalF's drag and spring forces written with Vector3f, the
+// way the cloth computed them before its state was split into channels:
+// every step is a vecmath call, so this is where inlining vecmath shows
+void vecmathClothForces(const ClothSystem& cloth, const StateView& state, vector<Vector3f>& forces)
+{
+    const ClothSystem::SpringList& springs = cloth.getSprings();
+    const float drag = cloth.params().drag;
+    forces.resize(state.numParticles());
+    for (int i = 0; i < state.numParticles(); ++i) {
+        forces[i] = -drag * state.velocityAt(i);
+    }
+    for (int k = 0; k < springs.size(); ++k) {
+        Vector3f d = state.positionAt(springs.a[k]) - state.positionAt(springs.b[k]);
+        float length = d.abs();
+        if (length <= 0) {
+            continue;
+        }
+        Vector3f f = -springs.stiffness[k] * (length - springs.restLength[k]) * (d / length);
+        forces[springs.a[k]] += f;
+        forces[springs.b[k]] -= f;
+    }
+}
+
+// Times the cloth forces on sheets of growing size: ClothSystem::evalF
+// on the channels, the same forces through Vector3f, and the spring
+// Jacobians, which are written with Vector3f. Run it against a build with
+// the out-of-line vecmath to see what inlining it gains.
+int benchmarkVecmath(int argc, char** argv)
+{
+    int maxSide = argc > 0 ? atoi(argv[0]) : 512;
+    int evaluations = argc > 1 ? atoi(argv[1]) : 20;
+
+    printf("vecmath: square cloth sheets up to %dx%d, %d evaluations each\n", maxSide, maxSide, evaluations);
+    printf("%10s %12s %14s %14s %16s\n", "side", "springs", "evalF ns/s", "Vector3f ns/s", "Jacobians ns/s");
+
+    double sink = 0;
+    for (int side = 32; ; side *= 2) {
+        side = min(side, maxSide);
+        ClothParams params;
+        params.width = side;
+        params.height = side;
+        ClothSystem cloth(params);
+        const double springs = cloth.getSprings().size();
+
+        AlignedFloats derivative(cloth.store().stateSize(), 0.0f);
+        DerivativeView f(derivative.data(), cloth.store().size(), cloth.store().stride());
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int k = 0; k < evaluations; ++k) {
+            cloth.evalF(cloth.getStateView(), f);
+        }
+        double eval = secondsSince(start) / evaluations;
+        sink += derivative[0];
+
+        vector<Vector3f> forces;
+        start = chrono::steady_clock::now();
+        for (int k = 0; k < evaluations; ++k) {
+            vecmathClothForces(cloth, cloth.getStateView(), forces);
+        }
+        double vectors = secondsSince(start) / evaluations;
+        sink += forces[0].y();
+
+        BlockSparseMatrix dfdx, dfdv;
+        // the first call builds the sparsity pattern
+        cloth.evalForceJacobians(cloth.getStateView(), dfdx, dfdv);
+        start = chrono::steady_clock::now();
+        for (int k = 0; k < evaluations; ++k) {
+            cloth.evalForceJacobians(cloth.getStateView(), dfdx, dfdv);
+        }
+        double jacobians = secondsSince(start) / evaluations;
+        sink += dfdx.diagonalBlock(0)[0];
+
+        printf("%10d %12.0f %14.2f %14.2f %16.2f\n", side, springs,
+               1e9 * eval / springs, 1e9 * vectors / springs, 1e9 * jacobians / springs);
+        if (side == maxSide) {
+            break;
+        }
+    }
+    printf("(checksum %g)\n", sink);
+    return 0;
+}
+
+// Counts the heap allocations, inside evalF included, of every
+// integrator's steps on the cloth and on the water once a warm-up has
+// sized everything. A steady-state step should make none.
+int benchmarkAllocations(int argc, char** argv)
+{
+    int steps = argc > 0 ? atoi(argv[0]) : 100;
+    int threads = argc > 1 ? atoi(argv[1]) : 1;
+    const int warmUp = 40;
+    if (!countingAllocations()) {
+        printf("allocations: heap allocations are only counted in a build with A3_COUNT_ALLOCATIONS\n");
+        printf("             (cmake -DA3_COUNT_ALLOCATIONS=ON)\n");
+        return -1;
+    }
+
+    setThreadCount(threads);
+    printf("allocations: %d steps after %d warm-up steps, %d threads\n", steps, warmUp, threadCount());
+    printf("%10s %12s %16s %14s %14s\n", "system", "integrator", "warm-up allocs", "allocs/step", "most in a step");
+    const char* integrators = "etrasvi";
+    for (int system = 0; system < 2; ++system) {
+        for (const char* integrator = integrators; *integrator; ++integrator) {
+            ParticleSystem* particles;
+            WaterSystem* water = nullptr;
+            if (system == 0) {
+                particles = new ClothSystem(ClothParams());
+            } else {
+                particles = water = new WaterSystem(WaterParams());
+            }
+            const float h = water ? 0.002f : 0.001f;
+            TimeStepper* stepper = createTimeStepper(*integrator);
+
+            long total = 0, most = 0, warmUpAllocations = 0;
+            for (int s = 0; s < warmUp + steps; ++s) {
+                long before = heapAllocations();
+                particles->beginStep(h);
+                stepper->takeStep(particles, h);
+                long allocations = heapAllocations() - before;
+                if (s < warmUp) {
+                    warmUpAllocations += allocations;
+                } else {
+                    total += allocations;
+                    most = max(most, allocations);
+                }
+            }
+            printf("%10s %12c %16ld %14.2f %14ld\n", water ? "water" : "cloth", *integrator,
+                   warmUpAllocations, (double) total / steps, most);
+            delete stepper;
+            delete particles;
+        }
+    }
+    setThreadCount(1);
+    return 0;
+}
+
+// Dormand-Prince with tolerances loose enough to take every step of the
+// coupling benchmark whole, so the step size a stepper carries over from
+// earlier calls makes no difference to its result
+TimeStepper* createCouplingStepper(char integrator)
+{
+    if (integrator == 'a') {
+        return new DormandPrince(1e-2f, 1e-2f);
+    }
+    return createTimeStepper(integrator);
+}
+
+// whether a stepper made by createCouplingStepper took its last `calls`
+// calls in one accepted step each
+bool tookWholeSteps(const TimeStepper* stepper, long calls)
+{
+    const DormandPrince* dp = dynamic_cast<const DormandPrince*>(stepper);
+    return !dp || (dp->acceptedSteps() == calls && dp->rejectedSteps() == 0);
+}
+
+// Runs a cloth hanging into water, coupled, with the steppers that
+// reuse the derivative of the last step's end (Velocity Verlet and
+// Dormand-Prince) and step sizes alternating like the adaptive
+// scheduler's. Each run is repeated with new steppers for every step,
+// which have nothing to reuse, so every first stage is a fresh evalF;
+// reports whether the two end states match bit for bit.
+int benchmarkCouplingCaches(int argc, char** argv)
+{
+    int steps = argc > 0 ? atoi(argv[0]) : 400;
+    ClothParams clothParams;
+    clothParams.origin = Vector3f(0.1f, 0.3f, 0);
+
+    printf("coupling: cloth in 2D water, %d steps of 0.002 and 0.001 alternately\n", steps);
+    printf("%10s %12s %12s %22s\n", "solver", "integrator", "ms/step", "first stage is fresh");
+    const char* integrators = "va";
+    for (int solver = 0; solver < 2; ++solver) {
+        for (const char* integrator = integrators; *integrator; ++integrator) {
+            vector<float> ends[2][2];
+            double perStep = 0;
+            bool whole = true;
+            for (int fresh = 0; fresh < 2; ++fresh) {
+                WaterParams waterParams;
+                waterParams.solver = solver ? WaterParams::SOLVER_PCISPH : WaterParams::SOLVER_WCSPH;
+                ClothSystem cloth(clothParams);
+                WaterSystem water(waterParams);
+                CoupledWorld world(&cloth, &water);
+                TimeStepper* clothStepper = createCouplingStepper(*integrator);
+                TimeStepper* waterStepper = createCouplingStepper(*integrator);
+
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                for (int s = 0; s < steps; ++s) {
+                    const float h = s % 2 ? 0.001f : 0.002f;
+                    cloth.beginStep(h);
+                    water.beginStep(h);
+                    if (fresh) {
+                        delete clothStepper;
+                        delete waterStepper;
+                        clothStepper = createCouplingStepper(*integrator);
+                        waterStepper = createCouplingStepper(*integrator);
+                    }
+                    world.step(clothStepper, waterStepper, h);
+                    if (fresh) {
+                        whole = whole && tookWholeSteps(clothStepper, 1) && tookWholeSteps(waterStepper, 1);
+                    }
+                }
+                if (!fresh) {
+                    perStep = secondsSince(start) / steps;
+                    whole = whole && tookWholeSteps(clothStepper, steps) && tookWholeSteps(waterStepper, steps);
+                }
+                delete clothStepper;
+                delete waterStepper;
+
+                const ParticleSystem* systems[] = { &cloth, &water };
+                for (int k = 0; k < 2; ++k) {
+                    const ParticleStore& store = systems[k]->store();
+                    ends[fresh][k].assign(store.data(), store.data() + store.stateSize());
+                }
+            }
+            bool same = ends[0][0] == ends[1][0] && ends[0][1] == ends[1][1];
+            printf("%10s %12c %12.3f %22s\n", solver ? "PCISPH" : "WCSPH", *integrator, 1000 * perStep,
+                   !whole ? "(steps split)" : same ? "yes" : "NO");
+        }
+    }
+    return 0;
+}
+
+struct Benchmark
+{
+    const char* name;
+    const char* usage;
+    int (*run)(int argc, char** argv);
+};
+
+const Benchmark BENCHMARKS[] = {
+    { "energy", "[timestep] [seconds]", benchmarkEnergyDrift },
+    { "cloth", "[max side] [evaluations]", benchmarkClothScaling },
+    { "kernels", "[distances] [repeats]", benchmarkKernels },
+    { "threads", "[max threads] [steps] [dimensions] [spacing] [depth]", benchmarkThreads },
+    { "pairs", "[steps] [dimensions] [spacing] [depth]", benchmarkSymmetricForces },
+    { "surface", "[max threads] [steps] [dimensions] [spacing] [depth]", benchmarkSurface },
+    { "vecmath", "[max side] [evaluations]", benchmarkVecmath },
+    { "allocations", "[steps] [threads]", benchmarkAllocations },
+    { "coupling", "[steps]", benchmarkCouplingCaches },
+};
+
+}
+
+int runBenchmark(int argc, char** argv)
+{
+    const int count = sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]);
+    if (argc >= 1) {
+        for (int k = 0; k < count; ++k) {
+            if (string(argv[0]) == BENCHMARKS[k].name) {
+                return BENCHMARKS[k].run(argc - 1, argv + 1);
+            }
+        }
+    }
+    printf("Available benchmarks:\n");
+    for (int k = 0; k < count; ++k) {
+        printf("       bench %s %s\n", BENCHMARKS[k].name, BENCHMARKS[k].usage);
+    }
+    return -1;
+}
@@ -0,0 +1,8 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Headless benchmarks, run as "a3 bench <name> [args]" without opening a
+// window. Returns the process exit code.
+int runBenchmark(int argc, char** argv);
+
+#endif
@@ -0,0 +1,208 @@
+#include "blocksparsematrix.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace
+{
+// 3x3 row-major helpers
+void invert3x3(const float* m, float* inv)
+{
+    float c00 = m[4]*m[8] - m[5]*m[7];
+    float c01 = m[5]*m[6] - m[3]*m[8];
+    float c02 = m[3]*m[7] - m[4]*m[6];
+    float det = m[0]*c00 + m[1]*c01 + m[2]*c02;
+    if (fabs(det) < 1e-20f) {
+        // fall back to plain Jacobi on a singular block
+        fill(inv, inv + 9, 0.0f);
+        for (int k = 0; k < 3; ++k) {
+            float d = m[4*k];
+            inv[4*k] = d != 0 ? 1.0f / d : 1.0f;
+        }
+        return;
+    }
+    float s = 1.0f / det;
+    inv[0] = c00 * s;
+    inv[1] = (m[2]*m[7] - m[1]*m[8]) * s;
+    inv[2] = (m[1]*m[5] - m[2]*m[4]) * s;
+    inv[3] = c01 * s;
+    inv[4] = (m[0]*m[8] - m[2]*m[6]) * s;
+    inv[5] = (m[2]*m[3] - m[0]*m[5]) * s;
+    inv[6] = c02 * s;
+    inv[7] = (m[1]*m[6] - m[0]*m[7]) * s;
+    inv[8] = (m[0]*m[4] - m[1]*m[3]) * s;
+}
+
+inline void multiplyAdd3x3(const float* m, const float* x, float* y)
+{
+    y[0] += m[0]*x[0] + m[1]*x[1] + m[2]*x[2];
+    y[1] += m[3]*x[0] + m[4]*x[1] + m[5]*x[2];
+    y[2] += m[6]*x[0] + m[7]*x[1] + m[8]*x[2];
+}
+
+double dot(const float* a, const float* b, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+}
+
+void BlockSparseMatrix::setPattern(int numBlockRows, const vector<pair<int, int> >& pairs)
+{
+    m_numBlockRows = numBlockRows;
+
+    // count blocks per row: the diagonal plus both halves of every pair
+    m_rowStart.assign(numBlockRows + 1, 0);
+    for (int i = 0; i < numBlockRows; ++i) {
+        m_rowStart[i + 1] = 1;
+    }
+    for (size_t k = 0; k < pairs.size(); ++k) {
+        ++m_rowStart[pairs[k].first + 1];
+        ++m_rowStart[pairs[k].second + 1];
+    }
+    for (int i = 0; i < numBlockRows; ++i) {
+        m_rowStart[i + 1] += m_rowStart[i];
+    }
+
+    m_columns.resize(m_rowStart[numBlockRows]);
+    vector<int> next(m_rowStart.begin(), m_rowStart.end() - 1);
+    for (int i = 0; i < numBlockRows; ++i) {
+        m_columns[next[i]++] = i;
+    }
+    for (size_t k = 0; k < pairs.size(); ++k) {
+        m_columns[next[pairs[k].first]++] = pairs[k].second;
+        m_columns[next[pairs[k].second]++] = pairs[k].first;
+    }
+
+    // sorted columns make find() a binary search
+    m_diagonal.resize(numBlockRows);
+    for (int i = 0; i < numBlockRows; ++i) {
+        sort(m_columns.begin() + m_rowStart[i], m_columns.begin() + m_rowStart[i + 1]);
+        m_diagonal[i] = find(i, i);
+    }
+
+    m_values.assign(9 * m_columns.size(), 0.0f);
+}
+
+void BlockSparseMatrix::copyPattern(const BlockSparseMatrix& other)
+{
+    m_numBlockRows = other.m_numBlockRows;
+    m_rowStart = other.m_rowStart;
+    m_columns = other.m_columns;
+    m_diagonal = other.m_diagonal;
+    m_values.assign(other.m_values.size(), 0.0f);
+}
+
+void BlockSparseMatrix::setZero()
+{
+    fill(m_values.begin(), m_values.end(), 0.0f);
+}
+
+int BlockSparseMatrix::find(int i, int j) const
+{
+    vector<int>::const_iterator begin = m_columns.begin() + m_rowStart[i];
+    vector<int>::const_iterator end = m_columns.begin() + m_rowStart[i + 1];
+    vector<int>::const_iterator it = lower_bound(begin, end, j);
+    if (it == end || *it != j) {
+        return -1;
+    }
+    return (int) (it - m_columns.begin());
+}
+
+void BlockSparseMatrix::assign(float a, const BlockSparseMatrix& x, float b, const BlockSparseMatrix& y)
+{
+    for (size_t k = 0; k < m_values.size(); ++k) {
+        m_values[k] = a * x.m_values[k] + b * y.m_values[k];
+    }
+}
+
+void BlockSparseMatrix::constrainRowAndColumn(int i)
+{
+    for (int k = m_rowStart[i]; k < m_rowStart[i + 1]; ++k) {
+        int j = m_columns[k];
+        fill(blockAt(k), blockAt(k) + 9, 0.0f);
+        // the pattern is symmetric, so (j, i) exists
+        int transposed = find(j, i);
+        fill(blockAt(transposed), blockAt(transposed) + 9, 0.0f);
+    }
+    float* d = diagonalBlock(i);
+    d[0] = d[4] = d[8] = 1.0f;
+}
+
+void BlockSparseMatrix::multiply(const float* x, float* y) const
+{
+    for (int i = 0; i < m_numBlockRows; ++i) {
+        float* yi = y + 3 * i;
+        yi[0] = yi[1] = yi[2] = 0.0f;
+        for (int k = m_rowStart[i]; k < m_rowStart[i + 1]; ++k) {
+            multiplyAdd3x3(blockAt(k), x + 3 * m_columns[k], yi);
+        }
+    }
+}
+
+int solveConjugateGradient(const BlockSparseMatrix& A, const float* b, float* x,
+                           float* scratch, float tolerance, int maxIterations)
+{
+    const int rows = A.numBlockRows();
+    const int n = 3 * rows;
+    float* r = scratch;
+    float* z = r + n;
+    float* p = z + n;
+    float* q = p + n;
+    float* inverseDiagonal = q + n;
+
+    for (int i = 0; i < rows; ++i) {
+        invert3x3(A.diagonalBlock(i), inverseDiagonal + 9 * i);
+    }
+
+    // r = b - A x
+    A.multiply(x, q);
+    for (int k = 0; k < n; ++k) {
+        r[k] = b[k] - q[k];
+    }
+
+    double threshold = tolerance * tolerance * dot(b, b, n);
+    double rr = dot(r, r, n);
+    int iteration = 0;
+    double rz = 0;
+
+    while (iteration < maxIterations && rr > threshold) {
+        // z = P^-1 r
+        for (int i = 0; i < rows; ++i) {
+            float* zi = z + 3 * i;
+            zi[0] = zi[1] = zi[2] = 0.0f;
+            multiplyAdd3x3(inverseDiagonal + 9 * i, r + 3 * i, zi);
+        }
+
+        double rzNew = dot(r, z, n);
+        if (iteration == 0) {
+            copy(z, z + n, p);
+        } else {
+            float beta = (float) (rzNew / rz);
+            for (int k = 0; k < n; ++k) {
+                p[k] = z[k] + beta * p[k];
+            }
+        }
+        rz = rzNew;
+
+        A.multiply(p, q);
+        double pq = dot(p, q, n);
+        if (pq <= 0) {
+            // A is not positive definite along p; stop with what we have
+            break;
+        }
+        float alpha = (float) (rz / pq);
+        for (int k = 0; k < n; ++k) {
+            x[k] += alpha * p[k];
+            r[k] -= alpha * q[k];
+        }
+        rr = dot(r, r, n);
+        ++iteration;
+    }
+    return iteration;
+}
@@ -0,0 +1,62 @@
+#ifndef BLOCKSPARSEMATRIX_H
+#define BLOCKSPARSEMATRIX_H
+
+#include <utility>
+#include <vector>
+
+// Square sparse matrix of 3x3 blocks in compressed block-row form, one
+// block row per particle. Vectors it acts on hold 3 floats per particle
+// (x, y, z interleaved). The pattern is structurally symmetric and always
+// contains the diagonal.
+class BlockSparseMatrix
+{
+public:
+    BlockSparseMatrix() : m_numBlockRows(0) {}
+
+    // sets up the pattern for numBlockRows particles with a block at (i, i)
+    // and at (i, j), (j, i) for every pair. All values start at zero.
+    void setPattern(int numBlockRows, const std::vector<std::pair<int, int> >& pairs);
+    // takes over the pattern of other, with zero values
+    void copyPattern(const BlockSparseMatrix& other);
+
+    int numBlockRows() const { return m_numBlockRows; }
+    int numBlocks() const { return (int) m_columns.size(); }
+
+    void setZero();
+
+    // offset of block (i, j) for use with blockAt; -1 if not in the pattern
+    int find(int i, int j) const;
+    float* blockAt(int offset) { return &m_values[9 * offset]; }
+    const float* blockAt(int offset) const { return &m_values[9 * offset]; }
+    float* diagonalBlock(int i) { return blockAt(m_diagonal[i]); }
+    const float* diagonalBlock(int i) const { return blockAt(m_diagonal[i]); }
+
+    // this = a * x + b * y; x and y must share this matrix's pattern
+    void assign(float a, const BlockSparseMatrix& x, float b, const BlockSparseMatrix& y);
+
+    // replaces block row and column i with the identity, decoupling
+    // particle i from the system (used for pinned particles)
+    void constrainRowAndColumn(int i);
+
+    // y = this * x
+    void multiply(const float* x, float* y) const;
+
+private:
+    int m_numBlockRows;
+    std::vector<int> m_rowStart;
+    std::vector<int> m_columns;
+    std::vector<int> m_diagonal;
+    std::vector<float> m_values;
+};
+
+// Solves A x = b with conjugate gradients preconditioned by the inverses
+// of A's diagonal blocks. A must be symmetric positive definite. x holds
+// the initial guess and receives the solution. scratch must point to
+// SOLVER_SCRATCH_PER_ROW * numBlockRows floats. Iterates until the
+// residual norm drops below tolerance * |b|. Returns the iteration count.
+const int SOLVER_SCRATCH_PER_ROW = 4 * 3 + 9;
+
+int solveConjugateGradient(const BlockSparseMatrix& A, const float* b, float* x,
+                           float* scratch, float tolerance, int maxIterations);
+
+#endif
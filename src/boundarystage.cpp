@@ -0,0 +1,254 @@
+#include "boundarystage.h"
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BOUNDARYSTAGE_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+
+// Reflects the particles in contact with one plane. Only the axes where
+// the normal is nonzero are passed: pos[k], vel[k] and normal[k] for
+// k < axes. Writes the contact slots to contacts unless it is null and
+// returns their number.
+typedef int (*ReflectFn)(float* const* pos, float* const* vel, const float* normal, int axes,
+                         float offset, float restitution, int begin, int end, int* contacts);
+
+// ---- portable reference version; also used for the vector tails ----
+
+int reflectScalar(float* const* pos, float* const* vel, const float* normal, int axes,
+                  float offset, float restitution, int begin, int end, int* contacts)
+{
+    int count = 0;
+    for (int i = begin; i < end; ++i) {
+        float distance = normal[0] * pos[0][i];
+        for (int k = 1; k < axes; ++k) {
+            distance += normal[k] * pos[k][i];
+        }
+        if (!(distance <= offset)) {
+            continue;
+        }
+        float vn = normal[0] * vel[0][i];
+        for (int k = 1; k < axes; ++k) {
+            vn += normal[k] * vel[k][i];
+        }
+        float reflected = restitution * fabs(vn);
+        // tangential part first, so that axis-aligned planes set the
+        // velocity component exactly
+        for (int k = 0; k < axes; ++k) {
+            vel[k][i] = (vel[k][i] - normal[k] * vn) + normal[k] * reflected;
+        }
+        if (contacts) {
+            contacts[count] = i;
+        }
+        ++count;
+    }
+    return count;
+}
+
+#ifdef BOUNDARYSTAGE_X86
+
+// appends the lanes set in mask, starting at slot i
+inline int appendContacts(int mask, int i, int* contacts, int count)
+{
+    for (; mask; mask &= mask - 1) {
+        if (contacts) {
+            contacts[count] = i + __builtin_ctz(mask);
+        }
+        ++count;
+    }
+    return count;
+}
+
+int reflectSse2(float* const* pos, float* const* vel, const float* normal, int axes,
+                float offset, float restitution, int begin, int end, int* contacts)
+{
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    const __m128 vOffset = _mm_set1_ps(offset);
+    const __m128 vRestitution = _mm_set1_ps(restitution);
+    __m128 vNormal[3];
+    for (int k = 0; k < axes; ++k) {
+        vNormal[k] = _mm_set1_ps(normal[k]);
+    }
+    int count = 0;
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 distance = _mm_mul_ps(vNormal[0], _mm_loadu_ps(pos[0] + i));
+        for (int k = 1; k < axes; ++k) {
+            distance = _mm_add_ps(distance, _mm_mul_ps(vNormal[k], _mm_loadu_ps(pos[k] + i)));
+        }
+        __m128 inContact = _mm_cmple_ps(distance, vOffset);
+        int mask = _mm_movemask_ps(inContact);
+        if (!mask) {
+            continue;
+        }
+        __m128 v[3];
+        v[0] = _mm_loadu_ps(vel[0] + i);
+        __m128 vn = _mm_mul_ps(vNormal[0], v[0]);
+        for (int k = 1; k < axes; ++k) {
+            v[k] = _mm_loadu_ps(vel[k] + i);
+            vn = _mm_add_ps(vn, _mm_mul_ps(vNormal[k], v[k]));
+        }
+        __m128 reflected = _mm_mul_ps(vRestitution, _mm_andnot_ps(signBit, vn));
+        for (int k = 0; k < axes; ++k) {
+            __m128 r = _mm_add_ps(_mm_sub_ps(v[k], _mm_mul_ps(vNormal[k], vn)),
+                                  _mm_mul_ps(vNormal[k], reflected));
+            r = _mm_or_ps(_mm_and_ps(inContact, r), _mm_andnot_ps(inContact, v[k]));
+            _mm_storeu_ps(vel[k] + i, r);
+        }
+        count = appendContacts(mask, i, contacts, count);
+    }
+    return count + reflectScalar(pos, vel, normal, axes, offset, restitution, i, end,
+                                 contacts ? contacts + count : nullptr);
+}
+
+__attribute__((target("avx2")))
+int reflectAvx2(float* const* pos, float* const* vel, const float* normal, int axes,
+                float offset, float restitution, int begin, int end, int* contacts)
+{
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    const __m256 vOffset = _mm256_set1_ps(offset);
+    const __m256 vRestitution = _mm256_set1_ps(restitution);
+    __m256 vNormal[3];
+    for (int k = 0; k < axes; ++k) {
+        vNormal[k] = _mm256_set1_ps(normal[k]);
+    }
+    int count = 0;
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 distance = _mm256_mul_ps(vNormal[0], _mm256_loadu_ps(pos[0] + i));
+        for (int k = 1; k < axes; ++k) {
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(vNormal[k], _mm256_loadu_ps(pos[k] + i)));
+        }
+        __m256 inContact = _mm256_cmp_ps(distance, vOffset, _CMP_LE_OQ);
+        int mask = _mm256_movemask_ps(inContact);
+        if (!mask) {
+            continue;
+        }
+        __m256 v[3];
+        v[0] = _mm256_loadu_ps(vel[0] + i);
+        __m256 vn = _mm256_mul_ps(vNormal[0], v[0]);
+        for (int k = 1; k < axes; ++k) {
+            v[k] = _mm256_loadu_ps(vel[k] + i);
+            vn = _mm256_add_ps(vn, _mm256_mul_ps(vNormal[k], v[k]));
+        }
+        __m256 reflected = _mm256_mul_ps(vRestitution, _mm256_andnot_ps(signBit, vn));
+        for (int k = 0; k < axes; ++k) {
+            __m256 r = _mm256_add_ps(_mm256_sub_ps(v[k], _mm256_mul_ps(vNormal[k], vn)),
+                                     _mm256_mul_ps(vNormal[k], reflected));
+            _mm256_storeu_ps(vel[k] + i, _mm256_blendv_ps(v[k], r, inContact));
+        }
+        count = appendContacts(mask, i, contacts, count);
+    }
+    return count + reflectScalar(pos, vel, normal, axes, offset, restitution, i, end,
+                                 contacts ? contacts + count : nullptr);
+}
+
+#endif
+
+ReflectFn pickReflect()
+{
+#ifdef BOUNDARYSTAGE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return reflectAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return reflectSse2;
+    }
+#endif
+    return reflectScalar;
+}
+
+// uniform in [-1, 1), from the particle ID and pass number
+float scatterSample(int id, long pass)
+{
+    uint32_t h = (uint32_t) id * 0x9e3779b1u ^ (uint32_t) pass * 0x85ebca77u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (2.0f / (1 << 24)) - 1.0f;
+}
+
+}
+
+BoundaryPlane::BoundaryPlane(const Vector3f& normal, float offset, float restitution, float scatter)
+    : normal(normal), offset(offset), restitution(restitution), scatter(scatter)
+{
+}
+
+BoundaryStage::BoundaryStage()
+    : m_passes(0), m_lastContacts(0)
+{
+}
+
+void BoundaryStage::setBox(const Vector3f& boxMin, const Vector3f& boxMax, int dims,
+                           float restitution, float scatter)
+{
+    m_planes.clear();
+    for (int c = 0; c < dims; ++c) {
+        Vector3f normal(0, 0, 0);
+        normal[c] = 1;
+        m_planes.push_back(BoundaryPlane(normal, boxMin[c], restitution, scatter));
+        m_planes.push_back(BoundaryPlane(-normal, -boxMax[c], restitution, scatter));
+    }
+}
+
+void BoundaryStage::apply(ParticleStore& store)
+{
+    static const ReflectFn reflect = pickReflect();
+    const int n = store.size();
+    ++m_passes;
+    m_lastContacts = 0;
+    for (size_t p = 0; p < m_planes.size(); ++p) {
+        const BoundaryPlane& plane = m_planes[p];
+        float* pos[3];
+        float* vel[3];
+        float normal[3];
+        int axes = 0;
+        for (int c = 0; c < 3; ++c) {
+            if (plane.normal[c] != 0) {
+                pos[axes] = store.channel(PX + c);
+                vel[axes] = store.channel(VX + c);
+                normal[axes] = plane.normal[c];
+                ++axes;
+            }
+        }
+        if (axes == 0) {
+            continue;
+        }
+
+        int* contacts = nullptr;
+        if (plane.scatter != 0) {
+            m_contacts.resize(n);
+            contacts = m_contacts.data();
+        }
+        int count = reflect(pos, vel, normal, axes, plane.offset, plane.restitution, 0, n, contacts);
+        m_lastContacts += count;
+        if (!contacts) {
+            continue;
+        }
+
+        // the wall direction is the normal turned a quarter in its plane
+        // with z, or with x for normals along z
+        Vector3f tangent = Vector3f::cross(plane.normal, Vector3f(0, 0, 1));
+        if (tangent.absSquared() == 0) {
+            tangent = Vector3f::cross(plane.normal, Vector3f(1, 0, 0));
+        }
+        tangent.normalize();
+        for (int k = 0; k < count; ++k) {
+            int i = contacts[k];
+            float r = scatterSample(store.id(i), m_passes);
+            Vector3f kick = plane.scatter * (1 - fabs(r)) * plane.normal + 0.5f * plane.scatter * r * tangent;
+            store.setVelocity(i, store.velocity(i) + kick);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef BOUNDARYSTAGE_H
+#define BOUNDARYSTAGE_H
+
+#include <vector>
+
+#include "particlestore.h"
+
+// Half-space wall: particles with dot(normal, position) <= offset are in
+// contact. normal must be unit length.
+struct BoundaryPlane
+{
+    BoundaryPlane(const Vector3f& normal, float offset, float restitution = 1.0f, float scatter = 0.0f);
+
+    Vector3f normal;
+    float offset;
+    // a contact sets the normal velocity to restitution * |normal velocity|,
+    // so particles always leave the wall
+    float restitution;
+    // random kick on contact: up to scatter along the normal and up to
+    // scatter / 2 either way along the wall, keeping particles from
+    // stacking on it
+    float scatter;
+};
+
+// Collision stage applied to a ParticleStore in place between steps. The
+// planes are processed in order, each in one vectorized pass over the
+// position and velocity channels it touches (AVX2 or SSE2 on x86, plain
+// C++ elsewhere, rounding identically). Scatter is drawn from a hash of
+// the particle's stable ID and the pass number, so it does not depend on
+// the slot order or on rand().
+class BoundaryStage
+{
+public:
+    BoundaryStage();
+
+    void setPlanes(const std::vector<BoundaryPlane>& planes) { m_planes = planes; }
+    void addPlane(const BoundaryPlane& plane) { m_planes.push_back(plane); }
+    const std::vector<BoundaryPlane>& planes() const { return m_planes; }
+    // replaces the planes by the six inward-facing walls of a box; in 2D
+    // (dims == 2) the z walls are left out
+    void setBox(const Vector3f& boxMin, const Vector3f& boxMax, int dims,
+                float restitution = 1.0f, float scatter = 0.0f);
+
+    void apply(ParticleStore& store);
+
+    long passes() const { return m_passes; }
+    // contacts resolved in the last pass, summed over the planes
+    int lastContacts() const { return m_lastContacts; }
+
+private:
+    std::vector<BoundaryPlane> m_planes;
+    long m_passes;
+    int m_lastContacts;
+    // slots in contact with the current plane, for scattering
+    std::vector<int> m_contacts;
+};
+
+#endif
@@ -1,187 +1,231 @@
 #include "clothsystem.h"
+#include "blocksparsematrix.h"
 #include "camera.h"
 #include "vertexrecorder.h"
 #include <iostream>
 
 using namespace std;
 
- // your system should at least contain 8x8 particles.
-const int W = 8;
-const int H = 8;
-const float MASS = 0.1;
-const float K_DRAG = 0.5;
-const float K_STRUCTURAL_SPRING = 50.0;
-const float K_SHEAR_SPRING = 50.0;
-const float K_FLEXION_SPRING = 50.0;
-const float STRUCTURAL_REST_LENGTH = 0.2;
-const float SHEAR_REST_LENGTH = sqrt(pow(0.2,2)*2);
-const float FLEXION_REST_LENGTH = 0.4;
 const float GRAVITY = -9.8;
+// particles are drawn as spheres only up to this many
+const int MAX_DRAWN_SPHERES = 4096;
 
-ClothSystem::ClothSystem()
+ClothParams::ClothParams()
+    // your system should at least contain 8x8 particles.
+    : width(8), height(8), spacing(0.2f), origin(0.4f, 1, 0),
+      mass(0.1f), drag(0.5f),
+      structuralStiffness(50.0f), shearStiffness(50.0f), flexionStiffness(50.0f),
+      pins(PIN_TOP_CORNERS)
 {
-    // TODO 5. Initialize m_vVecState with cloth particles. 
-    // You can again use rand_uniform(lo, hi) to make things a bit more interesting
-  vector<Vector3f> initialState;
+}
 
-  Vector3f position(0.4, 1, 0);
-  Vector3f velocity(0, 0, 0);
+ClothSystem::ClothSystem(const ClothParams& params)
+    : m_params(params)
+{
+  const int W = params.width;
+  const int H = params.height;
+  m_store.resize(W*H);
+  m_store.enableAttribute(ParticleStore::MASS, params.mass);
+  m_store.enableAttribute(ParticleStore::PINNED, 0.0f);
 
   for (int i=0; i<W*H; ++i) {
-    if (i%W == 0) {
-      position = Vector3f(0.4, 1, 0) - (i/W)*Vector3f(0, 0.2, 0);
-    } else {
-      position += Vector3f(0.2, 0, 0);
-    }
+    Vector3f position = params.origin + params.spacing * Vector3f(i%W, -(i/W), 0);
+    m_store.setPosition(i, position);
+    m_store.setVelocity(i, Vector3f(0, 0, 0));
+  }
 
-    initialState.push_back(position);
-    initialState.push_back(velocity);
+  float* pinned = m_store.attribute(ParticleStore::PINNED);
+  if (params.pins == ClothParams::PIN_TOP_CORNERS) {
+    pinned[0] = 1.0f;
+    pinned[W-1] = 1.0f;
+  } else if (params.pins == ClothParams::PIN_TOP_EDGE) {
+    for (int i=0; i<W; ++i) {
+      pinned[i] = 1.0f;
+    }
+  }
+  for (int k=0; k<(int) params.extraPins.size(); ++k) {
+    int i = params.extraPins[k];
+    if (i >= 0 && i < W*H) {
+      pinned[i] = 1.0f;
+    }
   }
 
-  setState(initialState);
+  buildSprings();
+}
+
+void ClothSystem::SpringList::add(int i, int j, float rest, float k)
+{
+  a.push_back(i);
+  b.push_back(j);
+  restLength.push_back(rest);
+  stiffness.push_back(k);
 }
 
+void ClothSystem::buildSprings()
+{
+  const int W = m_params.width;
+  const int H = m_params.height;
+  const float structuralRest = m_params.spacing;
+  const float shearRest = m_params.spacing * sqrt(2.0f);
+  const float flexionRest = 2 * m_params.spacing;
+  const float kStructural = m_params.structuralStiffness;
+  const float kShear = m_params.shearStiffness;
+  const float kFlexion = m_params.flexionStiffness;
+
+  // at most six springs start at each particle
+  m_springs = SpringList();
+  m_springs.a.reserve(6*W*H);
+  m_springs.b.reserve(6*W*H);
+  m_springs.restLength.reserve(6*W*H);
+  m_springs.stiffness.reserve(6*W*H);
 
-std::vector<Vector3f> ClothSystem::evalF(std::vector<Vector3f> state)
+  for (int i=0; i<W*H; ++i) {
+    int col = i%W;
+    int row = i/W;
+
+    // structural: right and down neighbors
+    if (col < W-1) m_springs.add(i, i+1, structuralRest, kStructural);
+    if (row < H-1) m_springs.add(i, i+W, structuralRest, kStructural);
+
+    // shear: both diagonals of the cell below and to the right
+    if (col < W-1 && row < H-1) {
+      m_springs.add(i, i+W+1, shearRest, kShear);
+      m_springs.add(i+1, i+W, shearRest, kShear);
+    }
+
+    // flexion: two to the right and two down
+    if (col < W-2) m_springs.add(i, i+2, flexionRest, kFlexion);
+    if (row < H-2) m_springs.add(i, i+2*W, flexionRest, kFlexion);
+  }
+}
+
+void ClothSystem::evalForceJacobians(const StateView& state,
+    BlockSparseMatrix& dfdx, BlockSparseMatrix& dfdv)
 {
-  //cerr << "eval f start" << endl;
-    std::vector<Vector3f> f;
-    // TODO 5. implement evalF
-    // - gravity
-    // - viscous drag
-    // - structural springs
-    // - shear springs
-    // - flexion springs
-    springs.clear();
-
-    for (int i=0; i<(int) state.size()/2; ++i) {
-      Vector3f pointi = getPositionAt(state, i);
-      Vector3f velocity = getVelocityAt(state, i);
-
-      Vector3f pointj;
-      Vector3f distance;
-
-      Vector3f fGravity(0.0, MASS * GRAVITY, 0.0);
-      Vector3f fDrag = -K_DRAG * velocity;
-      Vector3f fStructuralLeft = Vector3f();
-      Vector3f fStructuralRight = Vector3f();
-      Vector3f fStructuralUp = Vector3f();
-      Vector3f fStructuralDown = Vector3f();
-      Vector3f fShearUpLeft = Vector3f();
-      Vector3f fShearUpRight = Vector3f();
-      Vector3f fShearDownLeft = Vector3f();
-      Vector3f fShearDownRight = Vector3f();
-      Vector3f fFlexionLeft = Vector3f();
-      Vector3f fFlexionRight = Vector3f();
-      Vector3f fFlexionUp = Vector3f();
-      Vector3f fFlexionDown = Vector3f();
-     
-      // if particle isn't in the first column, there's a structural spring to the left
-      if (i%W != 0) {
-	pointj = getPositionAt(state, i-1);
-	distance = pointi - pointj;
-	fStructuralLeft = -K_STRUCTURAL_SPRING * (distance.abs() - STRUCTURAL_REST_LENGTH) * (distance / distance.abs());
-	springs.push_back(Vector2f(i, i-1));
-
-	// if particle isn't in the first column or top row, there's a shear spring up and left
-	if (i >= W) {
-	  pointj = getPositionAt(state, i-W-1);
-	  distance = pointi - pointj;
-	  fShearUpLeft = -K_SHEAR_SPRING * (distance.abs() - SHEAR_REST_LENGTH) * (distance / distance.abs());
-	  springs.push_back(Vector2f(i, i-W-1));
-	}
-
-	// if particle isn't in the first column or bottom row, there's a shear spring down and left
-	if (i < W*(H-1)) {
-	  pointj = getPositionAt(state, i+W-1);
-	  distance = pointi - pointj;
-	  fShearDownLeft = -K_SHEAR_SPRING * (distance.abs() - SHEAR_REST_LENGTH) * (distance / distance.abs());
-	  springs.push_back(Vector2f(i, i+W-1));
-	}
-
-	// if particle isn't in first or second column, there's a horizontal flexion spring to the left
-	if (i%W != 1) {
-	  pointj = getPositionAt(state, i-2);
-	  distance = pointi - pointj;
-	  fFlexionLeft = -K_FLEXION_SPRING * (distance.abs() - FLEXION_REST_LENGTH) * (distance / distance.abs());
-	  springs.push_back(Vector2f(i, i-2));
-	}
+  if (dfdx.numBlockRows() != state.numParticles()) {
+    vector<pair<int, int> > pairs;
+    pairs.reserve(m_springs.size());
+    for (int k=0; k<m_springs.size(); ++k) {
+      pairs.push_back(make_pair(m_springs.a[k], m_springs.b[k]));
+    }
+    dfdx.setPattern(state.numParticles(), pairs);
+    dfdv.copyPattern(dfdx);
+  }
+  dfdx.setZero();
+  dfdv.setZero();
+
+  // viscous drag f = -drag v
+  for (int i=0; i<state.numParticles(); ++i) {
+    float* d = dfdv.diagonalBlock(i);
+    d[0] = d[4] = d[8] = -m_params.drag;
+  }
+
+  // spring f_a = -k (|d| - L) d/|d| with d = x_a - x_b. Its derivative
+  // -k [ (1 - L/|d|) (I - u u^T) + u u^T ] is clamped to the stretched
+  // regime so that -df/dx stays positive semidefinite.
+  for (int k=0; k<m_springs.size(); ++k) {
+    int a = m_springs.a[k];
+    int b = m_springs.b[k];
+    Vector3f d = state.positionAt(a) - state.positionAt(b);
+    float length = d.abs();
+    if (length <= 0) {
+      continue;
+    }
+    Vector3f u = d / length;
+    float geometric = max(0.0f, 1.0f - m_springs.restLength[k] / length);
+    float stiffness = m_springs.stiffness[k];
+
+    float K[9];
+    for (int r=0; r<3; ++r) {
+      for (int c=0; c<3; ++c) {
+        float uu = u[r] * u[c];
+        K[3*r + c] = -stiffness * (geometric * ((r == c ? 1.0f : 0.0f) - uu) + uu);
       }
+    }
+
+    float* aa = dfdx.diagonalBlock(a);
+    float* bb = dfdx.diagonalBlock(b);
+    float* ab = dfdx.blockAt(dfdx.find(a, b));
+    float* ba = dfdx.blockAt(dfdx.find(b, a));
+    for (int e=0; e<9; ++e) {
+      aa[e] += K[e];
+      bb[e] += K[e];
+      ab[e] -= K[e];
+      ba[e] -= K[e];
+    }
+  }
+}
+
 
-      // if particle isn't in the last column, there's a structural spring to the right
-      if (i%W != W-1) {
-	pointj = getPositionAt(state, i+1);
-	distance = pointi - pointj;
-	fStructuralRight = -K_STRUCTURAL_SPRING * (distance.abs() - STRUCTURAL_REST_LENGTH) * (distance / distance.abs());
-	
-	// if particle isn't in the last column or top row, there's a shear spring up and right
-	if (i >= W) {
-	  pointj = getPositionAt(state, i-W+1);
-	  distance = pointi - pointj;
-	  fShearUpRight = -K_SHEAR_SPRING * (distance.abs() - SHEAR_REST_LENGTH) * (distance / distance.abs());
-	}
-
-	// if particle isn't in the last column or bottom row, there's a shear spring down and right
-	if (i < W*(H-1)) {
-	  pointj = getPositionAt(state, i+W+1);
-	  distance = pointi - pointj;
-	  fShearDownRight = -K_SHEAR_SPRING * (distance.abs() - SHEAR_REST_LENGTH) * (distance / distance.abs());
-	}
-	
-	// if particle isn't in last or next-to-last column, there's a horizontal flexion spring to the right
-	if (i%W != W-2) {
-	  pointj = getPositionAt(state, i+2);
-	  distance = pointi - pointj;
-	  fFlexionRight = -K_FLEXION_SPRING * (distance.abs() - FLEXION_REST_LENGTH) * (distance / distance.abs());
-	}
+void ClothSystem::evalF(const StateView& state, DerivativeView& f)
+{
+    // gravity, viscous drag, the structural, shear and flexion springs,
+    // and any external forces.
+    // Forces are accumulated straight into the dv/dt channels and divided
+    // by the mass at the end.
+    const int n = state.numParticles();
+    const float* mass = m_store.attribute(ParticleStore::MASS);
+    const float* pinned = m_store.attribute(ParticleStore::PINNED);
+    const float* x[3] = { state.channel(PX), state.channel(PY), state.channel(PZ) };
+    float* force[3] = { f.channel(VX), f.channel(VY), f.channel(VZ) };
+    const float drag = m_params.drag;
+
+    for (int c=0; c<3; ++c) {
+      const float* v = state.channel(VX + c);
+      float* dx = f.channel(PX + c);
+      for (int i=0; i<n; ++i) {
+        dx[i] = v[i];
+        force[c][i] = -drag * v[i];
       }
+    }
+    for (int i=0; i<n; ++i) {
+      force[1][i] += mass[i] * GRAVITY;
+    }
 
-      // if particle isn't in the top row, there's a structural spring up
-      if (i >= W) {
-	pointj = getPositionAt(state, i-W);
-	distance = pointi - pointj;
-	fStructuralUp = -K_STRUCTURAL_SPRING * (distance.abs() - STRUCTURAL_REST_LENGTH) * (distance / distance.abs());
-	springs.push_back(Vector2f(i, i-W));
-	
-	// if particle isn't in top or second row, there's a vertical flexion spring up
-	if (i >= 2*W) {
-	  pointj = getPositionAt(state, i-2*W);
-	  distance = pointi - pointj;
-	  fFlexionUp = -K_FLEXION_SPRING * (distance.abs() - FLEXION_REST_LENGTH) * (distance / distance.abs());
-	  springs.push_back(Vector2f(i, i-2*W));
-        }
+    // each spring once, equal and opposite on its two ends
+    const int* springA = m_springs.a.data();
+    const int* springB = m_springs.b.data();
+    const float* restLength = m_springs.restLength.data();
+    const float* stiffness = m_springs.stiffness.data();
+    for (int k=0; k<m_springs.size(); ++k) {
+      int a = springA[k];
+      int b = springB[k];
+      float d[3];
+      for (int c=0; c<3; ++c) {
+        d[c] = x[c][a] - x[c][b];
       }
-      
-      // if particle isn't in the bottom row, there's a structural spring down
-      if (i < W*(H-1)) {
-	pointj = getPositionAt(state, i+W);
-	distance = pointi - pointj;
-	fStructuralDown = -K_STRUCTURAL_SPRING * (distance.abs() - STRUCTURAL_REST_LENGTH) * (distance / distance.abs());
-	
-	// if particle isn't in last or next-to-last row, there's a vertical flexion spring down
-	if (i < W*(H-2)) {
-	  pointj = getPositionAt(state, i+2*W);
-	  distance = pointi - pointj;
-	  fFlexionDown = -K_FLEXION_SPRING * (distance.abs() - FLEXION_REST_LENGTH) * (distance / distance.abs());
-	}
+      float length = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+      if (length <= 0) {
+        continue;
       }
-      
-      Vector3f totalFStructural = fStructuralLeft + fStructuralRight + fStructuralUp + fStructuralDown;
-      Vector3f totalFShear = fShearUpLeft + fShearUpRight + fShearDownLeft + fShearDownRight;
-      Vector3f totalFFlexion = fFlexionLeft + fFlexionRight + fFlexionUp + fFlexionDown;
-      Vector3f totalForce = fGravity + fDrag + totalFStructural + totalFShear + totalFFlexion;
-      Vector3f acceleration = totalForce / MASS;
-      
-      if (i == 0 || i == W-1) {
-	velocity = Vector3f();
-	acceleration = Vector3f();
+      float scale = -stiffness[k] * (length - restLength[k]) / length;
+      for (int c=0; c<3; ++c) {
+        force[c][a] += scale * d[c];
+        force[c][b] -= scale * d[c];
       }
+    }
 
-      f.push_back(velocity);
-      f.push_back(acceleration);
+    if (hasExternalForces(n)) {
+      for (int i=0; i<n; ++i) {
+        for (int c=0; c<3; ++c) {
+          force[c][i] += m_externalForces[3*i + c];
+        }
+      }
+    }
+
+    for (int i=0; i<n; ++i) {
+      if (pinned[i] != 0.0f) {
+        for (int c=0; c<3; ++c) {
+          f.channel(PX + c)[i] = 0;
+          force[c][i] = 0;
+        }
+      } else {
+        float invMass = 1.0f / mass[i];
+        for (int c=0; c<3; ++c) {
+          force[c][i] *= invMass;
+        }
+      }
     }
-    //cerr << "eval f done" << endl;
-    return f;
 }
 
 
@@ -238,22 +282,24 @@ void ClothSystem::draw(GLProgram& gl)
     gl.enableLighting(); // reset to default lighting model
     // EXAMPLE END*/
 
-    vector<Vector3f> currentState = getState();
+    StateView currentState = getRenderView();
 
-    for (int i=0; i<(int) currentState.size()/2; ++i) {
-      gl.updateModelMatrix(Matrix4f::translation(getPositionAt(currentState, i)));
-      drawSphere(0.04f, 8, 8);
+    if (currentState.numParticles() <= MAX_DRAWN_SPHERES) {
+      for (int i=0; i<currentState.numParticles(); ++i) {
+        gl.updateModelMatrix(Matrix4f::translation(currentState.positionAt(i)));
+        drawSphere(0.04f, 8, 8);
+      }
     }
 
     gl.disableLighting();
     gl.updateModelMatrix(Matrix4f::identity());
     VertexRecorder rec;
     Vector3f O(0.4f, 1, 0);
-    vector<Vector2f> springs = getSprings();
+    const SpringList& springs = getSprings();
 
-    for (int i=0; i<(int) springs.size(); ++i) {
-      rec.record(getPositionAt(currentState, springs.at(i).x()), CLOTH_COLOR);
-      rec.record(getPositionAt(currentState, springs.at(i).y()), CLOTH_COLOR);
+    for (int k=0; k<springs.size(); ++k) {
+      rec.record(currentState.positionAt(springs.a[k]), CLOTH_COLOR);
+      rec.record(currentState.positionAt(springs.b[k]), CLOTH_COLOR);
     }
     
     glLineWidth(3.0f);
@@ -5,24 +5,68 @@
 
 #include "particlesystem.h"
 
+// Layout and material of a rectangular sheet. Particles are numbered row
+// by row starting at origin, with columns running along +x and rows
+// along -y. Rest lengths follow from spacing.
+struct ClothParams
+{
+    enum Pins { PIN_TOP_CORNERS, PIN_TOP_EDGE, PIN_NONE };
+
+    ClothParams();
+
+    int width;
+    int height;
+    float spacing;
+    Vector3f origin;
+    float mass;
+    float drag;
+    float structuralStiffness;
+    float shearStiffness;
+    float flexionStiffness;
+    Pins pins;
+    // particle indices pinned in addition to pins
+    std::vector<int> extraPins;
+};
+
 class ClothSystem : public ParticleSystem
 {
     ///ADD MORE FUNCTION AND FIELDS HERE
 public:
-    ClothSystem();
+    explicit ClothSystem(const ClothParams& params = ClothParams());
+
+    const ClothParams& params() const { return m_params; }
 
     // evalF is called by the integrator at least once per time step
-    std::vector<Vector3f> evalF(std::vector<Vector3f> state) override;
+    void evalF(const StateView& state, DerivativeView& f) override;
+    using ParticleSystem::evalF;
+
+    // analytic spring and drag Jacobians, used by the implicit integrator
+    bool hasForceJacobians() const override { return true; }
+    void evalForceJacobians(const StateView& state,
+        BlockSparseMatrix& dfdx, BlockSparseMatrix& dfdv) override;
 
     // draw is called once per frame
     void draw(GLProgram& ctx);
 
     // inherits
-    // std::vector<Vector3f> m_vVecState;
+    // ParticleStore m_store;
+
+    // every spring of the cloth, each particle pair listed once, as
+    // parallel arrays indexed by spring
+    struct SpringList {
+        std::vector<int> a, b;
+        std::vector<float> restLength;
+        std::vector<float> stiffness;
+
+        int size() const { return (int) a.size(); }
+        void add(int i, int j, float rest, float k);
+    };
+    const SpringList& getSprings() const { return m_springs; }
 
 private:
-	std::vector<Vector2f> springs;
-	std::vector<Vector2f> getSprings() { return springs; };
+	ClothParams m_params;
+	SpringList m_springs;
+	void buildSprings();
 };
 
 
@@ -0,0 +1,39 @@
+#include "coupledworld.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "clothsystem.h"
+#include "timestepper.h"
+#include "watersystem.h"
+
+using namespace std;
+
+CoupledWorld::CoupledWorld(ClothSystem* cloth, WaterSystem* water, float waterParticleMass)
+    : m_cloth(cloth), m_water(water), m_waterParticleMass(waterParticleMass), m_steps(0)
+{
+    m_systems.push_back(cloth);
+    m_systems.push_back(water);
+    m_contactRadius = max(cloth->params().spacing, water->params().particleSpacing);
+}
+
+void CoupledWorld::step(TimeStepper* clothStepper, TimeStepper* waterStepper, float h)
+{
+    m_water->coupleBoundary(m_cloth->getStateView(), m_contactRadius, m_waterParticleMass, m_reaction);
+    m_cloth->setExternalForces(m_reaction);
+    clothStepper->takeStep(m_cloth, h);
+    waterStepper->takeStep(m_water, h);
+    ++m_steps;
+}
+
+void CoupledWorld::printStats(ostream& out) const
+{
+    float largest = 0;
+    for (size_t k = 0; k + 2 < m_reaction.size(); k += 3) {
+        float f2 = m_reaction[k] * m_reaction[k] + m_reaction[k + 1] * m_reaction[k + 1] +
+                   m_reaction[k + 2] * m_reaction[k + 2];
+        largest = max(largest, f2);
+    }
+    out << "coupled world: " << m_steps << " steps, contact radius " << m_contactRadius
+        << ", largest force of the water on a cloth particle " << sqrt(largest) << endl;
+}
@@ -0,0 +1,49 @@
+#ifndef COUPLEDWORLD_H
+#define COUPLEDWORLD_H
+
+#include <ostream>
+#include <vector>
+
+class ClothSystem;
+class ParticleSystem;
+class TimeStepper;
+class WaterSystem;
+
+// A cloth and a body of water stepped together. The cloth particles act
+// as boundary particles for the water (see WaterSystem::coupleBoundary),
+// and the water pushes back on them. The cloth is held where it is at the
+// start of each step while the water's densities and pressures take it
+// in; the forces on the cloth come from that start state and are held
+// over the step. Each system is then integrated by its own stepper.
+class CoupledWorld
+{
+public:
+    // waterParticleMass is the mass of a water particle in cloth units
+    CoupledWorld(ClothSystem* cloth, WaterSystem* water, float waterParticleMass = 0.01f);
+
+    // the systems, for a FixedStepScheduler
+    const std::vector<ParticleSystem*>& systems() const { return m_systems; }
+
+    // water within this distance of a cloth particle is pushed away: the
+    // larger of the two spacings, so water cannot pass between cloth
+    // particles
+    float contactRadius() const { return m_contactRadius; }
+
+    // computes the coupling forces and advances both systems by h
+    void step(TimeStepper* clothStepper, TimeStepper* waterStepper, float h);
+
+    void printStats(std::ostream& out) const;
+
+private:
+    ClothSystem* m_cloth;
+    WaterSystem* m_water;
+    std::vector<ParticleSystem*> m_systems;
+    float m_waterParticleMass;
+    float m_contactRadius;
+
+    // forces on the cloth particles in the current step
+    std::vector<float> m_reaction;
+    long m_steps;
+};
+
+#endif
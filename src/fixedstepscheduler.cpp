@@ -0,0 +1,150 @@
+#include "fixedstepscheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "particlesystem.h"
+#include "statekernels.h"
+
+using namespace std;
+
+FixedStepScheduler::FixedStepScheduler(float stepSize, int maxSubsteps)
+    : m_stepSize(stepSize), m_maxSubsteps(maxSubsteps), m_adaptive(false)
+{
+    reset();
+}
+
+void FixedStepScheduler::reset()
+{
+    m_accumulator = 0;
+    m_simulated = 0;
+    m_dropped = 0;
+    m_lastSubsteps = 0;
+    m_lastMinStep = m_lastMaxStep = m_stepSize;
+    m_lastStep = m_stepSize;
+    m_hasPrevious = false;
+}
+
+int FixedStepScheduler::advance(ParticleSystem* system, double frameSeconds,
+                                const function<void(float)>& step)
+{
+    return advance(vector<ParticleSystem*>(1, system), frameSeconds, step);
+}
+
+int FixedStepScheduler::advance(const vector<ParticleSystem*>& systems, double frameSeconds,
+                                const function<void(float)>& step)
+{
+    m_accumulator += frameSeconds;
+    if (m_adaptive) {
+        return advanceAdaptive(systems, step);
+    }
+    int steps = (int) floor(m_accumulator / m_stepSize);
+    if (steps > m_maxSubsteps) {
+        // spiral-of-death guard: give up on the time we cannot catch up on
+        double excess = m_accumulator - m_maxSubsteps * m_stepSize;
+        m_dropped += excess;
+        m_accumulator -= excess;
+        steps = m_maxSubsteps;
+    }
+
+    for (int k = 0; k < steps; ++k) {
+        // only the state before the last step is needed for blending
+        beginStep(systems, m_stepSize, k == steps - 1);
+        step(m_stepSize);
+        m_accumulator -= m_stepSize;
+        m_simulated += m_stepSize;
+    }
+    m_lastSubsteps = steps;
+    m_lastMinStep = m_lastMaxStep = m_stepSize;
+    m_lastStep = m_stepSize;
+    updateRenderStates(systems, (float) max(0.0, min(1.0, m_accumulator / m_stepSize)));
+    return steps;
+}
+
+int FixedStepScheduler::advanceAdaptive(const vector<ParticleSystem*>& systems, const function<void(float)>& step)
+{
+    const float minStep = m_stepSize / MAX_STEP_REDUCTION;
+    int steps = 0;
+    for (;;) {
+        float h = m_stepSize;
+        for (size_t s = 0; s < systems.size(); ++s) {
+            float stable = systems[s]->stableStepSize();
+            if (stable > 0) {
+                h = min(h, max(minStep, stable));
+            }
+        }
+        if (m_accumulator < h) {
+            break;
+        }
+        if (steps == m_maxSubsteps) {
+            // spiral-of-death guard, as above
+            m_dropped += m_accumulator;
+            m_accumulator = 0;
+            break;
+        }
+        m_lastMinStep = steps == 0 ? h : min(m_lastMinStep, h);
+        m_lastMaxStep = steps == 0 ? h : max(m_lastMaxStep, h);
+        // the last step is only known afterwards, so snapshot every one
+        beginStep(systems, h, true);
+        step(h);
+        m_accumulator -= h;
+        m_simulated += h;
+        m_lastStep = h;
+        ++steps;
+    }
+    m_lastSubsteps = steps;
+    // the blend spans the last step taken, possibly in an earlier frame,
+    // not the proposed next one
+    updateRenderStates(systems, (float) max(0.0, min(1.0, m_accumulator / m_lastStep)));
+    return steps;
+}
+
+void FixedStepScheduler::beginStep(const vector<ParticleSystem*>& systems, float h, bool snapshot)
+{
+    m_previous.resize(systems.size());
+    for (size_t s = 0; s < systems.size(); ++s) {
+        // before the snapshot, so that a reordering system blends
+        // matching slots
+        systems[s]->beginStep(h);
+        if (snapshot) {
+            const ParticleStore& store = systems[s]->store();
+            m_previous[s].resize(store.stateSize());
+            memcpy(m_previous[s].data(), store.data(), store.stateSize() * sizeof(float));
+        }
+    }
+    m_hasPrevious = m_hasPrevious || snapshot;
+}
+
+void FixedStepScheduler::updateRenderStates(const vector<ParticleSystem*>& systems, float alpha)
+{
+    m_render.resize(systems.size());
+    for (size_t s = 0; s < systems.size(); ++s) {
+        ParticleSystem* system = systems[s];
+        const ParticleStore& store = system->store();
+        // the system may have changed size since the snapshot (or never
+        // been stepped); then there is nothing sensible to blend with
+        if (!m_hasPrevious || s >= m_previous.size() || (int) m_previous[s].size() != store.stateSize()) {
+            system->setRenderState(nullptr);
+            continue;
+        }
+
+        m_render[s].resize(store.stateSize());
+        const float weights[] = { 1.0f - alpha, alpha };
+        const float* const states[] = { m_previous[s].data(), store.data() };
+        stateCombine(m_render[s].data(), nullptr, 2, weights, states, store.stateSize());
+        system->setRenderState(m_render[s].data());
+    }
+}
+
+void FixedStepScheduler::printStats(ostream& out) const
+{
+    out << "simulated " << m_simulated << " s in steps of ";
+    if (m_adaptive) {
+        out << m_lastMinStep << " to " << m_lastMaxStep << " (adaptive, at most " << m_stepSize << ")";
+    } else {
+        out << m_stepSize;
+    }
+    out << ", " << m_lastSubsteps << " steps last frame (max " << m_maxSubsteps << ")"
+        << ", dropped " << m_dropped << " s" << endl;
+}
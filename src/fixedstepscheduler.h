@@ -0,0 +1,76 @@
+#ifndef FIXEDSTEPSCHEDULER_H
+#define FIXEDSTEPSCHEDULER_H
+
+#include <functional>
+#include <ostream>
+#include <vector>
+
+#include "particlestore.h"
+
+class ParticleSystem;
+
+// Decouples the simulation rate from the frame rate. Wall-clock time
+// accumulates and is consumed in fixed steps of stepSize, at most
+// maxSubsteps per frame; anything beyond that is dropped so that a
+// simulation slower than real time slows down instead of falling ever
+// further behind. For drawing, the system's render state is set to a
+// blend of the last two simulated states by the leftover fraction of a
+// step.
+//
+// In adaptive mode each step is instead the system's stableStepSize(),
+// clamped to between stepSize / MAX_STEP_REDUCTION and stepSize, so calm
+// phases advance in long steps and splashes in short ones.
+//
+// Several systems that are stepped together (e.g. coupled ones) can share
+// a scheduler: each gets beginStep and its own blended render state, and
+// adaptive steps follow the smallest limit among them.
+class FixedStepScheduler
+{
+public:
+    FixedStepScheduler(float stepSize, int maxSubsteps);
+
+    static const int MAX_STEP_REDUCTION = 64;
+    void setAdaptive(bool enabled) { m_adaptive = enabled; }
+
+    // consumes frameSeconds of wall time, calling system->beginStep and
+    // then step(h) once per simulation step of size h, then updates
+    // system's render state. Returns the number of steps taken.
+    int advance(ParticleSystem* system, double frameSeconds,
+                const std::function<void(float)>& step);
+    int advance(const std::vector<ParticleSystem*>& systems, double frameSeconds,
+                const std::function<void(float)>& step);
+
+    // forgets accumulated time and history, e.g. after a reset
+    void reset();
+
+    double simulatedSeconds() const { return m_simulated; }
+    double droppedSeconds() const { return m_dropped; }
+    void printStats(std::ostream& out) const;
+
+private:
+    int advanceAdaptive(const std::vector<ParticleSystem*>& systems, const std::function<void(float)>& step);
+    // calls beginStep(h) on every system, then snapshots them if snapshot
+    void beginStep(const std::vector<ParticleSystem*>& systems, float h, bool snapshot);
+    void updateRenderStates(const std::vector<ParticleSystem*>& systems, float alpha);
+
+    float m_stepSize;
+    int m_maxSubsteps;
+    double m_accumulator;
+    double m_simulated;
+    double m_dropped;
+    int m_lastSubsteps;
+    bool m_adaptive;
+    // range of step sizes in the last frame
+    float m_lastMinStep;
+    float m_lastMaxStep;
+    // size of the most recent step, which the render blend spans
+    float m_lastStep;
+
+    // per system, the state before the most recent step and the blended
+    // render state
+    std::vector<AlignedFloats> m_previous;
+    std::vector<AlignedFloats> m_render;
+    bool m_hasPrevious;
+};
+
+#endif
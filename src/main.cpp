@@ -2,19 +2,26 @@
 #include <GLFW/glfw3.h>
 
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <algorithm>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #include "vertexrecorder.h"
 #include "starter3_util.h"
 #include "camera.h"
 #include "timestepper.h"
+#include "fixedstepscheduler.h"
+#include "threadpool.h"
+#include "benchmark.h"
 //#include "simplesystem.h"
 //#include "pendulumsystem.h"
-//#include "clothsystem.h"
+#include "clothsystem.h"
 #include "watersystem.h"
+#include "coupledworld.h"
 
 using namespace std;
 
@@ -43,11 +50,19 @@ uint64_t start_tick;
 double elapsed_s;
 // number of seconds simulated
 double simulated_s;
+// elapsed_s at the previous frame
+double last_frame_s;
 
 // Globals here.
 TimeStepper* timeStepper;
+// steps the cloth of a coupled world, so each system keeps its own scratch
+TimeStepper* clothTimeStepper;
+FixedStepScheduler* scheduler;
 float h;
 char integrator;
+// most simulation steps taken per rendered frame
+int maxSubsteps = 32;
+bool adaptiveSteps = false;
 
 Camera camera;
 bool gMousePressed = false;
@@ -56,8 +71,23 @@ GLuint program_light;
 
   //SimpleSystem* simpleSystem;
   //PendulumSystem* pendulumSystem;
-  //ClothSystem* clothSystem;
+ClothSystem* clothSystem;
 WaterSystem* waterSystem;
+CoupledWorld* coupledWorld;
+// which of the systems above is simulated, chosen with --system
+string systemName = "water";
+ClothParams clothParams;
+WaterParams waterParams;
+bool tabulatedKernels = false;
+bool symmetricForces = false;
+vector<WaterEmitter> waterEmitters;
+vector<WaterSink> waterSinks;
+// mass of a water particle in cloth units, for --system coupled
+float couplingMass = 0.01f;
+bool surfaceRendering = false;
+// surface meshes are written to <prefix><frame>.obj when not empty
+string surfaceExportPrefix;
+int surfaceExportFrame = 0;
 
 // Function implementations
 static void keyCallback(GLFWwindow* window, int key,
@@ -88,6 +118,15 @@ static void keyCallback(GLFWwindow* window, int key,
         resetTime();
         break;
     }
+    case 'S':
+    {
+        timeStepper->printStats(cout);
+        scheduler->printStats(cout);
+        if (clothSystem) clothSystem->printStats(cout);
+        if (waterSystem) waterSystem->printStats(cout);
+        if (coupledWorld) coupledWorld->printStats(cout);
+        break;
+    }
     default:
         cout << "Unhandled key press " << key << "." << endl;
     }
@@ -179,32 +218,52 @@ void drawAxis()
 // initialize your particle systems
 void initSystem()
 {
-    switch (integrator) {
-    case 'e': timeStepper = new ForwardEuler(); break;
-    case 't': timeStepper = new Trapezoidal(); break;
-    case 'r': timeStepper = new RK4(); break;
-    default: printf("Unrecognized integrator\n"); exit(-1);
+    timeStepper = createTimeStepper(integrator);
+    if (!timeStepper) {
+        printf("Unrecognized integrator\n");
+        exit(-1);
     }
+    scheduler = new FixedStepScheduler(h, maxSubsteps);
+    scheduler->setAdaptive(adaptiveSteps);
 
     //simpleSystem = new SimpleSystem();
     // TODO you can modify the number of particles
     //pendulumSystem = new PendulumSystem();
-    // TODO customize initialization of cloth system
-    //clothSystem = new ClothSystem();
-    waterSystem = new WaterSystem();
+    if (systemName != "water") {
+        clothSystem = new ClothSystem(clothParams);
+    }
+    if (systemName != "cloth") {
+        waterSystem = new WaterSystem(waterParams);
+        waterSystem->setTabulatedKernels(tabulatedKernels);
+        waterSystem->setSymmetricForces(symmetricForces);
+        waterSystem->setSurfaceRendering(surfaceRendering);
+        for (size_t k = 0; k < waterEmitters.size(); ++k)
+            waterSystem->addEmitter(waterEmitters[k]);
+        for (size_t k = 0; k < waterSinks.size(); ++k)
+            waterSystem->addSink(waterSinks[k]);
+    }
+    if (systemName == "coupled") {
+        clothTimeStepper = createTimeStepper(integrator);
+        coupledWorld = new CoupledWorld(clothSystem, waterSystem, couplingMass);
+    }
 }
 
 void freeSystem() {
     //delete simpleSystem; simpleSystem = nullptr;
     delete timeStepper; timeStepper = nullptr;
+    delete clothTimeStepper; clothTimeStepper = nullptr;
+    delete scheduler; scheduler = nullptr;
     //delete pendulumSystem; pendulumSystem = nullptr;
-    //delete clothSystem; clothSystem = nullptr;
+    delete clothSystem; clothSystem = nullptr;
     delete waterSystem; waterSystem = nullptr;
+    delete coupledWorld; coupledWorld = nullptr;
 }
 
 void resetTime() {
     elapsed_s = 0;
     simulated_s = 0;
+    last_frame_s = 0;
+    scheduler->reset();
     start_tick = glfwGetTimerValue();
 }
 
@@ -212,35 +271,24 @@ void resetTime() {
 //       update the external forces before each time step
 void stepSystem()
 {
-    // step until simulated_s has caught up with elapsed_s.
-    //while (simulated_s < elapsed_s) {
-        //timeStepper->takeStep(simpleSystem, h);
-        //timeStepper->takeStep(pendulumSystem, h);
-        //timeStepper->takeStep(clothSystem, h);
-    vector<Vector3f> state = waterSystem->getState();
-    vector<Vector3f> newState;
-    const float TANK_START_X = -1.0f;
-    const float  TANK_END_X = 1.0f;
-    const float TANK_START_Y = -1.0f;
-    const float TANK_END_Y = 1.0f;
-    for (int i = 0; i < state.size() / 2; i++) {
-        int randNum = rand() % 100 - 50;
-        Vector3f pos = state[2*i];
-        Vector3f velocity = state[2*i+1];
-        if (pos.x() <= TANK_START_X)
-            velocity = Vector3f(abs(velocity.x()), velocity.y(), 0.0f);
-        if (pos.x() >= TANK_END_X)
-            velocity = Vector3f(-0.3f*abs(velocity.x()), velocity.y(), 0.0f);
-        if (pos.y() <= TANK_START_Y) {
-            velocity = Vector3f(velocity.x() + 1.0f*randNum/200.0f, 0.4 * abs(velocity.y()) + 1.0f*(50.0f-abs(randNum))/100.0f, 0.0f);
-        }
-        newState.push_back(pos);
-        newState.push_back(velocity);
+    // step in increments of h until simulated_s has caught up with
+    // elapsed_s, taking at most maxSubsteps steps per frame
+    if (coupledWorld) {
+        scheduler->advance(coupledWorld->systems(), elapsed_s - last_frame_s, [](float stepSize) {
+            coupledWorld->step(clothTimeStepper, timeStepper, stepSize);
+        });
+        last_frame_s = elapsed_s;
+        simulated_s = scheduler->simulatedSeconds();
+        return;
     }
-    waterSystem->setState(newState);
-    timeStepper->takeStep(waterSystem, h);
-    simulated_s += h;
-	//}
+    ParticleSystem* system = clothSystem ? (ParticleSystem*) clothSystem : waterSystem;
+    scheduler->advance(system, elapsed_s - last_frame_s, [system](float stepSize) {
+        //timeStepper->takeStep(simpleSystem, stepSize);
+        //timeStepper->takeStep(pendulumSystem, stepSize);
+        timeStepper->takeStep(system, stepSize);
+    });
+    last_frame_s = elapsed_s;
+    simulated_s = scheduler->simulatedSeconds();
 }
 
 // Draw the current particle positions
@@ -253,8 +301,20 @@ void drawSystem()
 
     //simpleSystem->draw(gl);
     //pendulumSystem->draw(gl);
-    //clothSystem->draw(gl);
-    waterSystem->draw(gl);
+    if (clothSystem) {
+        clothSystem->draw(gl);
+    }
+    if (waterSystem) {
+        waterSystem->draw(gl);
+        if (!surfaceExportPrefix.empty()) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s%05d.obj", surfaceExportPrefix.c_str(), surfaceExportFrame++);
+            if (!waterSystem->surface().writeObj(path)) {
+                printf("Cannot write %s, surface export stopped\n", path);
+                surfaceExportPrefix.clear();
+            }
+        }
+    }
 
     // set uniforms for floor
     gl.updateMaterial(FLOOR_COLOR);
@@ -280,11 +340,54 @@ void initRendering()
 // Set up OpenGL, define the callbacks and start the main loop
 int main(int argc, char** argv)
 {
-    if (argc != 3) {
-        printf("Usage: %s <e|t|r> <timestep>\n", argv[0]);
+    if (argc >= 2 && string(argv[1]) == "bench") {
+        return runBenchmark(argc - 2, argv + 2);
+    }
+
+    if (argc < 3) {
+        printf("Usage: %s <e|t|r|a|i|s|v> <timestep> [options]\n", argv[0]);
         printf("       e: Integrator: Forward Euler\n");
         printf("       t: Integrator: Trapezoid\n");
         printf("       r: Integrator: RK 4\n");
+        printf("       a: Integrator: adaptive Dormand-Prince 5(4); the timestep is\n");
+        printf("          the interval advanced per frame, subdivided as needed\n");
+        printf("       i: Integrator: implicit Euler (systems with force Jacobians)\n");
+        printf("       s: Integrator: symplectic Euler\n");
+        printf("       v: Integrator: velocity Verlet\n");
+        printf("   or: %s bench <name> [args]   (headless benchmarks)\n", argv[0]);
+        printf("\n");
+        printf("Options:\n");
+        printf("       --substeps <n>   most simulation steps per rendered frame (default %d);\n", maxSubsteps);
+        printf("                        simulation time beyond that is dropped\n");
+        printf("       --adaptive       steps follow the system's stability limit (CFL\n");
+        printf("                        for water); the timestep becomes the largest step\n");
+        printf("       --system <water|cloth|coupled>  system to simulate (default water); coupled\n");
+        printf("                                       hangs the cloth in the water, each pushing\n");
+        printf("                                       on the other\n");
+        printf("       --coupling-mass <m>             mass of a water particle in cloth units\n");
+        printf("                                       (coupled, default 0.01)\n");
+        printf("       --cloth-size <W>x<H>            cloth particles per row and column (default 8x8)\n");
+        printf("       --cloth-spacing <d>             cloth rest spacing (default 0.2)\n");
+        printf("       --cloth-stiffness <k>           stiffness of every cloth spring (default 50)\n");
+        printf("       --cloth-pins <corners|edge|none> pinned top corners, top row, or nothing\n");
+        printf("       --cloth-pin <i>                 additionally pin particle i (repeatable)\n");
+        printf("       --water-dims <2|3>              2D sheet or full 3D water (default 2)\n");
+        printf("       --water-spacing <d>             initial particle spacing and neighbor radius (default 0.08)\n");
+        printf("       --water-depth <d>               tank depth along z in 3D (default 1)\n");
+        printf("       --water-empty                   start without the block of water\n");
+        printf("       --water-emitter <x,y,z,vx,vy,vz,r> nozzle of radius r at (x,y,z) emitting at\n");
+        printf("                                       velocity (vx,vy,vz) (repeatable)\n");
+        printf("       --water-sink <x0,y0,z0,x1,y1,z1> remove water inside the box (repeatable)\n");
+        printf("       --water-solver <wcsph|pcisph>   weakly compressible SPH, or incompressible\n");
+        printf("                                       PCISPH for large steps (default wcsph)\n");
+        printf("       --courant <c>                   fraction of the CFL limit for --adaptive (default 0.4)\n");
+        printf("       --water-surface                 draw the water as a marching-cubes surface\n");
+        printf("       --export-surface <prefix>       also write the surface of every frame to\n");
+        printf("                                       <prefix>00000.obj, <prefix>00001.obj, ...\n");
+        printf("       --sph-tables                    tabulated SPH viscosity kernel (water)\n");
+        printf("       --sph-symmetric                 evaluate each SPH pair once, from a half\n");
+        printf("                                       neighbor list (water, wcsph)\n");
+        printf("       --threads <n>                   simulation threads, 0 for all cores (default 1)\n");
         printf("\n");
         printf("Try  : %s t 0.001\n", argv[0]);
         printf("       for trapezoid (1ms steps)\n");
@@ -295,10 +398,79 @@ int main(int argc, char** argv)
 
     integrator = argv[1][0];
     h = (float)atof(argv[2]);
-    printf("Using Integrator %c with time step %.4f\n", integrator, h);
+    for (int k = 3; k < argc; ++k) {
+        string option = argv[k];
+        string value = k + 1 < argc ? argv[k + 1] : "";
+        float p[3], q[3], r;
+        if (option == "--substeps" && k + 1 < argc) {
+            maxSubsteps = max(1, atoi(argv[++k]));
+        } else if (option == "--adaptive") {
+            adaptiveSteps = true;
+        } else if (option == "--system" && (value == "water" || value == "cloth" || value == "coupled")) {
+            systemName = argv[++k];
+        } else if (option == "--coupling-mass" && atof(value.c_str()) > 0) {
+            couplingMass = (float)atof(argv[++k]);
+        } else if (option == "--cloth-size" &&
+                   sscanf(value.c_str(), "%dx%d", &clothParams.width, &clothParams.height) == 2 &&
+                   clothParams.width >= 2 && clothParams.height >= 2) {
+            ++k;
+        } else if (option == "--cloth-spacing" && atof(value.c_str()) > 0) {
+            clothParams.spacing = (float)atof(argv[++k]);
+        } else if (option == "--cloth-stiffness" && atof(value.c_str()) > 0) {
+            float stiffness = (float)atof(argv[++k]);
+            clothParams.structuralStiffness = stiffness;
+            clothParams.shearStiffness = stiffness;
+            clothParams.flexionStiffness = stiffness;
+        } else if (option == "--cloth-pins" && (value == "corners" || value == "edge" || value == "none")) {
+            clothParams.pins = value == "corners" ? ClothParams::PIN_TOP_CORNERS :
+                               value == "edge" ? ClothParams::PIN_TOP_EDGE : ClothParams::PIN_NONE;
+            ++k;
+        } else if (option == "--cloth-pin" && k + 1 < argc) {
+            clothParams.extraPins.push_back(atoi(argv[++k]));
+        } else if (option == "--water-dims" && (value == "2" || value == "3")) {
+            waterParams.dimensions = atoi(argv[++k]);
+        } else if (option == "--water-spacing" && atof(value.c_str()) > 0) {
+            waterParams.particleSpacing = (float)atof(argv[++k]);
+        } else if (option == "--water-depth" && atof(value.c_str()) > 0) {
+            waterParams.tankDepth = (float)atof(argv[++k]);
+        } else if (option == "--water-empty") {
+            waterParams.initialBlock = false;
+        } else if (option == "--water-emitter" &&
+                   sscanf(value.c_str(), "%f,%f,%f,%f,%f,%f,%f", &p[0], &p[1], &p[2], &q[0], &q[1], &q[2], &r) == 7) {
+            waterEmitters.push_back(WaterEmitter(Vector3f(p[0], p[1], p[2]), Vector3f(q[0], q[1], q[2]), r));
+            ++k;
+        } else if (option == "--water-sink" &&
+                   sscanf(value.c_str(), "%f,%f,%f,%f,%f,%f", &p[0], &p[1], &p[2], &q[0], &q[1], &q[2]) == 6) {
+            waterSinks.push_back(WaterSink(Vector3f(p[0], p[1], p[2]), Vector3f(q[0], q[1], q[2])));
+            ++k;
+        } else if (option == "--water-solver" && (value == "wcsph" || value == "pcisph")) {
+            waterParams.solver = value == "pcisph" ? WaterParams::SOLVER_PCISPH : WaterParams::SOLVER_WCSPH;
+            ++k;
+        } else if (option == "--courant" && atof(value.c_str()) > 0) {
+            waterParams.courantFactor = (float)atof(argv[++k]);
+        } else if (option == "--water-surface") {
+            surfaceRendering = true;
+        } else if (option == "--export-surface" && k + 1 < argc) {
+            surfaceRendering = true;
+            surfaceExportPrefix = argv[++k];
+        } else if (option == "--sph-tables") {
+            tabulatedKernels = true;
+        } else if (option == "--sph-symmetric") {
+            symmetricForces = true;
+        } else if (option == "--threads" && k + 1 < argc) {
+            setThreadCount(atoi(argv[++k]));
+        } else {
+            printf("Unknown or malformed option %s\n", argv[k]);
+            return -1;
+        }
+    }
+    printf("Using Integrator %c with time step %.4f on %d thread(s)\n", integrator, h, threadCount());
 
 
     GLFWwindow* window = createOpenGLWindow(1024, 1024, "Final Project");
+    // cap rendering at the display refresh rate; the scheduler decouples
+    // the simulation rate from it
+    glfwSwapInterval(1);
 
     // setup the event handlers
     glfwSetKeyCallback(window, keyCallback);
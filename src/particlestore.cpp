@@ -0,0 +1,151 @@
+#include "particlestore.h"
+
+#include <algorithm>
+#include <functional>
+
+void ParticleStore::resize(int numParticles)
+{
+    int keep = std::min(numParticles, m_numParticles);
+    if (strideFor(numParticles) > m_stride) {
+        setStride(std::max(strideFor(numParticles), m_stride > 0 ? strideFor(m_stride + m_stride / 2) : 0));
+    }
+
+    // clear the lanes that are no longer (or not yet) in use; the ones
+    // past both sizes are padding and already zero
+    int used = std::max(numParticles, m_numParticles);
+    for (int c = 0; c < NUM_STATE_CHANNELS; ++c) {
+        std::fill(channel(c) + keep, channel(c) + used, 0.0f);
+    }
+    for (int a = 0; a < NUM_ATTRIBUTES; ++a) {
+        if (!m_attributes[a].empty()) {
+            std::fill(m_attributes[a].begin() + keep, m_attributes[a].begin() + used, 0.0f);
+        }
+    }
+
+    m_ids.resize(numParticles);
+    for (int i = keep; i < numParticles; ++i) {
+        m_ids[i] = m_nextId++;
+    }
+
+    m_numParticles = numParticles;
+}
+
+void ParticleStore::reserve(int numParticles)
+{
+    if (strideFor(numParticles) > m_stride) {
+        setStride(strideFor(numParticles));
+    }
+}
+
+// moves the live particles to a block of the given (larger) stride
+void ParticleStore::setStride(int stride)
+{
+    AlignedFloats state(NUM_STATE_CHANNELS * stride, 0.0f);
+    for (int c = 0; c < NUM_STATE_CHANNELS; ++c) {
+        std::copy(channel(c), channel(c) + m_numParticles, state.begin() + c * stride);
+    }
+    m_state.swap(state);
+
+    for (int a = 0; a < NUM_ATTRIBUTES; ++a) {
+        if (m_attributes[a].empty()) {
+            continue;
+        }
+        AlignedFloats values(stride, 0.0f);
+        std::copy(m_attributes[a].begin(), m_attributes[a].begin() + m_numParticles, values.begin());
+        m_attributes[a].swap(values);
+    }
+    m_stride = stride;
+}
+
+void ParticleStore::removeParticles(const std::vector<int>& slots)
+{
+    // from the back, so that the particle moved into a hole is never one
+    // that is still to be removed
+    m_removed = slots;
+    std::sort(m_removed.begin(), m_removed.end(), std::greater<int>());
+    int n = m_numParticles;
+    for (size_t k = 0; k < m_removed.size(); ++k) {
+        int slot = m_removed[k];
+        int last = --n;
+        if (slot == last) {
+            continue;
+        }
+        for (int c = 0; c < NUM_STATE_CHANNELS; ++c) {
+            channel(c)[slot] = channel(c)[last];
+        }
+        for (int a = 0; a < NUM_ATTRIBUTES; ++a) {
+            if (!m_attributes[a].empty()) {
+                m_attributes[a][slot] = m_attributes[a][last];
+            }
+        }
+        m_ids[slot] = m_ids[last];
+    }
+    resize(n);
+}
+
+void ParticleStore::permute(const std::vector<int>& order)
+{
+    m_permuted.resize(m_stride);
+    for (int c = 0; c < NUM_STATE_CHANNELS; ++c) {
+        float* values = channel(c);
+        for (int k = 0; k < m_numParticles; ++k) {
+            m_permuted[k] = values[order[k]];
+        }
+        std::copy(m_permuted.begin(), m_permuted.begin() + m_numParticles, values);
+    }
+    for (int a = 0; a < NUM_ATTRIBUTES; ++a) {
+        if (m_attributes[a].empty()) {
+            continue;
+        }
+        for (int k = 0; k < m_numParticles; ++k) {
+            m_permuted[k] = m_attributes[a][order[k]];
+        }
+        std::copy(m_permuted.begin(), m_permuted.begin() + m_numParticles, m_attributes[a].begin());
+    }
+
+    m_permutedIds.resize(m_numParticles);
+    for (int k = 0; k < m_numParticles; ++k) {
+        m_permutedIds[k] = m_ids[order[k]];
+    }
+    m_ids.swap(m_permutedIds);
+}
+
+void ParticleStore::setPosition(int i, const Vector3f& p)
+{
+    channel(PX)[i] = p.x();
+    channel(PY)[i] = p.y();
+    channel(PZ)[i] = p.z();
+}
+
+void ParticleStore::setVelocity(int i, const Vector3f& v)
+{
+    channel(VX)[i] = v.x();
+    channel(VY)[i] = v.y();
+    channel(VZ)[i] = v.z();
+}
+
+void ParticleStore::enableAttribute(Attribute a, float initialValue)
+{
+    // an enabled attribute is never empty, even on an empty store
+    reserve(1);
+    m_attributes[a].assign(m_stride, 0.0f);
+    std::fill(m_attributes[a].begin(), m_attributes[a].begin() + m_numParticles, initialValue);
+}
+
+void ParticleStore::exportInterleaved(std::vector<Vector3f>& out) const
+{
+    out.resize(2 * m_numParticles);
+    for (int i = 0; i < m_numParticles; ++i) {
+        out[2*i] = position(i);
+        out[2*i + 1] = velocity(i);
+    }
+}
+
+void ParticleStore::importInterleaved(const std::vector<Vector3f>& in)
+{
+    resize((int) in.size() / 2);
+    for (int i = 0; i < m_numParticles; ++i) {
+        setPosition(i, in[2*i]);
+        setVelocity(i, in[2*i + 1]);
+    }
+}
@@ -0,0 +1,203 @@
+#ifndef PARTICLESTORE_H
+#define PARTICLESTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <vecmath.h>
+
+// Allocator handing out 32-byte aligned blocks, so every channel of a
+// ParticleStore can be loaded with aligned AVX instructions.
+template <typename T>
+struct AlignedAllocator
+{
+    typedef T value_type;
+    static const std::size_t ALIGNMENT = 32;
+
+    template <typename U> struct rebind { typedef AlignedAllocator<U> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        // over-allocate and stash the raw pointer just below the aligned
+        // block; through operator new, so the allocation counter sees it
+        void* raw = ::operator new(n * sizeof(T) + ALIGNMENT);
+        std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(raw) + ALIGNMENT) & ~(std::uintptr_t)(ALIGNMENT - 1);
+        reinterpret_cast<void**>(aligned)[-1] = raw;
+        return reinterpret_cast<T*>(aligned);
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+        if (p) {
+            ::operator delete(reinterpret_cast<void**>(p)[-1]);
+        }
+    }
+};
+
+template <typename T, typename U>
+bool operator == (const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator != (const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
+typedef std::vector<float, AlignedAllocator<float> > AlignedFloats;
+
+// Channel order of a flat state block. Every channel is a contiguous run
+// of stride() floats, so the whole block is NUM_STATE_CHANNELS * stride()
+// floats. Padding lanes past numParticles() are kept at zero.
+// A derivative block uses the same layout, with dx/dt in PX..PZ and
+// dv/dt in VX..VZ.
+enum StateChannel { PX, PY, PZ, VX, VY, VZ, NUM_STATE_CHANNELS };
+
+// Non-owning, read-only view of a state block. Cheap to copy; must not
+// outlive the storage.
+class StateView
+{
+public:
+    StateView(const float* data, int numParticles, int stride)
+        : m_data(data), m_numParticles(numParticles), m_stride(stride) {}
+
+    int numParticles() const { return m_numParticles; }
+    int stride() const { return m_stride; }
+    const float* data() const { return m_data; }
+    const float* channel(int c) const { return m_data + c * m_stride; }
+
+    Vector3f positionAt(int i) const
+    {
+        return Vector3f(m_data[i], m_data[m_stride + i], m_data[2*m_stride + i]);
+    }
+    Vector3f velocityAt(int i) const
+    {
+        return Vector3f(m_data[3*m_stride + i], m_data[4*m_stride + i], m_data[5*m_stride + i]);
+    }
+
+private:
+    const float* m_data;
+    int m_numParticles;
+    int m_stride;
+};
+
+// Non-owning, writable view of a derivative block f(X,t).
+class DerivativeView
+{
+public:
+    DerivativeView(float* data, int numParticles, int stride)
+        : m_data(data), m_numParticles(numParticles), m_stride(stride) {}
+
+    int numParticles() const { return m_numParticles; }
+    int stride() const { return m_stride; }
+    float* data() const { return m_data; }
+    float* channel(int c) const { return m_data + c * m_stride; }
+
+    Vector3f velocityAt(int i) const
+    {
+        return Vector3f(m_data[i], m_data[m_stride + i], m_data[2*m_stride + i]);
+    }
+    Vector3f accelerationAt(int i) const
+    {
+        return Vector3f(m_data[3*m_stride + i], m_data[4*m_stride + i], m_data[5*m_stride + i]);
+    }
+
+    void set(int i, const Vector3f& velocity, const Vector3f& acceleration) const
+    {
+        m_data[i] = velocity.x();
+        m_data[m_stride + i] = velocity.y();
+        m_data[2*m_stride + i] = velocity.z();
+        m_data[3*m_stride + i] = acceleration.x();
+        m_data[4*m_stride + i] = acceleration.y();
+        m_data[5*m_stride + i] = acceleration.z();
+    }
+
+private:
+    float* m_data;
+    int m_numParticles;
+    int m_stride;
+};
+
+// Structure-of-arrays particle storage: separate 32-byte aligned x/y/z
+// runs for positions and velocities in one flat block, plus optional
+// per-particle attributes that are carried along but not integrated.
+// Every particle also has a stable ID that follows it when the store is
+// permuted, so slots may be reordered freely.
+class ParticleStore
+{
+public:
+    enum Attribute { MASS, INV_MASS, PINNED, DENSITY, NUM_ATTRIBUTES };
+
+    // channels are padded to a multiple of this many floats (32 bytes)
+    static const int LANES = 8;
+
+    ParticleStore() : m_numParticles(0), m_stride(0), m_nextId(0) {}
+
+    // grows or shrinks the store, keeping the leading particles. New
+    // particles get fresh IDs. The stride only ever grows, by at least
+    // half when it has to, so a store whose size goes up and down
+    // settles at its peak and stops reallocating.
+    void resize(int numParticles);
+    // makes the stride large enough for numParticles
+    void reserve(int numParticles);
+
+    // removes the particles in the given slots (distinct, in any order)
+    // by moving the last particles into the holes, O(1) each. Other
+    // particles keep their IDs but may change slot.
+    void removeParticles(const std::vector<int>& slots);
+
+    // reorders the particles so that slot k holds the particle previously
+    // in slot order[k]; state, attributes and IDs move together. order
+    // must be a permutation of 0 .. size()-1.
+    void permute(const std::vector<int>& order);
+
+    // stable ID of the particle in slot i
+    int id(int i) const { return m_ids[i]; }
+    const std::vector<int>& ids() const { return m_ids; }
+
+    int size() const { return m_numParticles; }
+    int stride() const { return m_stride; }
+    // number of floats in a state (or derivative) block
+    int stateSize() const { return NUM_STATE_CHANNELS * m_stride; }
+
+    float* data() { return m_state.data(); }
+    const float* data() const { return m_state.data(); }
+    float* channel(int c) { return m_state.data() + c * m_stride; }
+    const float* channel(int c) const { return m_state.data() + c * m_stride; }
+
+    StateView view() const { return StateView(m_state.data(), m_numParticles, m_stride); }
+
+    Vector3f position(int i) const { return view().positionAt(i); }
+    Vector3f velocity(int i) const { return view().velocityAt(i); }
+    void setPosition(int i, const Vector3f& p);
+    void setVelocity(int i, const Vector3f& v);
+
+    // attributes are absent until enabled; attribute() returns nullptr for
+    // a disabled attribute
+    void enableAttribute(Attribute a, float initialValue);
+    bool hasAttribute(Attribute a) const { return !m_attributes[a].empty(); }
+    float* attribute(Attribute a) { return hasAttribute(a) ? m_attributes[a].data() : nullptr; }
+    const float* attribute(Attribute a) const { return hasAttribute(a) ? m_attributes[a].data() : nullptr; }
+
+    // interleaved [x0, v0, x1, v1, ...] compatibility layer
+    void exportInterleaved(std::vector<Vector3f>& out) const;
+    void importInterleaved(const std::vector<Vector3f>& in);
+
+    static int strideFor(int numParticles) { return (numParticles + LANES - 1) / LANES * LANES; }
+
+private:
+    int m_numParticles;
+    int m_stride;
+    AlignedFloats m_state;
+    AlignedFloats m_attributes[NUM_ATTRIBUTES];
+    std::vector<int> m_ids;
+    int m_nextId;
+    void setStride(int stride);
+
+    // reused by permute and removeParticles
+    AlignedFloats m_permuted;
+    std::vector<int> m_permutedIds;
+    std::vector<int> m_removed;
+};
+
+#endif
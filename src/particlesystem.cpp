@@ -14,6 +14,27 @@ float rand_uniform(float low, float hi) {
    return f;
 }
 
+std::vector<Vector3f> ParticleSystem::evalF(const std::vector<Vector3f>& state)
+{
+    ParticleStore in;
+    in.importInterleaved(state);
+    ParticleStore out;
+    out.resize(in.size());
+    DerivativeView view(out.data(), out.size(), out.stride());
+    evalF(in.view(), view);
+
+    std::vector<Vector3f> f;
+    out.exportInterleaved(f);
+    return f;
+}
+
+std::vector<Vector3f> ParticleSystem::getState() const
+{
+    std::vector<Vector3f> state;
+    m_store.exportInterleaved(state);
+    return state;
+}
+
 GLProgram::GLProgram(uint32_t apl, uint32_t apc, Camera* ac)
     : program_light(apl), program_color(apc), camera(ac) 
 {
@@ -1,34 +1,100 @@
 #ifndef PARTICLESYSTEM_H
 #define PARTICLESYSTEM_H
 
+#include <ostream>
 #include <vector>
 #include <vecmath.h>
 #include <cstdint>
+#include "particlestore.h"
 
 
 // helper for uniform distribution
 float rand_uniform(float low, float hi);
 
 struct GLProgram;
+class BlockSparseMatrix;
 class ParticleSystem
 {
 public:
+    ParticleSystem() : m_derivativeEpoch(0), m_renderData(nullptr) {}
     virtual ~ParticleSystem() {}
 
-    // for a given state, evaluate derivative f(X,t)
-    virtual std::vector<Vector3f> evalF(std::vector<Vector3f> state) = 0;
+    // for a given state, evaluate derivative f(X,t) into f.
+    // f must have the same particle count and stride as state.
+    virtual void evalF(const StateView& state, DerivativeView& f) = 0;
+
+    // allocating adapter around the view-based evalF, for interleaved
+    // [x0, v0, x1, v1, ...] states
+    std::vector<Vector3f> evalF(const std::vector<Vector3f>& state);
+
+    // Optional interface for implicit integrators. Systems that can
+    // provide analytic force Jacobians return true and fill dfdx and dfdv:
+    // the derivatives of the per-particle forces (not accelerations) with
+    // respect to positions and velocities at state. Implementations set up
+    // the sparsity pattern whenever the matrices are not yet sized for
+    // the system. Masses are read from the MASS attribute (1 if absent),
+    // pinned particles from PINNED.
+    virtual bool hasForceJacobians() const { return false; }
+    virtual void evalForceJacobians(const StateView& state,
+        BlockSparseMatrix& dfdx, BlockSparseMatrix& dfdv) {}
+
+    // called once before every time step of size h, while no integrator
+    // is in the middle of a step. Systems may rearrange their store here,
+    // e.g. reorder particles for locality.
+    virtual void beginStep(float h) {}
+
+    // largest step size the system considers stable in its current state
+    // (e.g. from a CFL condition), or 0 if it has no limit
+    virtual float stableStepSize() const { return 0; }
+
+    // prints system-specific performance counters
+    virtual void printStats(std::ostream& out) const {}
+
+    // Hook for forces from outside the system, e.g. from its coupling to
+    // another system: evalF adds forces[3*i .. 3*i + 2] to the forces on
+    // particle i, held constant over the step. Ignored unless there are
+    // three per particle, so a system whose size changed is left alone.
+    void setExternalForces(const std::vector<float>& forces) { m_externalForces = forces; invalidateDerivativeCache(); }
+    void clearExternalForces() { m_externalForces.clear(); invalidateDerivativeCache(); }
+
+    // Changes whenever evalF of an unchanged state may give a different
+    // result: the external forces, a coupling or a parameter changed.
+    // Steppers that reuse the derivative of the last step's end state
+    // only do so while it stays the same.
+    unsigned long derivativeEpoch() const { return m_derivativeEpoch; }
+    void invalidateDerivativeCache() { ++m_derivativeEpoch; }
+
+    // the system's state; timesteppers integrate store().data() in place
+    ParticleStore& store() { return m_store; }
+    const ParticleStore& store() const { return m_store; }
+    StateView getStateView() const { return m_store.view(); }
+
+    // state to draw. Normally the current state; a FixedStepScheduler
+    // points it at a blend of the last two steps. data must have the
+    // store's layout and stay valid until the next call.
+    StateView getRenderView() const
+    {
+        return m_renderData ? StateView(m_renderData, m_store.size(), m_store.stride()) : m_store.view();
+    }
+    void setRenderState(const float* data) { m_renderData = data; }
+
+    // interleaved compatibility accessors; these copy the whole state
+    std::vector<Vector3f> getState() const;
+    void setState(const std::vector<Vector3f>  & newState) { m_store.importInterleaved(newState); };
+
+	static const Vector3f& getPositionAt(const std::vector<Vector3f>& state, int i) { return state.at(i*2); };
+	static const Vector3f& getVelocityAt(const std::vector<Vector3f>& state, int i) { return state.at(i*2 + 1); };
 
-    // getter method for the system's state
-    std::vector<Vector3f> getState() { return m_vVecState; };
-
-    // setter method for the system's state
-    void setState(const std::vector<Vector3f>  & newState) { m_vVecState = newState; };
+ protected:
+    ParticleStore m_store;
+    std::vector<float> m_externalForces;
+    unsigned long m_derivativeEpoch;
 
-	static Vector3f getPositionAt(std::vector<Vector3f> state, int i) { return state.at(i*2); };
-	static Vector3f getVelocityAt(std::vector<Vector3f> state, int i) { return state.at(i*2 + 1); };
+    // whether the external forces match a state of n particles
+    bool hasExternalForces(int n) const { return n > 0 && (int) m_externalForces.size() == 3 * n; }
 
- protected:
-    std::vector<Vector3f> m_vVecState;
+ private:
+    const float* m_renderData;
 };
 
 /* GLProgram is a helper for updating uniform variables.
@@ -44,31 +44,29 @@ PendulumSystem::PendulumSystem()
 }
 
 
-std::vector<Vector3f> PendulumSystem::evalF(std::vector<Vector3f> state)
+void PendulumSystem::evalF(const StateView& state, DerivativeView& f)
 {
-    std::vector<Vector3f> f;
     // TODO 4.1: implement evalF
     //  - gravity
     //  - viscous drag
     //  - springs
 
-    for (int i=0; i<(int) state.size()/2; ++i) {
+    for (int i=0; i<state.numParticles(); ++i) {
       if (i==0) {
-	f.push_back(Vector3f());
-	f.push_back(Vector3f());
+	f.set(i, Vector3f(), Vector3f());
       } else {
-	Vector3f pointi = getPositionAt(state, i-1);
-	Vector3f pointj = getPositionAt(state, i);
+	const Vector3f& pointi = state.positionAt(i-1);
+	const Vector3f& pointj = state.positionAt(i);
 	Vector3f distance = pointj - pointi;
-	Vector3f velocity = getVelocityAt(state, i);
+	const Vector3f& velocity = state.velocityAt(i);
 
 	Vector3f fGravity(0.0, MASS * GRAVITY, 0.0);
 	Vector3f fDrag = -K_DRAG * velocity;
 	Vector3f fSpringDown = -K_SPRING * (distance.abs() - REST_LENGTH) * (distance / distance.abs());
 	Vector3f fSpringUp = Vector3f();
 	
-	if (i < (int) state.size()/2 - 1) {
-	  Vector3f pointk = getPositionAt(state, i+1);
+	if (i < state.numParticles() - 1) {
+	  const Vector3f& pointk = state.positionAt(i+1);
 	  Vector3f distance2 = pointj - pointk;
 
 	  fSpringUp = -K_SPRING * (distance2.abs() - REST_LENGTH) * (distance2 / distance2.abs());
@@ -77,12 +75,9 @@ std::vector<Vector3f> PendulumSystem::evalF(std::vector<Vector3f> state)
 	Vector3f totalForce = fGravity + fDrag + fSpringUp + fSpringDown;
 	Vector3f acceleration = totalForce / MASS;
 
-	f.push_back(velocity);
-	f.push_back(acceleration);
+	f.set(i, velocity, acceleration);
       }
     }
-
-    return f;
 }
 
 // render the system (ie draw the particles)
@@ -95,10 +90,10 @@ void PendulumSystem::draw(GLProgram& gl)
 
     // example code. Replace with your own drawing  code
     //gl.updateModelMatrix(Matrix4f::translation(Vector3f(-0.5, 1.0, 0)));
-    vector<Vector3f> currentState = getState();
+    StateView currentState = getRenderView();
    
-    for (int i=0; i<(int) currentState.size()/2; ++i) {
-      gl.updateModelMatrix(Matrix4f::translation(getPositionAt(currentState, i)));
+    for (int i=0; i<currentState.numParticles(); ++i) {
+      gl.updateModelMatrix(Matrix4f::translation(currentState.positionAt(i)));
       drawSphere(0.075f, 10, 10);
     }
 }
@@ -10,11 +10,12 @@ class PendulumSystem : public ParticleSystem
 public:
     PendulumSystem();
 
-    std::vector<Vector3f> evalF(std::vector<Vector3f> state) override;
+    void evalF(const StateView& state, DerivativeView& f) override;
+    using ParticleSystem::evalF;
     void draw(GLProgram&);
 
     // inherits 
-    // std::vector<Vector3f> m_vVecState;
+    // ParticleStore m_store;
 };
 
 #endif
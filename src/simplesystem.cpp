@@ -19,18 +19,13 @@ SimpleSystem::SimpleSystem()
   setState(initialState);
 }
 
-std::vector<Vector3f> SimpleSystem::evalF(std::vector<Vector3f> state)
+void SimpleSystem::evalF(const StateView& state, DerivativeView& f)
 {
-    std::vector<Vector3f> f;
-
     // TODO 3.2: implement evalF
     // for a given state, evaluate f(X,t)
-    for (int i=0; i<(int) state.size()/2; ++i) {
-      f.push_back(-1.0*getVelocityAt(state, i));
-      f.push_back(getPositionAt(state, i));
+    for (int i=0; i<state.numParticles(); ++i) {
+      f.set(i, -1.0*state.velocityAt(i), state.positionAt(i));
     }
-
-    return f;
 }
 
 // render the system (ie draw the particles)
@@ -50,7 +45,7 @@ void SimpleSystem::draw(GLProgram& gl)
 
     const Vector3f PARTICLE_COLOR(0.4f, 0.7f, 1.0f);
     gl.updateMaterial(PARTICLE_COLOR);
-    Vector3f pos(getPositionAt(getState(), 0)); //YOUR PARTICLE POSITION
+    Vector3f pos(getRenderView().positionAt(0)); //YOUR PARTICLE POSITION
     gl.updateModelMatrix(Matrix4f::translation(pos));
     drawSphere(0.075f, 10, 10);
 }
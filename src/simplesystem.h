@@ -14,13 +14,14 @@ public:
     // with any particle system (simple, pendulum, cloth), without
     // knowing which particular system it is.
     // Each ParticleSystem subclass must provide an implementation of evalF.
-    std::vector<Vector3f> evalF(std::vector<Vector3f> state) override;
+    void evalF(const StateView& state, DerivativeView& f) override;
+    using ParticleSystem::evalF;
 
     // this is called from main.cpp when it's time to draw a new frame.
     void draw(GLProgram&);
 
     // inherits 
-    // std::vector<Vector3f> m_vVecState;
+    // ParticleStore m_store;
 };
 
 #endif
@@ -0,0 +1,183 @@
+#include "spatialhashgrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace
+{
+const uint64_t EMPTY_KEY = ~(uint64_t) 0;
+// cell coordinates are stored in 21 bits each
+const int COORDINATE_LIMIT = 1 << 20;
+const int MIN_CAPACITY = 64;
+
+// mixes the packed key so neighboring cells spread over the table
+inline uint64_t hashKey(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+int nextPowerOfTwo(int n)
+{
+    int p = MIN_CAPACITY;
+    while (p < n) {
+        p *= 2;
+    }
+    return p;
+}
+}
+
+SpatialHashGrid::SpatialHashGrid()
+    : m_cellSize(1), m_inverseCellSize(1)
+{
+    m_origin[0] = m_origin[1] = m_origin[2] = 0;
+    m_cellStart.assign(1, 0);
+}
+
+void SpatialHashGrid::configure(float cellSize, const Vector3f& origin)
+{
+    m_cellSize = cellSize;
+    m_inverseCellSize = 1.0f / cellSize;
+    for (int c = 0; c < 3; ++c) {
+        m_origin[c] = origin[c];
+    }
+}
+
+int SpatialHashGrid::cellCoordinate(float p, int axis) const
+{
+    float cell = floor((p - m_origin[axis]) * m_inverseCellSize);
+    // written so that NaN ends up at the lower limit
+    if (!(cell > -COORDINATE_LIMIT)) {
+        return -COORDINATE_LIMIT;
+    }
+    if (!(cell < COORDINATE_LIMIT - 1)) {
+        return COORDINATE_LIMIT - 1;
+    }
+    return (int) cell;
+}
+
+uint64_t SpatialHashGrid::packKey(int x, int y, int z)
+{
+    const uint64_t mask = (1u << 21) - 1;
+    return ((uint64_t) (x + COORDINATE_LIMIT) & mask) << 42 |
+           ((uint64_t) (y + COORDINATE_LIMIT) & mask) << 21 |
+           ((uint64_t) (z + COORDINATE_LIMIT) & mask);
+}
+
+int SpatialHashGrid::findCell(int x, int y, int z) const
+{
+    if (x < -COORDINATE_LIMIT || x >= COORDINATE_LIMIT ||
+        y < -COORDINATE_LIMIT || y >= COORDINATE_LIMIT ||
+        z < -COORDINATE_LIMIT || z >= COORDINATE_LIMIT || m_tableKeys.empty()) {
+        return -1;
+    }
+    uint64_t key = packKey(x, y, z);
+    size_t mask = m_tableKeys.size() - 1;
+    for (size_t e = hashKey(key) & mask; ; e = (e + 1) & mask) {
+        if (m_tableKeys[e] == key) {
+            return m_tableCells[e];
+        }
+        if (m_tableKeys[e] == EMPTY_KEY) {
+            return -1;
+        }
+    }
+}
+
+// returns the cell index of key, adding a new cell if needed
+int SpatialHashGrid::insert(uint64_t key)
+{
+    // keep the load factor at or below one half
+    int numCells = (int) m_cellStart.size() - 1;
+    if (2 * (numCells + 1) > (int) m_tableKeys.size()) {
+        rehash(2 * (int) m_tableKeys.size());
+    }
+    size_t mask = m_tableKeys.size() - 1;
+    for (size_t e = hashKey(key) & mask; ; e = (e + 1) & mask) {
+        if (m_tableKeys[e] == key) {
+            return m_tableCells[e];
+        }
+        if (m_tableKeys[e] == EMPTY_KEY) {
+            m_tableKeys[e] = key;
+            m_tableCells[e] = numCells;
+            m_cellStart.push_back(0);
+            return numCells;
+        }
+    }
+}
+
+void SpatialHashGrid::rehash(int capacity)
+{
+    vector<uint64_t> keys(capacity, EMPTY_KEY);
+    vector<int> cells(capacity, -1);
+    size_t mask = capacity - 1;
+    for (size_t k = 0; k < m_tableKeys.size(); ++k) {
+        if (m_tableKeys[k] == EMPTY_KEY) {
+            continue;
+        }
+        size_t e = hashKey(m_tableKeys[k]) & mask;
+        while (keys[e] != EMPTY_KEY) {
+            e = (e + 1) & mask;
+        }
+        keys[e] = m_tableKeys[k];
+        cells[e] = m_tableCells[k];
+    }
+    m_tableKeys.swap(keys);
+    m_tableCells.swap(cells);
+}
+
+void SpatialHashGrid::build(const StateView& state, int dims)
+{
+    const int n = state.numParticles();
+
+    // size the table for last build's occupancy, so it shrinks again
+    // after a splash settles
+    int capacity = nextPowerOfTwo(2 * numOccupiedCells());
+    if (capacity != (int) m_tableKeys.size()) {
+        m_tableKeys.assign(capacity, EMPTY_KEY);
+        m_tableCells.assign(capacity, -1);
+    } else {
+        fill(m_tableKeys.begin(), m_tableKeys.end(), EMPTY_KEY);
+    }
+
+    // cell of every particle, counting particles per cell into
+    // m_cellStart[cell + 1]
+    m_cellStart.assign(1, 0);
+    m_particleCell.resize(n);
+    for (int i = 0; i < n; ++i) {
+        int coordinate[3] = { 0, 0, 0 };
+        for (int c = 0; c < dims; ++c) {
+            coordinate[c] = cellCoordinate(state.channel(PX + c)[i], c);
+        }
+        int cell = insert(packKey(coordinate[0], coordinate[1], coordinate[2]));
+        m_particleCell[i] = cell;
+        ++m_cellStart[cell + 1];
+    }
+
+    const int numCells = numOccupiedCells();
+    for (int c = 0; c < numCells; ++c) {
+        m_cellStart[c + 1] += m_cellStart[c];
+    }
+
+    // scatter; m_cellStart[c] serves as the insertion cursor of cell c,
+    // ending up at the start of cell c+1, so shift back afterwards
+    m_particles.resize(n);
+    for (int i = 0; i < n; ++i) {
+        m_particles[m_cellStart[m_particleCell[i]]++] = i;
+    }
+    for (int c = numCells; c > 0; --c) {
+        m_cellStart[c] = m_cellStart[c - 1];
+    }
+    m_cellStart[0] = 0;
+}
+
+size_t SpatialHashGrid::memoryBytes() const
+{
+    return m_tableKeys.capacity() * sizeof(uint64_t) + m_tableCells.capacity() * sizeof(int) +
+           m_cellStart.capacity() * sizeof(int);
+}
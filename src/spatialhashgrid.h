@@ -0,0 +1,67 @@
+#ifndef SPATIALHASHGRID_H
+#define SPATIALHASHGRID_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "particlestore.h"
+
+// Uniform grid over an unbounded domain. Only occupied cells exist: they
+// are found through an open-addressing hash table on the cell
+// coordinates, so memory grows with the number of occupied cells rather
+// than with the extent of the domain.
+//
+// build() sorts the particles by cell (counting sort over the occupied
+// cells). Within a cell they stay in index order, and cells are numbered
+// in the order their first particle appears, so the result only depends
+// on the input.
+class SpatialHashGrid
+{
+public:
+    SpatialHashGrid();
+
+    // cells are cubes of size cellSize with a corner at origin
+    void configure(float cellSize, const Vector3f& origin);
+    float cellSize() const { return m_cellSize; }
+
+    // cell coordinate of position p along axis (0, 1, 2). Coordinates are
+    // clamped to +-2^20 cells (and NaN to the lower limit).
+    int cellCoordinate(float p, int axis) const;
+
+    // bins the particles of state by their first dims coordinates; in 2D
+    // all cells have z coordinate 0
+    void build(const StateView& state, int dims);
+
+    int numOccupiedCells() const { return (int) m_cellStart.size() - 1; }
+    // index of the occupied cell (x, y, z), or -1 if it is empty
+    int findCell(int x, int y, int z) const;
+    // the particles in occupied cell c are
+    // particles()[cellStart(c)] .. particles()[cellStart(c + 1) - 1]
+    int cellStart(int c) const { return m_cellStart[c]; }
+    const std::vector<int>& particles() const { return m_particles; }
+
+    // bytes held by the table and cell arrays
+    std::size_t memoryBytes() const;
+
+private:
+    static uint64_t packKey(int x, int y, int z);
+    int insert(uint64_t key);
+    void rehash(int capacity);
+
+    float m_cellSize;
+    float m_inverseCellSize;
+    float m_origin[3];
+
+    // open-addressing table with linear probing; EMPTY_KEY marks free
+    // entries. m_tableCells holds the cell index of each used entry.
+    std::vector<uint64_t> m_tableKeys;
+    std::vector<int> m_tableCells;
+
+    std::vector<int> m_cellStart;
+    std::vector<int> m_particles;
+    // cell of each particle, reused between builds
+    std::vector<int> m_particleCell;
+};
+
+#endif
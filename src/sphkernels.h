@@ -0,0 +1,138 @@
+#ifndef SPHKERNELS_H
+#define SPHKERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// SPH smoothing kernels with support radius h. The normalization factors
+// are computed once at construction and evaluation has no branches, so
+// the functors inline into the per-pair loops. Each one documents
+// whether it takes the distance r or its square.
+
+const float SPH_PI = 3.14159265358979323846f;
+
+// Poly6 density kernel, 315 / (64 pi h^9) (h^2 - r^2)^3; works on r^2 so
+// the density pass needs no square roots.
+struct Poly6Kernel
+{
+    explicit Poly6Kernel(float h)
+        : h2(h * h), coefficient(315.0f / (64.0f * SPH_PI * std::pow(h, 9.0f))) {}
+
+    float operator()(float r2) const
+    {
+        float d = std::max(h2 - r2, 0.0f);
+        return coefficient * d * d * d;
+    }
+
+    float h2;
+    float coefficient;
+};
+
+// Spiky pressure kernel gradient, as the factor g(r) with
+// grad W(r_ij) = g(r) r_ij, where g(r) = (h - r)^2 / (pi h^5 r). This is
+// the 2D spiky gradient without its constant factor, which the gas
+// constant absorbs. r must be positive.
+struct SpikyGradientKernel
+{
+    explicit SpikyGradientKernel(float h)
+        : h(h), coefficient(1.0f / (SPH_PI * std::pow(h, 5.0f))) {}
+
+    float operator()(float r) const
+    {
+        float d = std::max(h - r, 0.0f);
+        return coefficient * d * d / r;
+    }
+
+    float h;
+    float coefficient;
+};
+
+// Viscosity kernel Laplacian (2D), 40 / (pi h^5) (h - r).
+struct ViscosityLaplacianKernel
+{
+    explicit ViscosityLaplacianKernel(float h)
+        : h(h), coefficient(40.0f / (SPH_PI * std::pow(h, 5.0f))) {}
+
+    float operator()(float r) const
+    {
+        return coefficient * std::max(h - r, 0.0f);
+    }
+
+    float h;
+    float coefficient;
+};
+
+// Normalized cubic B-spline kernel with support radius h, in 2D or 3D,
+// with its exact gradient. Used by the incompressible solver, which needs
+// the density kernel and the gradient to match.
+struct CubicSplineKernel
+{
+    CubicSplineKernel(float h, int dims)
+        : h(h), inverseH(1.0f / h),
+          coefficient(dims == 3 ? 8.0f / (SPH_PI * h * h * h) : 40.0f / (7.0f * SPH_PI * h * h)) {}
+
+    // W(r), taking r^2
+    float operator()(float r2) const
+    {
+        float q = std::sqrt(r2) * inverseH;
+        if (q <= 0.5f) {
+            return coefficient * (6.0f * (q * q * q - q * q) + 1.0f);
+        }
+        float d = std::max(1.0f - q, 0.0f);
+        return coefficient * 2.0f * d * d * d;
+    }
+
+    // the factor g(r) with grad W(r_ij) = g(r) r_ij; r must be positive
+    float gradient(float r) const
+    {
+        float q = r * inverseH;
+        float dWdq;
+        if (q <= 0.5f) {
+            dWdq = 6.0f * (3.0f * q * q - 2.0f * q);
+        } else {
+            float d = std::max(1.0f - q, 0.0f);
+            dWdq = -6.0f * d * d;
+        }
+        return coefficient * inverseH * dWdq / r;
+    }
+
+    float h;
+    float inverseH;
+    float coefficient;
+};
+
+// Piecewise-linear table of a kernel over squared distance, up to
+// maxRadius (normally the neighbor radius; beyond it the last sample is
+// returned). Lets kernels of r be evaluated without the square root.
+class TabulatedKernel
+{
+public:
+    TabulatedKernel() : m_scale(0), m_samples(0) {}
+
+    // kernelOfR maps a distance r to the kernel value
+    template <typename Function>
+    TabulatedKernel(const Function& kernelOfR, float maxRadius, int samples = 1024)
+        : m_scale(samples / (maxRadius * maxRadius)), m_samples(samples), m_values(samples + 2)
+    {
+        for (int k = 0; k <= samples; ++k) {
+            m_values[k] = kernelOfR(std::sqrt(k / m_scale));
+        }
+        m_values[samples + 1] = m_values[samples];
+    }
+
+    float operator()(float r2) const
+    {
+        float x = std::min(r2 * m_scale, (float) m_samples);
+        int k = (int) x;
+        float t = x - k;
+        return m_values[k] + t * (m_values[k + 1] - m_values[k]);
+    }
+
+private:
+    float m_scale;
+    int m_samples;
+    std::vector<float> m_values;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "statekernels.h"
+
+#include <cassert>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STATEKERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+typedef void (*AxpyFn)(float*, const float*, float, const float*, int);
+typedef void (*CombineFn)(float*, const float*, int, const float*, const float* const*, int);
+
+// ---- portable reference versions; also used for the vector tails ----
+
+void axpyScalar(float* y, const float* x, float a, const float* k, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        y[i] = x[i] + a * k[i];
+    }
+}
+
+void combineScalar(float* y, const float* x, int m, const float* c, const float* const* ks, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        float acc = c[0] * ks[0][i];
+        for (int t = 1; t < m; ++t) {
+            acc += c[t] * ks[t][i];
+        }
+        y[i] = x ? x[i] + acc : acc;
+    }
+}
+
+#ifdef STATEKERNELS_X86
+
+// SSE2 is part of the x86-64 baseline, so these need no target attribute
+void axpySse2(float* y, const float* x, float a, const float* k, int n)
+{
+    const __m128 va = _mm_set1_ps(a);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 r = _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(va, _mm_loadu_ps(k + i)));
+        _mm_storeu_ps(y + i, r);
+    }
+    axpyScalar(y + i, x + i, a, k + i, n - i);
+}
+
+void combineSse2(float* y, const float* x, int m, const float* c, const float* const* ks, int n)
+{
+    __m128 vc[MAX_COMBINE_TERMS];
+    for (int t = 0; t < m; ++t) {
+        vc[t] = _mm_set1_ps(c[t]);
+    }
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 acc = _mm_mul_ps(vc[0], _mm_loadu_ps(ks[0] + i));
+        for (int t = 1; t < m; ++t) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(vc[t], _mm_loadu_ps(ks[t] + i)));
+        }
+        if (x) {
+            acc = _mm_add_ps(_mm_loadu_ps(x + i), acc);
+        }
+        _mm_storeu_ps(y + i, acc);
+    }
+    const float* tails[MAX_COMBINE_TERMS];
+    for (int t = 0; t < m; ++t) {
+        tails[t] = ks[t] + i;
+    }
+    combineScalar(y + i, x ? x + i : nullptr, m, c, tails, n - i);
+}
+
+__attribute__((target("avx2")))
+void axpyAvx2(float* y, const float* x, float a, const float* k, int n)
+{
+    const __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 r = _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(va, _mm256_loadu_ps(k + i)));
+        _mm256_storeu_ps(y + i, r);
+    }
+    axpyScalar(y + i, x + i, a, k + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void combineAvx2(float* y, const float* x, int m, const float* c, const float* const* ks, int n)
+{
+    __m256 vc[MAX_COMBINE_TERMS];
+    for (int t = 0; t < m; ++t) {
+        vc[t] = _mm256_set1_ps(c[t]);
+    }
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 acc = _mm256_mul_ps(vc[0], _mm256_loadu_ps(ks[0] + i));
+        for (int t = 1; t < m; ++t) {
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(vc[t], _mm256_loadu_ps(ks[t] + i)));
+        }
+        if (x) {
+            acc = _mm256_add_ps(_mm256_loadu_ps(x + i), acc);
+        }
+        _mm256_storeu_ps(y + i, acc);
+    }
+    const float* tails[MAX_COMBINE_TERMS];
+    for (int t = 0; t < m; ++t) {
+        tails[t] = ks[t] + i;
+    }
+    combineScalar(y + i, x ? x + i : nullptr, m, c, tails, n - i);
+}
+
+#endif
+
+struct Dispatch
+{
+    AxpyFn axpy;
+    CombineFn combine;
+    const char* isa;
+
+    Dispatch() : axpy(axpyScalar), combine(combineScalar), isa("scalar")
+    {
+#ifdef STATEKERNELS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            axpy = axpyAvx2; combine = combineAvx2; isa = "avx2";
+        } else if (__builtin_cpu_supports("sse2")) {
+            axpy = axpySse2; combine = combineSse2; isa = "sse2";
+        }
+#endif
+    }
+};
+
+const Dispatch& dispatch()
+{
+    static const Dispatch d;
+    return d;
+}
+
+}
+
+void stateAxpy(float* y, const float* x, float a, const float* k, int n)
+{
+    dispatch().axpy(y, x, a, k, n);
+}
+
+void stateCombine(float* y, const float* x, int numTerms,
+                  const float* coeffs, const float* const* ks, int n)
+{
+    assert(numTerms >= 1 && numTerms <= MAX_COMBINE_TERMS);
+    dispatch().combine(y, x, numTerms, coeffs, ks, n);
+}
+
+const char* stateKernelIsa()
+{
+    return dispatch().isa;
+}
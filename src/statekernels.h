@@ -0,0 +1,29 @@
+#ifndef STATEKERNELS_H
+#define STATEKERNELS_H
+
+// Vectorized kernels for combining flat state/derivative blocks, used by
+// the timesteppers. The implementation is picked once at startup:
+// AVX2 or SSE2 on x86, plain C++ elsewhere. All paths round identically,
+// so results do not depend on the machine, as long as statekernels.cpp is
+// built without floating-point contraction (-ffp-contract=off, which the
+// CMake build sets): GCC otherwise fuses the plain C++ loops into FMAs on
+// targets such as AArch64.
+//
+// Blocks may alias (e.g. y == x). n need not be a multiple of the
+// vector width, but ParticleStore blocks always are.
+
+// largest number of terms stateCombine accepts
+const int MAX_COMBINE_TERMS = 8;
+
+// y[i] = x[i] + a * k[i]
+void stateAxpy(float* y, const float* x, float a, const float* k, int n);
+
+// y[i] = x[i] + (coeffs[0] * ks[0][i] + ... + coeffs[m-1] * ks[m-1][i])
+// x may be nullptr, in which case y is just the weighted sum.
+void stateCombine(float* y, const float* x, int numTerms,
+                  const float* coeffs, const float* const* ks, int n);
+
+// name of the instruction set the kernels dispatched to
+const char* stateKernelIsa();
+
+#endif
@@ -0,0 +1,458 @@
+#include "surfacemesher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+#include "threadpool.h"
+
+using namespace std;
+
+namespace
+{
+// samples per block side: the BLOCK_SIZE + 1 nodes and one apron node on
+// either side
+const int SAMPLES = SurfaceMesher::BLOCK_SIZE + 3;
+const int BLOCK_SAMPLES = SAMPLES * SAMPLES * SAMPLES;
+
+// integral of a particle's splat over space, in units of radius^3:
+// 4 pi * 16 / 315
+const float SPLAT_VOLUME = 0.638f;
+// a cell is inside the fluid if its particles, spread over it, would make
+// the field this many times the contour level
+const float FULL_CELL_FIELD = 2.0f;
+
+// block coordinates are stored in 21 bits each, as in SpatialHashGrid
+const int COORDINATE_OFFSET = 1 << 20;
+const uint64_t COORDINATE_MASK = (1u << 21) - 1;
+
+inline uint64_t packBlock(int x, int y, int z)
+{
+    return ((uint64_t) (x + COORDINATE_OFFSET) & COORDINATE_MASK) << 42 |
+           ((uint64_t) (y + COORDINATE_OFFSET) & COORDINATE_MASK) << 21 |
+           ((uint64_t) (z + COORDINATE_OFFSET) & COORDINATE_MASK);
+}
+
+inline int unpackBlock(uint64_t key, int axis)
+{
+    return (int) (key >> (42 - 21 * axis) & COORDINATE_MASK) - COORDINATE_OFFSET;
+}
+
+// Cube corner c is at (c & 1, c >> 1 & 1, c >> 2 & 1); edge e joins
+// corners EDGE_CORNERS[e][0] and [1].
+const int EDGE_CORNERS[12][2] = {
+    { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 },
+    { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+    { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 },
+};
+
+// corners of each face, counterclockwise seen from outside the cube
+const int FACE_CORNERS[6][4] = {
+    { 0, 4, 6, 2 }, { 1, 3, 7, 5 },
+    { 0, 1, 5, 4 }, { 2, 6, 7, 3 },
+    { 0, 2, 3, 1 }, { 4, 5, 7, 6 },
+};
+
+int edgeBetween(int a, int b)
+{
+    for (int e = 0; e < 12; ++e) {
+        if ((EDGE_CORNERS[e][0] == a && EDGE_CORNERS[e][1] == b) ||
+            (EDGE_CORNERS[e][0] == b && EDGE_CORNERS[e][1] == a)) {
+            return e;
+        }
+    }
+    return -1;
+}
+
+// Marching cubes triangles for each of the 256 inside/outside corner
+// patterns, as edge triples ending in -1.
+struct TriangleTable
+{
+    signed char edges[256][16];
+};
+
+// Derives the table instead of spelling it out. On every face the
+// contour segments are found by walking its corners: each run of inside
+// corners is cut off by a segment from the edge where the walk leaves the
+// run back to the edge where it entered it. Faces shared by two cubes
+// are cut the same way from both, so the mesh is closed, including on
+// faces with two diagonal inside corners, which are always kept apart.
+// Following the segments from edge to edge gives the contour polygons,
+// fanned into triangles that face away from the inside corners.
+TriangleTable buildTriangleTable()
+{
+    TriangleTable table;
+    for (int pattern = 0; pattern < 256; ++pattern) {
+        int next[12];
+        fill(next, next + 12, -1);
+        for (int f = 0; f < 6; ++f) {
+            const int* corners = FACE_CORNERS[f];
+            for (int k = 0; k < 4; ++k) {
+                int a = corners[k];
+                int b = corners[(k + 1) % 4];
+                if (!(pattern >> a & 1) || (pattern >> b & 1)) {
+                    continue;
+                }
+                // leaving a run of inside corners; find where it began
+                int m = k;
+                do {
+                    m = (m + 3) % 4;
+                } while ((pattern >> corners[m] & 1) || !(pattern >> corners[(m + 1) % 4] & 1));
+                next[edgeBetween(a, b)] = edgeBetween(corners[m], corners[(m + 1) % 4]);
+            }
+        }
+
+        int count = 0;
+        bool visited[12] = { false };
+        for (int start = 0; start < 12; ++start) {
+            if (next[start] < 0 || visited[start]) {
+                continue;
+            }
+            int polygon[12];
+            int length = 0;
+            for (int e = start; !visited[e]; e = next[e]) {
+                visited[e] = true;
+                polygon[length++] = e;
+            }
+            for (int t = 1; t + 1 < length; ++t) {
+                table.edges[pattern][count++] = (signed char) polygon[0];
+                table.edges[pattern][count++] = (signed char) polygon[t + 1];
+                table.edges[pattern][count++] = (signed char) polygon[t];
+            }
+        }
+        table.edges[pattern][count] = -1;
+    }
+    return table;
+}
+
+const TriangleTable& triangleTable()
+{
+    static const TriangleTable table = buildTriangleTable();
+    return table;
+}
+
+// floor without the library call; v must be well within int range
+inline int floorToInt(float v)
+{
+    int i = (int) v;
+    return i - (v < i);
+}
+
+inline int sampleIndex(int i, int j, int k)
+{
+    return (k * SAMPLES + j) * SAMPLES + i;
+}
+}
+
+SurfaceMesher::SurfaceMesher()
+    : m_voxelSize(1), m_radius(1), m_isoLevel(0.5f), m_reach(1), m_fullCell(1), m_interiorBlocks(0),
+      m_builds(0), m_lastBuildSeconds(0)
+{
+    configure(m_voxelSize, m_radius, m_isoLevel);
+}
+
+void SurfaceMesher::configure(float voxelSize, float radius, float isoLevel)
+{
+    m_voxelSize = voxelSize;
+    m_radius = radius;
+    m_isoLevel = isoLevel;
+    const float blockSize = BLOCK_SIZE * voxelSize;
+    // the apron node just outside a block must still be covered
+    m_reach = max(1, (int) ceil((radius + voxelSize) / blockSize));
+    m_blockGrid.configure(blockSize, Vector3f(0, 0, 0));
+    m_cellGrid.configure(radius, Vector3f(0, 0, 0));
+    m_fullCell = max(1, (int) ceil(FULL_CELL_FIELD * isoLevel / SPLAT_VOLUME));
+}
+
+// Whether block (x, y, z) lies deep enough inside the fluid that the
+// contour cannot pass through it: every cell within a radius of its nodes
+// is full. A cell short of particles anywhere near makes it a surface
+// block.
+bool SurfaceMesher::interiorBlock(int x, int y, int z) const
+{
+    const int block[3] = { x, y, z };
+    int first[3], last[3];
+    for (int a = 0; a < 3; ++a) {
+        const float low = block[a] * BLOCK_SIZE * m_voxelSize;
+        first[a] = m_cellGrid.cellCoordinate(low - m_radius, a);
+        last[a] = m_cellGrid.cellCoordinate(low + BLOCK_SIZE * m_voxelSize + m_radius, a);
+    }
+    for (int cz = first[2]; cz <= last[2]; ++cz)
+    for (int cy = first[1]; cy <= last[1]; ++cy)
+    for (int cx = first[0]; cx <= last[0]; ++cx) {
+        int cell = m_cellGrid.findCell(cx, cy, cz);
+        if (cell < 0 || m_cellGrid.cellStart(cell + 1) - m_cellGrid.cellStart(cell) < m_fullCell) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SurfaceMesher::build(const StateView& state)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    m_blockGrid.build(state, 3);
+    m_cellGrid.build(state, 3);
+
+    // every block that the splat of a particle, or its apron, reaches
+    const float reachDistance = m_radius + m_voxelSize;
+    m_blockKeys.clear();
+    const vector<int>& binned = m_blockGrid.particles();
+    for (int c = 0; c < m_blockGrid.numOccupiedCells(); ++c) {
+        Vector3f low = state.positionAt(binned[m_blockGrid.cellStart(c)]);
+        Vector3f high = low;
+        for (int k = m_blockGrid.cellStart(c) + 1; k < m_blockGrid.cellStart(c + 1); ++k) {
+            Vector3f p = state.positionAt(binned[k]);
+            for (int a = 0; a < 3; ++a) {
+                low[a] = min(low[a], p[a]);
+                high[a] = max(high[a], p[a]);
+            }
+        }
+        int first[3], last[3];
+        for (int a = 0; a < 3; ++a) {
+            first[a] = m_blockGrid.cellCoordinate(low[a] - reachDistance, a);
+            last[a] = m_blockGrid.cellCoordinate(high[a] + reachDistance, a);
+        }
+        for (int z = first[2]; z <= last[2]; ++z)
+        for (int y = first[1]; y <= last[1]; ++y)
+        for (int x = first[0]; x <= last[0]; ++x)
+            m_blockKeys.push_back(packBlock(x, y, z));
+    }
+    sort(m_blockKeys.begin(), m_blockKeys.end());
+    m_blockKeys.erase(unique(m_blockKeys.begin(), m_blockKeys.end()), m_blockKeys.end());
+    // the field stays above the contour level in interior blocks, so they
+    // would never have triangles
+    const size_t reached = m_blockKeys.size();
+    m_blockKeys.erase(remove_if(m_blockKeys.begin(), m_blockKeys.end(), [&](uint64_t key) {
+        return interiorBlock(unpackBlock(key, 0), unpackBlock(key, 1), unpackBlock(key, 2));
+    }), m_blockKeys.end());
+    m_interiorBlocks = (int) (reached - m_blockKeys.size());
+    const int numBlocks = (int) m_blockKeys.size();
+    m_blocks.resize(3 * numBlocks);
+    for (int b = 0; b < numBlocks; ++b) {
+        for (int c = 0; c < 3; ++c) {
+            m_blocks[3*b + c] = unpackBlock(m_blockKeys[b], c);
+        }
+    }
+
+    // the buffers only grow, so steady scenes do not allocate
+    if (m_fields.size() < (size_t) numBlocks * BLOCK_SAMPLES) {
+        m_fields.resize((size_t) numBlocks * BLOCK_SAMPLES);
+    }
+    if ((int) m_blockPositions.size() < numBlocks) {
+        m_blockPositions.resize(numBlocks);
+        m_blockNormals.resize(numBlocks);
+    }
+    parallelFor(0, numBlocks, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b) {
+            float* field = m_fields.data() + (size_t) b * BLOCK_SAMPLES;
+            sampleBlock(state, b, field);
+            polygonizeBlock(b, field);
+        }
+    }, 1);
+
+    size_t vertices = 0;
+    for (int b = 0; b < numBlocks; ++b) {
+        vertices += m_blockPositions[b].size();
+    }
+    m_positions.clear();
+    m_normals.clear();
+    m_positions.reserve(vertices);
+    m_normals.reserve(vertices);
+    for (int b = 0; b < numBlocks; ++b) {
+        m_positions.insert(m_positions.end(), m_blockPositions[b].begin(), m_blockPositions[b].end());
+        m_normals.insert(m_normals.end(), m_blockNormals[b].begin(), m_blockNormals[b].end());
+    }
+
+    ++m_builds;
+    m_lastBuildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Adds the splats of all particles within reach to the samples of block
+// b, in the order of the block grid, so the sums round the same way
+// whichever thread runs the block.
+void SurfaceMesher::sampleBlock(const StateView& state, int b, float* field) const
+{
+    fill(field, field + BLOCK_SAMPLES, 0.0f);
+    // everything in units of voxels. Distances are taken between global
+    // sample and particle coordinates, so samples on the faces shared
+    // with other blocks come out bit for bit the same in each.
+    const float inverseVoxel = 1.0f / m_voxelSize;
+    const float radius = m_radius * inverseVoxel;
+    const float radius2 = radius * radius;
+    const float inverseRadius6 = 1.0f / (radius2 * radius2 * radius2);
+    // global index of sample 0 along each axis
+    int first[3];
+    for (int c = 0; c < 3; ++c) {
+        first[c] = m_blocks[3*b + c] * BLOCK_SIZE - 1;
+    }
+
+    const vector<int>& binned = m_blockGrid.particles();
+    for (int dz = -m_reach; dz <= m_reach; ++dz)
+    for (int dy = -m_reach; dy <= m_reach; ++dy)
+    for (int dx = -m_reach; dx <= m_reach; ++dx) {
+        int cell = m_blockGrid.findCell(m_blocks[3*b] + dx, m_blocks[3*b + 1] + dy, m_blocks[3*b + 2] + dz);
+        if (cell < 0) {
+            continue;
+        }
+        for (int k = m_blockGrid.cellStart(cell); k < m_blockGrid.cellStart(cell + 1); ++k) {
+            const int i = binned[k];
+            float u[3];
+            // samples within the radius, clipped to the block
+            int lo[3], hi[3];
+            bool outside = false;
+            for (int c = 0; c < 3; ++c) {
+                u[c] = state.channel(PX + c)[i] * inverseVoxel;
+                lo[c] = max(floorToInt(u[c] - radius) + 1 - first[c], 0);
+                hi[c] = min(floorToInt(u[c] + radius) - first[c], SAMPLES - 1);
+                outside |= lo[c] > hi[c];
+            }
+            if (outside) {
+                continue;
+            }
+            for (int z = lo[2]; z <= hi[2]; ++z) {
+                float gz = (float) (first[2] + z) - u[2];
+                float rz = radius2 - gz * gz;
+                for (int y = lo[1]; y <= hi[1]; ++y) {
+                    float gy = (float) (first[1] + y) - u[1];
+                    float ryz = rz - gy * gy;
+                    if (ryz <= 0) {
+                        continue;
+                    }
+                    float* row = field + sampleIndex(0, y, z);
+                    for (int x = lo[0]; x <= hi[0]; ++x) {
+                        float gx = (float) (first[0] + x) - u[0];
+                        float w = max(ryz - gx * gx, 0.0f);
+                        row[x] += w * w * w * inverseRadius6;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void SurfaceMesher::polygonizeBlock(int b, const float* field)
+{
+    const TriangleTable& table = triangleTable();
+    const float isoLevel = m_isoLevel;
+    vector<Vector3f>& positions = m_blockPositions[b];
+    vector<Vector3f>& normals = m_blockNormals[b];
+    positions.clear();
+    normals.clear();
+
+    // only blocks the contour passes through have triangles; the others
+    // are skipped without visiting their voxels
+    bool below = false;
+    bool above = false;
+    for (int k = 1; k <= BLOCK_SIZE + 1; ++k)
+    for (int j = 1; j <= BLOCK_SIZE + 1; ++j) {
+        const float* row = field + sampleIndex(0, j, k);
+        for (int i = 1; i <= BLOCK_SIZE + 1; ++i) {
+            below |= row[i] < isoLevel;
+            above |= row[i] >= isoLevel;
+        }
+    }
+    if (!below || !above) {
+        return;
+    }
+
+    int cornerOffset[8];
+    for (int c = 0; c < 8; ++c) {
+        cornerOffset[c] = sampleIndex(c & 1, c >> 1 & 1, c >> 2 & 1);
+    }
+    int first[3];
+    for (int c = 0; c < 3; ++c) {
+        first[c] = m_blocks[3*b + c] * BLOCK_SIZE - 1;
+    }
+    // field gradient at sample (i, j, k), which must not be on the apron
+    auto gradient = [&](int i, int j, int k) {
+        return Vector3f(field[sampleIndex(i + 1, j, k)] - field[sampleIndex(i - 1, j, k)],
+                        field[sampleIndex(i, j + 1, k)] - field[sampleIndex(i, j - 1, k)],
+                        field[sampleIndex(i, j, k + 1)] - field[sampleIndex(i, j, k - 1)]);
+    };
+
+    // the voxels' corners are samples 1 .. BLOCK_SIZE + 1
+    Vector3f edgePosition[12];
+    Vector3f edgeNormal[12];
+    for (int k = 1; k <= BLOCK_SIZE; ++k)
+    for (int j = 1; j <= BLOCK_SIZE; ++j)
+    for (int i = 1; i <= BLOCK_SIZE; ++i) {
+        const float* corners = field + sampleIndex(i, j, k);
+        float values[8];
+        int pattern = 0;
+        for (int c = 0; c < 8; ++c) {
+            values[c] = corners[cornerOffset[c]];
+            pattern |= (values[c] >= isoLevel) << c;
+        }
+        if (pattern == 0 || pattern == 255) {
+            continue;
+        }
+
+        int crossed = 0;
+        for (const signed char* e = table.edges[pattern]; *e >= 0; ++e) {
+            if (crossed >> *e & 1) {
+                continue;
+            }
+            crossed |= 1 << *e;
+            int a = EDGE_CORNERS[*e][0];
+            int c = EDGE_CORNERS[*e][1];
+            float t = (isoLevel - values[a]) / (values[c] - values[a]);
+            Vector3f cornerA(i + (a & 1), j + (a >> 1 & 1), k + (a >> 2 & 1));
+            Vector3f cornerC(i + (c & 1), j + (c >> 1 & 1), k + (c >> 2 & 1));
+            Vector3f sample = cornerA + t * (cornerC - cornerA);
+            edgePosition[*e] = Vector3f(first[0] + sample.x(), first[1] + sample.y(), first[2] + sample.z()) * m_voxelSize;
+            Vector3f gradientA = gradient((int) cornerA.x(), (int) cornerA.y(), (int) cornerA.z());
+            Vector3f gradientC = gradient((int) cornerC.x(), (int) cornerC.y(), (int) cornerC.z());
+            // the field falls off outwards
+            edgeNormal[*e] = -(gradientA + t * (gradientC - gradientA));
+        }
+
+        for (const signed char* e = table.edges[pattern]; *e >= 0; e += 3) {
+            Vector3f facing = Vector3f::cross(edgePosition[e[1]] - edgePosition[e[0]],
+                                              edgePosition[e[2]] - edgePosition[e[0]]);
+            for (int v = 0; v < 3; ++v) {
+                Vector3f normal = edgeNormal[e[v]];
+                // flat spots of the field take the triangle's own normal
+                if (normal.absSquared() == 0) {
+                    normal = facing;
+                }
+                float length = normal.abs();
+                positions.push_back(edgePosition[e[v]]);
+                normals.push_back(length > 0 ? normal / length : Vector3f(0, 1, 0));
+            }
+        }
+    }
+}
+
+size_t SurfaceMesher::memoryBytes() const
+{
+    size_t bytes = m_blockGrid.memoryBytes() + m_cellGrid.memoryBytes() + m_blocks.capacity() * sizeof(int) +
+                   m_blockKeys.capacity() * sizeof(uint64_t) + m_fields.capacity() * sizeof(float) +
+                   (m_positions.capacity() + m_normals.capacity()) * sizeof(Vector3f);
+    for (size_t b = 0; b < m_blockPositions.size(); ++b) {
+        bytes += (m_blockPositions[b].capacity() + m_blockNormals[b].capacity()) * sizeof(Vector3f);
+    }
+    return bytes;
+}
+
+bool SurfaceMesher::writeObj(const string& path) const
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "# fluid surface, %d triangles\n", numTriangles());
+    for (size_t v = 0; v < m_positions.size(); ++v) {
+        fprintf(file, "v %g %g %g\n", m_positions[v].x(), m_positions[v].y(), m_positions[v].z());
+    }
+    for (size_t v = 0; v < m_normals.size(); ++v) {
+        fprintf(file, "vn %g %g %g\n", m_normals[v].x(), m_normals[v].y(), m_normals[v].z());
+    }
+    for (int t = 0; t < numTriangles(); ++t) {
+        int v = 3 * t + 1;
+        fprintf(file, "f %d//%d %d//%d %d//%d\n", v, v, v + 1, v + 1, v + 2, v + 2);
+    }
+    bool failed = ferror(file) != 0;
+    return fclose(file) == 0 && !failed;
+}
@@ -0,0 +1,90 @@
+#ifndef SURFACEMESHER_H
+#define SURFACEMESHER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "particlestore.h"
+#include "spatialhashgrid.h"
+
+// Triangle mesh of the surface of a particle fluid. Every particle adds
+// (1 - r^2 / radius^2)^3 to a scalar field, so a lone particle peaks at
+// 1, and the mesh is the isoLevel contour of that field, found by
+// marching cubes.
+//
+// The field is only sampled in blocks of BLOCK_SIZE^3 voxels that a
+// particle reaches, found through a SpatialHashGrid of block-sized cells,
+// so memory and work follow the fluid rather than the domain. Blocks deep
+// inside the fluid are skipped before sampling: a block is interior when
+// every radius-sized cell within a radius of it holds enough particles
+// to keep the field well above the contour level. Blocks are
+// independent and run on the thread pool; each gathers the splats of the
+// particles around it in a fixed order and writes its own triangles, and
+// the blocks are joined in a fixed order, so the mesh does not depend on
+// the thread count. Triangles do not share vertices; they face
+// out of the fluid and carry the normalized field gradient as normal.
+class SurfaceMesher
+{
+public:
+    SurfaceMesher();
+
+    static const int BLOCK_SIZE = 16;
+
+    void configure(float voxelSize, float radius, float isoLevel);
+    float voxelSize() const { return m_voxelSize; }
+
+    void build(const StateView& state);
+
+    // three vertices per triangle
+    int numTriangles() const { return (int) m_positions.size() / 3; }
+    const std::vector<Vector3f>& positions() const { return m_positions; }
+    const std::vector<Vector3f>& normals() const { return m_normals; }
+
+    int numBlocks() const { return (int) m_blocks.size() / 3; }
+    // blocks a particle reaches that were skipped as interior
+    int numInteriorBlocks() const { return m_interiorBlocks; }
+    // bytes held by the field samples, the block grid and the mesh
+    std::size_t memoryBytes() const;
+    long builds() const { return m_builds; }
+    double lastBuildSeconds() const { return m_lastBuildSeconds; }
+
+    // writes the mesh as a Wavefront OBJ file; false if it cannot be
+    // written
+    bool writeObj(const std::string& path) const;
+
+private:
+    bool interiorBlock(int x, int y, int z) const;
+    void sampleBlock(const StateView& state, int b, float* field) const;
+    void polygonizeBlock(int b, const float* field);
+
+    float m_voxelSize;
+    float m_radius;
+    float m_isoLevel;
+    // blocks a splat can reach beyond the one its particle is in
+    int m_reach;
+
+    // particles binned by block, and by cells as wide as the radius
+    SpatialHashGrid m_blockGrid;
+    SpatialHashGrid m_cellGrid;
+    // particles that make a radius-sized cell count as inside the fluid
+    int m_fullCell;
+    int m_interiorBlocks;
+    // (x, y, z) block coordinates of the sampled blocks, in sorted order
+    std::vector<int> m_blocks;
+    std::vector<uint64_t> m_blockKeys;
+    // field samples, (BLOCK_SIZE + 3)^3 per block: the block's nodes and
+    // one more on every side for the gradient
+    std::vector<float> m_fields;
+    // triangles of each block, joined into the mesh after the parallel pass
+    std::vector<std::vector<Vector3f> > m_blockPositions;
+    std::vector<std::vector<Vector3f> > m_blockNormals;
+
+    std::vector<Vector3f> m_positions;
+    std::vector<Vector3f> m_normals;
+    long m_builds;
+    double m_lastBuildSeconds;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+namespace
+{
+// set while a thread runs chunks, to serialize nested parallelFor calls
+thread_local bool t_insideParallelFor = false;
+
+unique_ptr<ThreadPool>& globalPool()
+{
+    static unique_ptr<ThreadPool> pool(new ThreadPool(1));
+    return pool;
+}
+}
+
+ThreadPool::ThreadPool(int numThreads)
+    : m_body(nullptr), m_begin(0), m_end(0), m_chunkSize(1), m_nextChunk(0),
+      m_numChunks(0), m_busyWorkers(0), m_generation(0), m_stop(false)
+{
+    for (int k = 1; k < numThreads; ++k) {
+        m_workers.push_back(thread(&ThreadPool::workerLoop, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (size_t k = 0; k < m_workers.size(); ++k) {
+        m_workers[k].join();
+    }
+}
+
+void ThreadPool::parallelFor(int begin, int end, ChunkFunction<void> body, int grain)
+{
+    if (end <= begin) {
+        return;
+    }
+    // a few chunks per thread balances uneven particle costs
+    int count = end - begin;
+    int chunkSize = max(grain, (count + 4 * numThreads() - 1) / (4 * numThreads()));
+    if (m_workers.empty() || t_insideParallelFor || chunkSize >= count) {
+        bool nested = t_insideParallelFor;
+        t_insideParallelFor = true;
+        body(begin, end);
+        t_insideParallelFor = nested;
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_body = &body;
+        m_begin = begin;
+        m_end = end;
+        m_chunkSize = chunkSize;
+        m_numChunks = (count + chunkSize - 1) / chunkSize;
+        m_nextChunk = 0;
+        m_busyWorkers = (int) m_workers.size();
+        ++m_generation;
+    }
+    m_wake.notify_all();
+
+    runChunks();
+
+    unique_lock<mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_busyWorkers == 0; });
+    m_body = nullptr;
+}
+
+void ThreadPool::runChunks()
+{
+    t_insideParallelFor = true;
+    for (;;) {
+        int chunk = m_nextChunk++;
+        if (chunk >= m_numChunks) {
+            break;
+        }
+        int chunkBegin = m_begin + chunk * m_chunkSize;
+        (*m_body)(chunkBegin, min(chunkBegin + m_chunkSize, m_end));
+    }
+    t_insideParallelFor = false;
+}
+
+void ThreadPool::workerLoop()
+{
+    long seen = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_wake.wait(lock, [this, seen] { return m_stop || m_generation != seen; });
+            if (m_stop) {
+                return;
+            }
+            seen = m_generation;
+        }
+
+        runChunks();
+
+        lock_guard<mutex> lock(m_mutex);
+        if (--m_busyWorkers == 0) {
+            m_done.notify_one();
+        }
+    }
+}
+
+void setThreadCount(int numThreads)
+{
+    if (numThreads <= 0) {
+        numThreads = max(1, (int) thread::hardware_concurrency());
+    }
+    globalPool().reset(new ThreadPool(numThreads));
+}
+
+int threadCount()
+{
+    return globalPool()->numThreads();
+}
+
+void parallelFor(int begin, int end, ChunkFunction<void> body, int grain)
+{
+    globalPool()->parallelFor(begin, end, body, grain);
+}
+
+float parallelMax(int begin, int end, ChunkFunction<float> chunkMax,
+                  float initial, int grain)
+{
+    // max is order independent, so the result does not depend on how
+    // the chunks were scheduled
+    mutex resultMutex;
+    float result = initial;
+    parallelFor(begin, end, [&](int chunkBegin, int chunkEnd) {
+        float value = chunkMax(chunkBegin, chunkEnd);
+        lock_guard<mutex> lock(resultMutex);
+        if (value > result) {
+            result = value;
+        }
+    }, grain);
+    return result;
+}
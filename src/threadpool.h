@@ -0,0 +1,86 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Non-owning reference to a callable taking (chunkBegin, chunkEnd). A
+// lambda passed to parallelFor is referenced rather than copied into a
+// std::function, which would allocate on every call once its captures
+// outgrow the small-object buffer. It must outlive the call, which a
+// temporary argument does.
+template <typename Result>
+class ChunkFunction
+{
+public:
+    template <typename Function>
+    ChunkFunction(const Function& function) : m_function(&function), m_call(&call<Function>) {}
+
+    Result operator()(int chunkBegin, int chunkEnd) const { return m_call(m_function, chunkBegin, chunkEnd); }
+
+private:
+    template <typename Function>
+    static Result call(const void* function, int chunkBegin, int chunkEnd)
+    {
+        return (*static_cast<const Function*>(function))(chunkBegin, chunkEnd);
+    }
+
+    const void* m_function;
+    Result (*m_call)(const void*, int, int);
+};
+
+// Fixed set of worker threads that run the chunks of a parallelFor. The
+// calling thread works along, so a pool of n threads has n - 1 workers.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();
+
+    int numThreads() const { return (int) m_workers.size() + 1; }
+
+    // calls body(chunkBegin, chunkEnd) on disjoint chunks covering
+    // [begin, end), each at least grain long (but the last), and returns
+    // when all are done. Chunks are handed out dynamically, so body must
+    // not depend on which thread runs which chunk; results stay
+    // deterministic as long as every index only writes its own outputs.
+    // Calls from inside a body run serially on the calling thread.
+    void parallelFor(int begin, int end, ChunkFunction<void> body, int grain = 64);
+
+private:
+    void workerLoop();
+    void runChunks();
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+
+    // the job in progress
+    const ChunkFunction<void>* m_body;
+    int m_begin;
+    int m_end;
+    int m_chunkSize;
+    std::atomic<int> m_nextChunk;
+    int m_numChunks;
+    int m_busyWorkers;
+    long m_generation;
+    bool m_stop;
+};
+
+// Process-wide pool used by the simulation. setThreadCount replaces it;
+// 0 picks the number of hardware threads. Defaults to 1 thread.
+void setThreadCount(int numThreads);
+int threadCount();
+void parallelFor(int begin, int end, ChunkFunction<void> body, int grain = 64);
+
+// largest of initial and chunkMax(chunkBegin, chunkEnd) over chunks
+// covering [begin, end), on the process-wide pool. NaN chunk results are
+// ignored.
+float parallelMax(int begin, int end, ChunkFunction<float> chunkMax,
+                  float initial = 0, int grain = 1024);
+
+#endif
@@ -1,79 +1,489 @@
 #include "timestepper.h"
+#include "statekernels.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <cstdio>
 #include <iostream>
 
 using namespace std;
 
+void ScratchArena::reserve(int numBlocks, int blockSize, int numParticles)
+{
+    size_t needed = (size_t) numBlocks * blockSize;
+    if (needed > m_storage.size()) {
+        AlignedFloats storage(needed, 0.0f);
+        m_storage.swap(storage);
+        ++m_growths;
+    } else if (blockSize != m_blockSize) {
+        // the layout changed, so old data may sit in what are now padding lanes
+        std::fill(m_storage.begin(), m_storage.end(), 0.0f);
+    } else if (numParticles < m_numParticles) {
+        // same layout with fewer particles: clear the lanes they left
+        const int stride = blockSize / NUM_STATE_CHANNELS;
+        for (size_t channel = 0; channel < m_storage.size() / stride; ++channel) {
+            float* lanes = m_storage.data() + channel * stride;
+            std::fill(lanes + numParticles, lanes + std::min(m_numParticles, stride), 0.0f);
+        }
+    }
+    m_numBlocks = numBlocks;
+    m_blockSize = blockSize;
+    m_numParticles = numParticles;
+}
+
+void TimeStepper::printStats(std::ostream& out) const
+{
+    out << "scratch arena growths in last step: " << m_arenaGrowthsLastStep << endl;
+    out << "state kernels: " << stateKernelIsa() << endl;
+}
+
+void TimeStepper::prepareScratch(ParticleSystem* particleSystem, int numBlocks)
+{
+    long before = m_scratch.growths();
+    const ParticleStore& store = particleSystem->store();
+    m_scratch.reserve(numBlocks, store.stateSize(), store.size());
+    m_arenaGrowthsLastStep = m_scratch.growths() - before;
+}
+
+StateView TimeStepper::scratchState(ParticleSystem* particleSystem, int i)
+{
+    const ParticleStore& store = particleSystem->store();
+    return StateView(m_scratch.block(i), store.size(), store.stride());
+}
+
+DerivativeView TimeStepper::scratchDerivative(ParticleSystem* particleSystem, int i)
+{
+    const ParticleStore& store = particleSystem->store();
+    return DerivativeView(m_scratch.block(i), store.size(), store.stride());
+}
+
 void ForwardEuler::takeStep(ParticleSystem* particleSystem, float stepSize)
 {
    //TODO: See handout 3.1 
-  vector<Vector3f> newState;
-  vector<Vector3f> oldState = particleSystem->getState();
-  vector<Vector3f> f0derivative = particleSystem->evalF(oldState);
+  prepareScratch(particleSystem, 1);
+  ParticleStore& store = particleSystem->store();
+  const int n = store.stateSize();
+  float* state = store.data();
+  const float* f0 = m_scratch.block(0);
 
-  for (int i=0; i<(int) f0derivative.size(); ++i) {
-    newState.push_back(oldState.at(i) + stepSize*f0derivative.at(i));
-  }
+  DerivativeView f0derivative = scratchDerivative(particleSystem, 0);
+  particleSystem->evalF(store.view(), f0derivative);
 
-  particleSystem->setState(newState);
+  stateAxpy(state, state, stepSize, f0, n);
 }
 
 void Trapezoidal::takeStep(ParticleSystem* particleSystem, float stepSize)
 {
    //TODO: See handout 3.1 
-  vector<Vector3f> newState;
-  vector<Vector3f> oldState = particleSystem->getState();
-  vector<Vector3f> f0derivative = particleSystem->evalF(oldState);
-  vector<Vector3f> intermediateState;
+  prepareScratch(particleSystem, 3);
+  ParticleStore& store = particleSystem->store();
+  const int n = store.stateSize();
+  float* state = store.data();
+  const float* f0 = m_scratch.block(0);
+  const float* f1 = m_scratch.block(1);
+  float* intermediateState = m_scratch.block(2);
 
-  for (int i=0; i<(int) f0derivative.size(); ++i) {
-    intermediateState.push_back(oldState.at(i) + stepSize*f0derivative.at(i));
-  }
+  DerivativeView f0derivative = scratchDerivative(particleSystem, 0);
+  particleSystem->evalF(store.view(), f0derivative);
 
-  vector<Vector3f> f1derivative = particleSystem->evalF(intermediateState);
+  stateAxpy(intermediateState, state, stepSize, f0, n);
 
-  for (int i=0; i<(int) f1derivative.size(); ++i) {
-    newState.push_back(oldState.at(i) + stepSize/2.0*(f0derivative.at(i)+f1derivative.at(i)));
-  }
+  DerivativeView f1derivative = scratchDerivative(particleSystem, 1);
+  particleSystem->evalF(scratchState(particleSystem, 2), f1derivative);
 
-  particleSystem->setState(newState);
+  const float weights[] = { stepSize/2.0f, stepSize/2.0f };
+  const float* const derivatives[] = { f0, f1 };
+  stateCombine(state, state, 2, weights, derivatives, n);
 }
 
 
 void RK4::takeStep(ParticleSystem* particleSystem, float stepSize)
 {
    //TODO: See handout 4.4
-  vector<Vector3f> newState;
-  vector<Vector3f> oldState = particleSystem->getState();
-  vector<Vector3f> k1 = particleSystem->evalF(oldState);
-  vector<Vector3f> intermediateState;
+  prepareScratch(particleSystem, 5);
+  ParticleStore& store = particleSystem->store();
+  const int n = store.stateSize();
+  float* state = store.data();
+  const float* k1 = m_scratch.block(0);
+  const float* k2 = m_scratch.block(1);
+  const float* k3 = m_scratch.block(2);
+  const float* k4 = m_scratch.block(3);
+  float* intermediateState = m_scratch.block(4);
+  StateView intermediateView = scratchState(particleSystem, 4);
+
+  DerivativeView k1view = scratchDerivative(particleSystem, 0);
+  particleSystem->evalF(store.view(), k1view);
+
+  stateAxpy(intermediateState, state, stepSize/2.0f, k1, n);
+
+  DerivativeView k2view = scratchDerivative(particleSystem, 1);
+  particleSystem->evalF(intermediateView, k2view);
+
+  stateAxpy(intermediateState, state, stepSize/2.0f, k2, n);
+
+  DerivativeView k3view = scratchDerivative(particleSystem, 2);
+  particleSystem->evalF(intermediateView, k3view);
+
+  stateAxpy(intermediateState, state, stepSize, k3, n);
+
+  DerivativeView k4view = scratchDerivative(particleSystem, 3);
+  particleSystem->evalF(intermediateView, k4view);
+
+  const float weights[] = { stepSize/6.0f, stepSize/3.0f, stepSize/3.0f, stepSize/6.0f };
+  const float* const stages[] = { k1, k2, k3, k4 };
+  stateCombine(state, state, 4, weights, stages, n);
+}
+
+void SymplecticEuler::takeStep(ParticleSystem* particleSystem, float stepSize)
+{
+  prepareScratch(particleSystem, 1);
+  ParticleStore& store = particleSystem->store();
+  const int n = 3 * store.stride();
+
+  DerivativeView f0 = scratchDerivative(particleSystem, 0);
+  particleSystem->evalF(store.view(), f0);
+
+  stateAxpy(store.channel(VX), store.channel(VX), stepSize, f0.channel(VX), n);
+  stateAxpy(store.channel(PX), store.channel(PX), stepSize, store.channel(VX), n);
+}
+
+namespace
+{
+// arena blocks used by VelocityVerlet: two derivative blocks that swap
+// roles every step, and a copy of the state the current one belongs to
+const int VV_STATE_COPY = 2;
+const int VV_NUM_BLOCKS = 3;
+}
+
+void VelocityVerlet::takeStep(ParticleSystem* particleSystem, float stepSize)
+{
+  int oldBlockSize = m_scratch.blockSize();
+  prepareScratch(particleSystem, VV_NUM_BLOCKS);
+  ParticleStore& store = particleSystem->store();
+  const int n = 3 * store.stride();
+  const float h = stepSize;
+  float* stateCopy = m_scratch.block(VV_STATE_COPY);
+
+  bool cacheValid = m_cacheValid && m_arenaGrowthsLastStep == 0 && oldBlockSize == store.stateSize() &&
+    m_cacheEpoch == particleSystem->derivativeEpoch() &&
+    memcmp(store.data(), stateCopy, store.stateSize() * sizeof(float)) == 0;
+  if (!cacheValid) {
+    DerivativeView f0 = scratchDerivative(particleSystem, m_current);
+    particleSystem->evalF(store.view(), f0);
+  }
+  const float* a0 = scratchDerivative(particleSystem, m_current).channel(VX);
+
+  // x1 = x0 + h v0 + h^2/2 a0, then the first half kick v = v0 + h/2 a0
+  const float weights[] = { h, h*h/2.0f };
+  const float* const terms[] = { store.channel(VX), a0 };
+  stateCombine(store.channel(PX), store.channel(PX), 2, weights, terms, n);
+  stateAxpy(store.channel(VX), store.channel(VX), h/2.0f, a0, n);
+
+  m_current = 1 - m_current;
+  DerivativeView f1 = scratchDerivative(particleSystem, m_current);
+  particleSystem->evalF(store.view(), f1);
+
+  // second half kick with a1
+  stateAxpy(store.channel(VX), store.channel(VX), h/2.0f, f1.channel(VX), n);
+
+  memcpy(stateCopy, store.data(), store.stateSize() * sizeof(float));
+  m_cacheValid = true;
+  m_cacheEpoch = particleSystem->derivativeEpoch();
+}
+
+namespace
+{
+// Dormand-Prince 5(4) tableau. Row 7 of A equals the 5th order weights,
+// which is what makes the last stage reusable (FSAL).
+const float DP_A[7][6] = {
+  { 0 },
+  { 1.0f/5 },
+  { 3.0f/40, 9.0f/40 },
+  { 44.0f/45, -56.0f/15, 32.0f/9 },
+  { 19372.0f/6561, -25360.0f/2187, 64448.0f/6561, -212.0f/729 },
+  { 9017.0f/3168, -355.0f/33, 46732.0f/5247, 49.0f/176, -5103.0f/18656 },
+  { 35.0f/384, 0, 500.0f/1113, 125.0f/192, -2187.0f/6784, 11.0f/84 }
+};
+// difference between the 5th and 4th order weights
+const float DP_E[7] = {
+  71.0f/57600, 0, -71.0f/16695, 71.0f/1920, -17253.0f/339200, 22.0f/525, -1.0f/40
+};
+
+const float DP_SAFETY = 0.9f;
+const float DP_MIN_FACTOR = 0.2f;
+const float DP_MAX_FACTOR = 5.0f;
+// never subdivide an interval into steps smaller than this fraction of it
+const float DP_MIN_STEP_FRACTION = 1e-6f;
+
+// arena blocks past the seven stages
+const int DP_STAGE_INPUT = 7;
+const int DP_NEW_STATE = 8;
+const int DP_ERROR = 9;
+const int DP_NUM_BLOCKS = 10;
+}
+
+DormandPrince::DormandPrince(float absTolerance, float relTolerance)
+  : m_absTolerance(absTolerance), m_relTolerance(relTolerance),
+    m_h(0), m_accepted(0), m_rejected(0), m_abandoned(0), m_fsalValid(false), m_fsalEpoch(0)
+{
+  for (int s=0; s<7; ++s) {
+    m_stage[s] = s;
+  }
+}
+
+void DormandPrince::takeStep(ParticleSystem* particleSystem, float stepSize)
+{
+  int oldBlockSize = m_scratch.blockSize();
+  prepareScratch(particleSystem, DP_NUM_BLOCKS);
+  long growths = m_arenaGrowthsLastStep;
+
+  // k7 of the last accepted step is f(state) unless the arena was
+  // relaid out or someone changed the state or what evalF makes of it
+  // since
+  ParticleStore& store = particleSystem->store();
+  bool k1Valid = m_fsalValid && growths == 0 && oldBlockSize == store.stateSize() &&
+    m_fsalEpoch == particleSystem->derivativeEpoch() &&
+    memcmp(store.data(), m_scratch.block(DP_NEW_STATE), store.stateSize() * sizeof(float)) == 0;
+
+  if (m_h <= 0) {
+    m_h = stepSize;
+  }
+  const float minStep = stepSize * DP_MIN_STEP_FRACTION;
+
+  float remaining = stepSize;
+  while (remaining > minStep) {
+    bool truncated = m_h >= remaining;
+    float h = truncated ? remaining : m_h;
+
+    float error = attemptStep(particleSystem, h, k1Valid);
+    // after a rejection k1 is still f(state); after acceptance it is k7
+    k1Valid = true;
+
+    // a NaN or infinite error is a rejection; once even the smallest step
+    // gives one, the state itself is broken and shrinking cannot help, so
+    // leave it alone and give up on the rest of the interval
+    if (!std::isfinite(error)) {
+      ++m_rejected;
+      if (h <= minStep) {
+        ++m_abandoned;
+        m_h = stepSize;
+        break;
+      }
+      m_h = std::max(minStep, h * DP_MIN_FACTOR);
+      continue;
+    }
+    bool accepted = error <= 1.0f || h <= minStep;
+
+    float factor = error > 0 ? DP_SAFETY * pow(error, -0.2f) : DP_MAX_FACTOR;
+    factor = std::min(DP_MAX_FACTOR, std::max(DP_MIN_FACTOR, factor));
+
+    if (accepted) {
+      memcpy(store.data(), m_scratch.block(DP_NEW_STATE), store.stateSize() * sizeof(float));
+      std::swap(m_stage[0], m_stage[6]);
+      ++m_accepted;
+      remaining -= h;
+      // a step cut short by the end of the interval says little about how
+      // large the next one may be, so only let it shrink m_h
+      if (!truncated || h * factor < m_h) {
+        m_h = h * factor;
+      }
+    } else {
+      ++m_rejected;
+      m_h = std::max(minStep, h * std::min(1.0f, factor));
+    }
+  }
+  m_fsalValid = k1Valid;
+  m_fsalEpoch = particleSystem->derivativeEpoch();
+  m_arenaGrowthsLastStep = growths;
+}
+
+float DormandPrince::attemptStep(ParticleSystem* particleSystem, float h, bool k1Valid)
+{
+  ParticleStore& store = particleSystem->store();
+  const int n = store.stateSize();
+  float* state = store.data();
+  float* newState = m_scratch.block(DP_NEW_STATE);
+  float* error = m_scratch.block(DP_ERROR);
+
+  if (!k1Valid) {
+    DerivativeView k1 = scratchDerivative(particleSystem, m_stage[0]);
+    particleSystem->evalF(store.view(), k1);
+  }
+
+  float coeffs[7];
+  const float* stages[7];
+  for (int s=1; s<7; ++s) {
+    int terms = 0;
+    for (int j=0; j<s; ++j) {
+      if (DP_A[s][j] != 0) {
+        coeffs[terms] = h * DP_A[s][j];
+        stages[terms] = m_scratch.block(m_stage[j]);
+        ++terms;
+      }
+    }
+    // the last stage is evaluated at the 5th order solution itself
+    int input = s == 6 ? DP_NEW_STATE : DP_STAGE_INPUT;
+    stateCombine(m_scratch.block(input), state, terms, coeffs, stages, n);
+
+    DerivativeView k = scratchDerivative(particleSystem, m_stage[s]);
+    particleSystem->evalF(scratchState(particleSystem, input), k);
+  }
+
+  int terms = 0;
+  for (int j=0; j<7; ++j) {
+    if (DP_E[j] != 0) {
+      coeffs[terms] = h * DP_E[j];
+      stages[terms] = m_scratch.block(m_stage[j]);
+      ++terms;
+    }
+  }
+  stateCombine(error, nullptr, terms, coeffs, stages, n);
+
+  // RMS of the error scaled by the mixed absolute/relative tolerance,
+  // over the live lanes of every channel
+  double sum = 0;
+  const int numParticles = store.size();
+  const int stride = store.stride();
+  for (int c=0; c<NUM_STATE_CHANNELS; ++c) {
+    for (int i=c*stride; i<c*stride + numParticles; ++i) {
+      float scale = m_absTolerance + m_relTolerance * std::max(fabs(state[i]), fabs(newState[i]));
+      double e = error[i] / scale;
+      sum += e * e;
+    }
+  }
+  float norm = numParticles > 0 ? (float) sqrt(sum / (NUM_STATE_CHANNELS * numParticles)) : 0.0f;
+
+  return norm;
+}
 
-  for (int i=0; i<(int) k1.size(); ++i) {
-    intermediateState.push_back(oldState.at(i) + stepSize/2.0*k1.at(i));
+void DormandPrince::printStats(std::ostream& out) const
+{
+  TimeStepper::printStats(out);
+  out << "accepted steps: " << m_accepted << ", rejected steps: " << m_rejected
+      << ", abandoned steps: " << m_abandoned
+      << ", current step size: " << m_h << endl;
+}
+
+namespace
+{
+// arena blocks used by ImplicitEuler; vectors in blocks 1-3 hold
+// 3 floats per particle
+const int IE_DERIVATIVE = 0;
+const int IE_RHS = 1;
+const int IE_DELTA_V = 2;
+const int IE_VELOCITY = 3;
+// the solver needs 21 floats per particle; a block has at least 6
+const int IE_SOLVER = 4;
+const int IE_SOLVER_BLOCKS = 4;
+const int IE_NUM_BLOCKS = IE_SOLVER + IE_SOLVER_BLOCKS;
+}
+
+ImplicitEuler::ImplicitEuler(float tolerance, int maxIterations)
+  : m_tolerance(tolerance), m_maxIterations(maxIterations),
+    m_lastIterations(0), m_totalIterations(0), m_steps(0), m_warnedNoJacobians(false)
+{
+}
+
+void ImplicitEuler::takeStep(ParticleSystem* particleSystem, float stepSize)
+{
+  prepareScratch(particleSystem, IE_NUM_BLOCKS);
+  ParticleStore& store = particleSystem->store();
+  const int numParticles = store.size();
+  const float h = stepSize;
+
+  DerivativeView f0 = scratchDerivative(particleSystem, IE_DERIVATIVE);
+  particleSystem->evalF(store.view(), f0);
+
+  if (!particleSystem->hasForceJacobians()) {
+    if (!m_warnedNoJacobians) {
+      cerr << "Implicit Euler: system has no force Jacobians, using forward Euler" << endl;
+      m_warnedNoJacobians = true;
+    }
+    stateAxpy(store.data(), store.data(), h, f0.data(), store.stateSize());
+    return;
   }
 
-  vector<Vector3f> k2 = particleSystem->evalF(intermediateState);
+  particleSystem->evalForceJacobians(store.view(), m_dfdx, m_dfdv);
+  if (m_system.numBlockRows() != m_dfdx.numBlockRows() || m_system.numBlocks() != m_dfdx.numBlocks()) {
+    m_system.copyPattern(m_dfdx);
+  }
 
-  intermediateState.clear();
-  
-  for (int i=0; i<(int) k2.size(); ++i) {
-    intermediateState.push_back(oldState.at(i) + stepSize/2.0*k2.at(i));
+  // A = M - h df/dv - h^2 df/dx
+  m_system.assign(-h, m_dfdv, -h*h, m_dfdx);
+  const float* mass = store.attribute(ParticleStore::MASS);
+  const float* pinned = store.attribute(ParticleStore::PINNED);
+  for (int i=0; i<numParticles; ++i) {
+    float* d = m_system.diagonalBlock(i);
+    float m = mass ? mass[i] : 1.0f;
+    d[0] += m; d[4] += m; d[8] += m;
   }
 
-  vector<Vector3f> k3 = particleSystem->evalF(intermediateState);
+  float* velocity = m_scratch.block(IE_VELOCITY);
+  float* rhs = m_scratch.block(IE_RHS);
+  float* deltaV = m_scratch.block(IE_DELTA_V);
+  for (int c=0; c<3; ++c) {
+    const float* v = store.channel(VX + c);
+    for (int i=0; i<numParticles; ++i) {
+      velocity[3*i + c] = v[i];
+    }
+  }
 
-  intermediateState.clear();
+  // b = h (f0 + h df/dx v0), with f0 = M a0
+  m_dfdx.multiply(velocity, rhs);
+  for (int c=0; c<3; ++c) {
+    const float* a0 = f0.channel(VX + c);
+    for (int i=0; i<numParticles; ++i) {
+      float m = mass ? mass[i] : 1.0f;
+      rhs[3*i + c] = h * (m * a0[i] + h * rhs[3*i + c]);
+    }
+  }
 
-  for (int i=0; i<(int) k3.size(); ++i) {
-    intermediateState.push_back(oldState.at(i) + stepSize*k3.at(i));
+  if (pinned) {
+    for (int i=0; i<numParticles; ++i) {
+      if (pinned[i] != 0.0f) {
+        m_system.constrainRowAndColumn(i);
+        rhs[3*i] = rhs[3*i + 1] = rhs[3*i + 2] = 0.0f;
+      }
+    }
   }
 
-  vector<Vector3f> k4 = particleSystem->evalF(intermediateState);
+  std::fill(deltaV, deltaV + 3*numParticles, 0.0f);
+  m_lastIterations = solveConjugateGradient(m_system, rhs, deltaV,
+    m_scratch.block(IE_SOLVER), m_tolerance, m_maxIterations);
+  m_totalIterations += m_lastIterations;
+  ++m_steps;
+
+  // v1 = v0 + dv, then x1 = x0 + h v1
+  for (int c=0; c<3; ++c) {
+    float* v = store.channel(VX + c);
+    for (int i=0; i<numParticles; ++i) {
+      v[i] += deltaV[3*i + c];
+    }
+  }
+  stateAxpy(store.channel(PX), store.channel(PX), h, store.channel(VX), 3 * store.stride());
+}
 
-  for (int i=0; i<(int) oldState.size(); ++i) {
-    newState.push_back(oldState.at(i) + stepSize/6.0*(k1.at(i) + 2*k2.at(i) + 2*k3.at(i) + k4.at(i)));
+void ImplicitEuler::printStats(std::ostream& out) const
+{
+  TimeStepper::printStats(out);
+  out << "CG iterations in last step: " << m_lastIterations;
+  if (m_steps > 0) {
+    out << ", average: " << (double) m_totalIterations / m_steps;
   }
+  out << endl;
+}
 
-  particleSystem->setState(newState);
+TimeStepper* createTimeStepper(char integrator)
+{
+  switch (integrator) {
+  case 'e': return new ForwardEuler();
+  case 't': return new Trapezoidal();
+  case 'r': return new RK4();
+  case 'a': return new DormandPrince();
+  case 'i': return new ImplicitEuler();
+  case 's': return new SymplecticEuler();
+  case 'v': return new VelocityVerlet();
+  default: return nullptr;
+  }
 }
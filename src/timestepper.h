@@ -2,14 +2,66 @@
 #define INTEGRATOR_H
 
 #include "vecmath.h"
+#include <ostream>
 #include <vector>
 #include "particlesystem.h"
+#include "blocksparsematrix.h"
+
+// Scratch memory owned by a TimeStepper: numBlocks state-sized blocks in
+// one aligned allocation. It is sized once for the system it integrates
+// and reused by every later step; it only reallocates when the system
+// outgrows it.
+class ScratchArena
+{
+public:
+    ScratchArena() : m_numBlocks(0), m_blockSize(0), m_numParticles(0), m_growths(0) {}
+
+    // makes room for numBlocks state blocks of blockSize floats each, for
+    // numParticles particles. Padding lanes of every block start out (and
+    // must stay) zero, including lanes of particles removed since the
+    // last call.
+    void reserve(int numBlocks, int blockSize, int numParticles);
+
+    float* block(int i) { return m_storage.data() + i * m_blockSize; }
+    int blockSize() const { return m_blockSize; }
+
+    // number of times the arena has been reallocated so far
+    long growths() const { return m_growths; }
+
+private:
+    AlignedFloats m_storage;
+    int m_numBlocks;
+    int m_blockSize;
+    int m_numParticles;
+    long m_growths;
+};
 
 class TimeStepper
 {
 public:
+    TimeStepper() : m_arenaGrowthsLastStep(0) {}
     virtual ~TimeStepper() {}
 	virtual void takeStep(ParticleSystem* particleSystem, float stepSize) = 0;
+
+    // times the scratch arena was reallocated during the last takeStep;
+    // zero once it has been sized for the system. This only covers the
+    // arena, not allocations inside evalF; "bench allocations" counts
+    // every heap allocation of a step.
+    long arenaGrowthsLastStep() const { return m_arenaGrowthsLastStep; }
+
+    virtual void printStats(std::ostream& out) const;
+
+protected:
+    // sizes the arena for numBlocks blocks shaped like particleSystem's
+    // state, and records whether that reallocated it
+    void prepareScratch(ParticleSystem* particleSystem, int numBlocks);
+
+    // views of arena block i, laid out like particleSystem's state
+    StateView scratchState(ParticleSystem* particleSystem, int i);
+    DerivativeView scratchDerivative(ParticleSystem* particleSystem, int i);
+
+    ScratchArena m_scratch;
+    long m_arenaGrowthsLastStep;
 };
 
 //IMPLEMENT YOUR TIMESTEPPERS
@@ -29,5 +81,96 @@ class RK4 : public TimeStepper
 	void takeStep(ParticleSystem* particleSystem, float stepSize) override;
 };
 
+// Semi-implicit (symplectic) Euler: v1 = v0 + h a(x0, v0), x1 = x0 + h v1.
+// One force evaluation per step.
+class SymplecticEuler : public TimeStepper
+{
+	void takeStep(ParticleSystem* particleSystem, float stepSize) override;
+};
+
+// Velocity Verlet (kick-drift-kick). The acceleration evaluated at the end
+// of a step is reused at the start of the next one, so a step costs one
+// force evaluation unless the state was changed in between. Velocity
+// dependent forces see the half-step velocity.
+class VelocityVerlet : public TimeStepper
+{
+public:
+    VelocityVerlet() : m_current(0), m_cacheValid(false), m_cacheEpoch(0) {}
+	void takeStep(ParticleSystem* particleSystem, float stepSize) override;
+
+private:
+    // arena block holding a(state) of the last step, and the system's
+    // derivative epoch it was computed in
+    int m_current;
+    bool m_cacheValid;
+    unsigned long m_cacheEpoch;
+};
+
+// Adaptive Dormand-Prince 5(4). takeStep advances the system by exactly
+// stepSize, subdividing it into as many internal steps as the error
+// tolerances require; the internal step size carries over between calls.
+// The last stage of an accepted step is reused as the first stage of the
+// next one (FSAL) unless the state or the system's derivative epoch
+// changed in between.
+class DormandPrince : public TimeStepper
+{
+public:
+    DormandPrince(float absTolerance = 1e-4f, float relTolerance = 1e-3f);
+
+	void takeStep(ParticleSystem* particleSystem, float stepSize) override;
+    void printStats(std::ostream& out) const override;
+
+    long acceptedSteps() const { return m_accepted; }
+    long rejectedSteps() const { return m_rejected; }
+    // calls that gave up because even the smallest step was not finite
+    long abandonedSteps() const { return m_abandoned; }
+
+private:
+    // computes a step of size h from the system's state into the arena and
+    // returns its scaled error norm; the step is acceptable if it is <= 1.
+    // k1Valid says whether the first stage block already holds f(state).
+    float attemptStep(ParticleSystem* particleSystem, float h, bool k1Valid);
+
+    float m_absTolerance;
+    float m_relTolerance;
+    float m_h;
+    long m_accepted;
+    long m_rejected;
+    long m_abandoned;
+    // arena blocks holding k1..k7; rotated so k7 becomes the next k1
+    int m_stage[7];
+    bool m_fsalValid;
+    unsigned long m_fsalEpoch;
+};
+
+// Linearized backward Euler (Baraff & Witkin):
+//   (M - h df/dv - h^2 df/dx) dv = h (f0 + h df/dx v0)
+// solved with block-Jacobi preconditioned conjugate gradients. Stable at
+// step sizes far beyond the explicit steppers for stiff springs. Needs a
+// system with force Jacobians; others are stepped with forward Euler.
+class ImplicitEuler : public TimeStepper
+{
+public:
+    ImplicitEuler(float tolerance = 1e-4f, int maxIterations = 200);
+
+	void takeStep(ParticleSystem* particleSystem, float stepSize) override;
+    void printStats(std::ostream& out) const override;
+
+private:
+    float m_tolerance;
+    int m_maxIterations;
+    BlockSparseMatrix m_dfdx;
+    BlockSparseMatrix m_dfdv;
+    BlockSparseMatrix m_system;
+    int m_lastIterations;
+    long m_totalIterations;
+    long m_steps;
+    bool m_warnedNoJacobians;
+};
+
+// creates the stepper for a command line integrator letter
+// (e, t, r, a, i, s, v); returns nullptr for unknown letters
+TimeStepper* createTimeStepper(char integrator);
+
 /////////////////////////
 #endif
@@ -1,35 +1,34 @@
 #include "watersystem.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include "camera.h"
+#include "threadpool.h"
 #include "vertexrecorder.h"
 #include <iostream>
 
 using namespace std;
 
-const float c_pi = 3.14159265358979323846f;
-
 const float TANK_STANDARD_MINUS = -1.0f;
 const float TANK_STANDARD_PLUS = 1.0f;
-const float PARTICLE_SPACING = 0.08f;
-const float CELL_SPACING = 0.08f;
+// time steps between Morton reorderings of the particles
+const int REORDER_INTERVAL = 32;
+// particles are drawn as spheres only up to this many, points beyond
+const int MAX_DRAWN_SPHERES = 4096;
+// surface mesh voxel size and splat radius, in particle spacings, and the
+// contour level in lone-particle peaks
+const float SURFACE_VOXEL_SIZE = 0.5f;
+const float SURFACE_RADIUS = 2.0f;
+const float SURFACE_ISO_LEVEL = 1.0f;
 
 const float TANK_START_X = TANK_STANDARD_MINUS;
 const float TANK_END_X = TANK_STANDARD_PLUS;
 const float TANK_START_Y = TANK_STANDARD_MINUS;
 const float TANK_END_Y = 0.0f;
 
-const float GRID_START_X = TANK_STANDARD_MINUS - CELL_SPACING;
-const float GRID_END_X = TANK_STANDARD_PLUS + CELL_SPACING;
-const float GRID_START_Y = TANK_STANDARD_MINUS - CELL_SPACING;
-const float GRID_END_Y = 1.0f;
-
-const float NUM_X_INDICES = (GRID_END_X - GRID_START_X) / CELL_SPACING;
-const float NUM_Y_INDICES = (GRID_END_Y - GRID_START_Y) / CELL_SPACING;
-const float NUM_TOTAL_INDICES = NUM_X_INDICES * NUM_Y_INDICES;
-
-const float NEIGHBOR_RADIUS = CELL_SPACING;
-
 const float GRAVITY = -50.0f;
 const float MASS = 1.0f;
 const float H_KERNEL = 1.0f;
@@ -40,84 +39,741 @@ const float MU = 0.0000001f;
 const float REST_DENSITY = 0.001f;
 const float SINGLE_PARTICLE_DENSITY = 0.1f;
 
+// boundary coupling: push on a water particle at the center of a boundary
+// particle, in water weights, and damping of its approach
+const float BOUNDARY_STIFFNESS = 20.0f * MASS * -GRAVITY;
+const float BOUNDARY_DAMPING = 300.0f;
+
+// PCISPH iteration bounds, and the step predicted over until beginStep
+// says otherwise
+const int MIN_SOLVER_ITERATIONS = 3;
+const int MAX_SOLVER_ITERATIONS = 50;
+const float DEFAULT_SOLVER_STEP = 0.01f;
+// fixed number of blocks the symmetric force pass is split into, so the
+// summation order does not depend on the thread count
+const int SYMMETRIC_FORCE_BLOCKS = 16;
+
+WaterParams::WaterParams()
+    : dimensions(2), particleSpacing(0.08f), tankDepth(1.0f),
+      solver(SOLVER_WCSPH), maxDensityError(0.01f), courantFactor(0.4f), initialBlock(true)
+{
+}
+
+WaterEmitter::WaterEmitter(const Vector3f& position, const Vector3f& velocity, float radius)
+    : position(position), velocity(velocity), radius(radius)
+{
+}
+
+WaterSink::WaterSink(const Vector3f& boxMin, const Vector3f& boxMax)
+    : boxMin(boxMin), boxMax(boxMax)
+{
+}
+
+namespace
+{
+// spread the low bits of v out to every second (third) bit, for 2D (3D)
+// Morton codes
+uint32_t spreadBits2(uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+uint32_t spreadBits3(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// position of particle i, with z = 0 in 2D, for the distances to
+// boundary particles, which are taken in 3D
+template <int Dim>
+inline void boundaryFramePosition(const StateView& state, int i, float* position) {
+    position[2] = 0;
+    for (int c = 0; c < Dim; ++c)
+        position[c] = state.channel(PX + c)[i];
+}
+
+// squared distance between particles i and j over the first Dim axes
+template <int Dim>
+inline float distanceSquared(const StateView& state, int i, int j) {
+    float r2 = 0;
+    for (int c = 0; c < Dim; ++c) {
+        float d = state.channel(PX + c)[i] - state.channel(PX + c)[j];
+        r2 += d * d;
+    }
+    return r2;
+}
+}
+
 void WaterSystem::printGrid() {
-  for (int i=0; i<(int) systemGrid.size(); ++i) {
-    vector<int> cellElements = systemGrid.at(i);
+  for (int i=0; i<m_grid.numOccupiedCells(); ++i) {
     cout << "cell " << i << ": ";
 
-    for (int j=0; j<(int) cellElements.size(); ++j) {
-      cout << cellElements.at(j) << " ";
+    for (int k=m_grid.cellStart(i); k<m_grid.cellStart(i+1); ++k) {
+      cout << m_grid.particles()[k] << " ";
     }
 
     cout << endl;
   }
 }
 
-int WaterSystem::posToGridIndex(float x, float y) {
-    int xIndex = (x - GRID_START_X) / CELL_SPACING;
-    int yIndex = (y - GRID_START_Y) / CELL_SPACING;
-    return xIndex * NUM_Y_INDICES + yIndex;
-}
+WaterSystem::WaterSystem(const WaterParams& params)
+    : m_params(params), m_emitted(0), m_removed(0), m_surfaceRendering(false),
+      m_evaluations(0), m_rebuilds(0), m_neighborSeconds(0), m_forceSeconds(0), m_maxAcceleration(0), m_stepsSinceReorder(0), m_reorders(0),
+      m_poly6(H_KERNEL), m_spikyGradient(H_KERNEL), m_viscosityLaplacian(H_KERNEL),
+      m_tabulatedKernels(false), m_symmetricForces(false),
+      m_latticeDensity(0), m_couplings(0), m_stepSize(DEFAULT_SOLVER_STEP), m_cubicSpline(1, params.dimensions), m_restDensity(1),
+      m_pressureStiffness(0), m_solves(0), m_solverIterations(0), m_lastDensityError(0)
+{
+    const bool volumetric = params.dimensions == 3;
+    const bool incompressible = params.solver == WaterParams::SOLVER_PCISPH;
+    m_neighborRadius = (incompressible ? 2 : 1) * params.particleSpacing;
+    m_skin = 0.25f * params.particleSpacing;
+    m_viscosityTable = TabulatedKernel(m_viscosityLaplacian, m_neighborRadius);
+    m_surface.configure(SURFACE_VOXEL_SIZE * params.particleSpacing, SURFACE_RADIUS * params.particleSpacing,
+                        SURFACE_ISO_LEVEL);
+    if (incompressible) {
+        if (volumetric)
+            initializeIncompressible<3>();
+        else
+            initializeIncompressible<2>();
+    }
+    m_latticeDensity = volumetric ? latticeDensity<3>() : latticeDensity<2>();
+    m_boundaryGrid.configure(m_neighborRadius, Vector3f(0, 0, 0));
 
-void WaterSystem::clearGrid() {
-  for (int i = 0; i <(int) systemGrid.size(); i++)
-    systemGrid[i] = vector<int>();
-}
+    // cells are aligned one cell outside the tank's lower corner
+    const float halfDepth = 0.5f * params.tankDepth;
+    const float cellSize = m_neighborRadius + m_skin;
+    m_grid.configure(cellSize, Vector3f(TANK_STANDARD_MINUS - cellSize, TANK_STANDARD_MINUS - cellSize,
+                                        -halfDepth - cellSize));
 
-WaterSystem::WaterSystem()
-{
     // single particle that is dropped
-    vector<Vector3f> initialState;
-    vector<vector<int>> initialGrid;
-    
-    for (float x = GRID_START_X; x < GRID_END_X; x += CELL_SPACING)
-    for (float y = GRID_START_Y; y < GRID_END_Y; y += CELL_SPACING)
-      initialGrid.push_back(vector<int>());
-    
-    int curStateIndex = 0;
-    // particles that make up the water into which particle falls
-    for (float x = TANK_START_X; x < 0.0f; x += PARTICLE_SPACING)
-    for (float y = TANK_START_Y; y < TANK_END_Y; y += PARTICLE_SPACING) {
-       //populate the initial grid with current index
-        int gridIndex = WaterSystem::posToGridIndex(x, y);
-        Vector3f position = Vector3f(x, y + 1.0f, 0.0f);
-        initialState.push_back(position);
-        initialState.push_back(Vector3f(0.0f, 0.0f, 0.0f));
-        initialGrid[gridIndex].push_back(curStateIndex);
-        curStateIndex++;
+    vector<Vector3f> initialPositions;
+
+    // particles that make up the water into which particle falls; in 3D
+    // the block fills the depth of the tank
+    const float startZ = volumetric ? -halfDepth : 0.0f;
+    const float endZ = volumetric ? halfDepth : params.particleSpacing;
+    const float endX = params.initialBlock ? 0.0f : TANK_START_X;
+    for (float x = TANK_START_X; x < endX; x += params.particleSpacing)
+    for (float y = TANK_START_Y; y < TANK_END_Y; y += params.particleSpacing)
+    for (float z = startZ; z < endZ; z += params.particleSpacing) {
+        Vector3f position = Vector3f(x, y + 1.0f, volumetric ? z : 0.0f);
+        initialPositions.push_back(position);
+    }
+
+    m_store.resize((int) initialPositions.size());
+    for (int i = 0; i < m_store.size(); ++i)
+        m_store.setPosition(i, initialPositions[i]);
+    // holds the densities of the most recent evalF
+    m_store.enableAttribute(ParticleStore::DENSITY, SINGLE_PARTICLE_DENSITY);
+
+    // the tank is open at the top. Its right wall absorbs most of the
+    // impact, and its floor scatters the particles it bounces
+    m_boundaries.addPlane(BoundaryPlane(Vector3f(1, 0, 0), TANK_STANDARD_MINUS));
+    m_boundaries.addPlane(BoundaryPlane(Vector3f(-1, 0, 0), -TANK_STANDARD_PLUS, 0.3f));
+    m_boundaries.addPlane(BoundaryPlane(Vector3f(0, 1, 0), TANK_STANDARD_MINUS, 0.4f, 0.5f));
+    if (volumetric) {
+        m_boundaries.addPlane(BoundaryPlane(Vector3f(0, 0, 1), -halfDepth));
+        m_boundaries.addPlane(BoundaryPlane(Vector3f(0, 0, -1), -halfDepth));
     }
-    setState(initialState);
-    setGrid(initialGrid);
 }
 
-void WaterSystem::updateGrid(std::vector<Vector3f> state){
-    clearGrid();
-    for (int stateIndex = 0; stateIndex <(int) state.size(); stateIndex += 2) {
-        Vector3f pos = state[stateIndex];
-        int gridIndex = WaterSystem::posToGridIndex(pos.x(), pos.y());
-        if (gridIndex < 0 || gridIndex >= NUM_TOTAL_INDICES)
-	         cout << "not in grid" << endl;
+void WaterSystem::beginStep(float h) {
+    // PCISPH's pressures depend on the step predicted over
+    if (h != m_stepSize)
+        invalidateDerivativeCache();
+    m_stepSize = h;
+    if (++m_stepsSinceReorder >= REORDER_INTERVAL) {
+        if (m_params.dimensions == 3)
+            reorderParticles<3>();
         else
-	        systemGrid[gridIndex].push_back(stateIndex/2);
+            reorderParticles<2>();
+        m_stepsSinceReorder = 0;
+    }
+    bool removed = removeSunkParticles();
+    bool added = emitParticles(h);
+    if (removed || added) {
+        // slots changed, so the neighbor lists must be rebuilt
+        m_buildPositions.clear();
+    }
+    m_boundaries.apply(m_store);
+}
+
+void WaterSystem::addEmitter(const WaterEmitter& emitter) {
+    m_emitters.push_back(emitter);
+    // the first layer comes out in the first step
+    m_emitterTravel.push_back(m_params.particleSpacing);
+}
+
+void WaterSystem::addSink(const WaterSink& sink) {
+    m_sinks.push_back(sink);
+}
+
+void WaterSystem::coupleBoundary(const StateView& boundary, float radius, float particleMass,
+                                 vector<float>& reaction) {
+    if (m_params.dimensions == 3)
+        coupleBoundaryParticles<3>(boundary, radius, particleMass, reaction);
+    else
+        coupleBoundaryParticles<2>(boundary, radius, particleMass, reaction);
+}
+
+float WaterSystem::densityKernel(float r2) const {
+    return m_params.solver == WaterParams::SOLVER_PCISPH ? m_cubicSpline(r2) : m_poly6(r2);
+}
+
+float WaterSystem::selfDensity() const {
+    return m_params.solver == WaterParams::SOLVER_PCISPH ? MASS * m_cubicSpline(0) : SINGLE_PARTICLE_DENSITY;
+}
+
+// the density of a particle inside the initial lattice, summed the way
+// the solver sums it
+template <int Dim>
+float WaterSystem::latticeDensity() const {
+    const float spacing = m_params.particleSpacing;
+    const int reach = (int) (m_neighborRadius / spacing);
+    const int zReach = Dim == 3 ? reach : 0;
+    float density = selfDensity();
+    for (int x = -reach; x <= reach; ++x)
+    for (int y = -reach; y <= reach; ++y)
+    for (int z = -zReach; z <= zReach; ++z) {
+        float r2 = (x * x + y * y + z * z) * spacing * spacing;
+        if (r2 > 0 && sqrt(r2) <= m_neighborRadius)
+            density += MASS * densityKernel(r2);
+    }
+    return density;
+}
+
+// calls visit(b, r2, r_ib) for every boundary particle b within the
+// neighbor radius of position, with r_ib = position - x_b, in grid order
+template <typename Visit>
+void WaterSystem::visitBoundaryNeighbors(const float* position, Visit visit) const {
+    if (m_boundaryMass.empty())
+        return;
+    int center[3];
+    for (int c = 0; c < 3; ++c)
+        center[c] = m_boundaryGrid.cellCoordinate(position[c], c);
+    const float radius2 = m_neighborRadius * m_neighborRadius;
+    const vector<int>& cellParticles = m_boundaryGrid.particles();
+    for (int x = center[0] - 1; x <= center[0] + 1; ++x)
+    for (int y = center[1] - 1; y <= center[1] + 1; ++y)
+    for (int z = center[2] - 1; z <= center[2] + 1; ++z) {
+        int cell = m_boundaryGrid.findCell(x, y, z);
+        if (cell < 0)
+            continue;
+        for (int k = m_boundaryGrid.cellStart(cell); k < m_boundaryGrid.cellStart(cell + 1); ++k) {
+            int b = cellParticles[k];
+            float r_ib[3];
+            float r2 = 0;
+            for (int c = 0; c < 3; ++c) {
+                r_ib[c] = position[c] - m_boundaryPositions[3*b + c];
+                r2 += r_ib[c] * r_ib[c];
+            }
+            if (r2 <= radius2)
+                visit(b, r2, r_ib);
+        }
     }
 }
 
-std::vector<int> WaterSystem::getNeighbors(int i, std::vector<Vector3f> state) {
-    Vector3f iPos = state[2 * i];
-    std::vector<int> neighboringIndices = vector<int>();
-   
-    for (float x = iPos.x() - CELL_SPACING; x < iPos.x() + CELL_SPACING*2; x += CELL_SPACING)
-    for (float y = iPos.y() - CELL_SPACING; y < iPos.y() + CELL_SPACING*2; y += CELL_SPACING) {
-        int gridIndex = posToGridIndex(x, y);
-        if (gridIndex >= 0 && gridIndex < NUM_TOTAL_INDICES) {
-            for (int neighborIndex : systemGrid[gridIndex]) {
-                Vector3f neighborDistance = state[2*neighborIndex] - iPos;
-                if (neighborDistance.abs() <= NEIGHBOR_RADIUS && neighborDistance.abs() > 0)
-                    neighboringIndices.push_back(neighborIndex);
+// calls visit(i, r2, r_ib) for every water particle i of state within
+// radius of boundary position x_b, with r_ib = x_i - x_b. The grid holds
+// the positions of the last list rebuild, which the water has left by at
+// most half the skin.
+template <int Dim, typename Visit>
+void WaterSystem::visitWaterNeighbors(const StateView& state, const float* position, float radius,
+                                      Visit visit) const {
+    const int reach = (int) ceil((radius + 0.5f * m_skin) / m_grid.cellSize());
+    const int zReach = Dim == 3 ? reach : 0;
+    int center[3] = { 0, 0, 0 };
+    for (int c = 0; c < Dim; ++c)
+        center[c] = m_grid.cellCoordinate(position[c], c);
+    const vector<int>& cellParticles = m_grid.particles();
+    for (int x = center[0] - reach; x <= center[0] + reach; ++x)
+    for (int y = center[1] - reach; y <= center[1] + reach; ++y)
+    for (int z = center[2] - zReach; z <= center[2] + zReach; ++z) {
+        int cell = m_grid.findCell(x, y, z);
+        if (cell < 0)
+            continue;
+        for (int k = m_grid.cellStart(cell); k < m_grid.cellStart(cell + 1); ++k) {
+            int i = cellParticles[k];
+            float water[3];
+            boundaryFramePosition<Dim>(state, i, water);
+            float r_ib[3];
+            float r2 = 0;
+            for (int c = 0; c < 3; ++c) {
+                r_ib[c] = water[c] - position[c];
+                r2 += r_ib[c] * r_ib[c];
             }
+            if (r2 <= radius * radius)
+                visit(i, r2, r_ib);
         }
-	}
-    return neighboringIndices;
+    }
+}
+
+// the fluid mass the boundary particles near position add to its density
+float WaterSystem::boundaryDensity(const float* position) const {
+    float density = 0;
+    visitBoundaryNeighbors(position, [&](int b, float r2, const float*) {
+        density += m_boundaryMass[b] * densityKernel(r2);
+    });
+    return density;
+}
+
+// WCSPH pressure force of the boundary particles on a water particle at
+// position: each acts like a water particle of its mass at the water
+// particle's own pressure, counted once rather than from both sides
+// (Akinci et al. 2012), in the units of calculatePressureForceOnParticle
+template <int Dim>
+Vector3f WaterSystem::calculateBoundaryPressureForce(const float* position, float density_i) {
+    float force[3] = { 0, 0, 0 };
+    visitBoundaryNeighbors(position, [&](int b, float r2, const float* r_ib) {
+        if (r2 == 0)
+            return;
+        float magnitude = m_boundaryMass[b] * (density_i - REST_DENSITY) * m_spikyGradient(sqrt(r2)) / density_i;
+        for (int c = 0; c < Dim; ++c)
+            force[c] += magnitude * r_ib[c];
+    });
+    return Vector3f(force[0], force[1], force[2]) * K_GAS_CONSTANT;
+}
+
+// Sets up the boundary particles for the SPH sums, then counts and fills
+// the contacts of each boundary particle in parallel and adds them to the
+// water serially in boundary order, so the forces do not depend on the
+// thread count.
+template <int Dim>
+void WaterSystem::coupleBoundaryParticles(const StateView& boundary, float radius, float particleMass,
+                                          vector<float>& reaction) {
+    const StateView state = m_store.view();
+    const int n = state.numParticles();
+    const int m = boundary.numParticles();
+
+    // each boundary particle stands for the fluid mass that brings the
+    // kernel sum over itself and its boundary neighbors up to the lattice
+    // density, so sparse and single-layer boundaries weigh as much as a
+    // full one
+    m_boundaryPositions.resize(3 * m);
+    for (int b = 0; b < m; ++b)
+        for (int c = 0; c < 3; ++c)
+            m_boundaryPositions[3*b + c] = boundary.channel(PX + c)[b];
+    m_boundaryGrid.build(boundary, 3);
+    m_boundaryMass.resize(m);
+    parallelFor(0, m, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b) {
+            float density = MASS * densityKernel(0);
+            visitBoundaryNeighbors(&m_boundaryPositions[3*b], [&](int l, float r2, const float*) {
+                if (l != b)
+                    density += MASS * densityKernel(r2);
+            });
+            m_boundaryMass[b] = MASS * m_latticeDensity / density;
+        }
+    });
+
+    // densities of the current state with the boundary, for the pressure
+    // the boundary particles feel
+    findNeighbors<Dim>(state);
+    m_density.resize(n);
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            float density = selfDensity();
+            for (int k = m_neighborStart[i]; k < m_neighborStart[i + 1]; ++k)
+                density += MASS * densityKernel(distanceSquared<Dim>(state, i, m_neighbors[k]));
+            float position[3];
+            boundaryFramePosition<Dim>(state, i, position);
+            m_density[i] = density + boundaryDensity(position);
+        }
+    });
+    storeDensities(state);
+
+    auto contacts = [&](int b, ForceSpill* out) {
+        int count = 0;
+        visitWaterNeighbors<Dim>(state, &m_boundaryPositions[3*b], radius, [&](int i, float r2, const float* d) {
+            if (!(r2 < radius * radius) || r2 == 0)
+                return;
+            if (out) {
+                float r = sqrt(r2);
+                float approach = 0;
+                for (int c = 0; c < Dim; ++c)
+                    approach += (state.channel(VX + c)[i] - boundary.channel(VX + c)[b]) * d[c] / r;
+                float push = BOUNDARY_STIFFNESS * (1 - r / radius) - BOUNDARY_DAMPING * min(approach, 0.0f);
+                out[count].particle = i;
+                out[count].force[2] = 0;
+                for (int c = 0; c < Dim; ++c)
+                    out[count].force[c] = push * d[c] / r;
+            }
+            ++count;
+        });
+        return count;
+    };
+
+    // the pressure force of boundary particle b on the water around it,
+    // in the units of the contact forces; PCISPH takes the pressure of
+    // the first solver iteration over the current state
+    const bool incompressible = m_params.solver == WaterParams::SOLVER_PCISPH;
+    const float stiffness = m_pressureStiffness / (m_stepSize * m_stepSize);
+    auto pressureOnWater = [&](int b, float* force) {
+        visitWaterNeighbors<Dim>(state, &m_boundaryPositions[3*b], m_neighborRadius, [&](int i, float r2, const float* d) {
+            if (r2 == 0)
+                return;
+            const float density_i = m_density[i];
+            float magnitude;
+            if (incompressible) {
+                float pressureTerm = max(stiffness * (density_i - m_restDensity), 0.0f) / (m_restDensity * m_restDensity);
+                magnitude = -MASS * 10 * m_boundaryMass[b] * pressureTerm * m_cubicSpline.gradient(sqrt(r2));
+            } else {
+                magnitude = 1000 * K_GAS_CONSTANT * m_boundaryMass[b] * (density_i - REST_DENSITY) *
+                            m_spikyGradient(sqrt(r2)) / density_i;
+            }
+            for (int c = 0; c < Dim; ++c)
+                force[c] += magnitude * d[c];
+        });
+    };
+
+    m_boundaryStart.resize(m + 1);
+    m_boundaryStart[0] = 0;
+    parallelFor(0, m, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b)
+            m_boundaryStart[b + 1] = contacts(b, nullptr);
+    });
+    for (int b = 0; b < m; ++b)
+        m_boundaryStart[b + 1] += m_boundaryStart[b];
+    m_boundaryContacts.resize(m_boundaryStart[m]);
+
+    // a water particle of particleMass accelerates by force / MASS / 10,
+    // as in evalF, so the boundary takes that momentum the other way
+    const float reactionScale = -particleMass / (MASS * 10);
+    reaction.assign(3 * m, 0.0f);
+    parallelFor(0, m, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b) {
+            contacts(b, m_boundaryContacts.data() + m_boundaryStart[b]);
+            float force[3] = { 0, 0, 0 };
+            for (int k = m_boundaryStart[b]; k < m_boundaryStart[b + 1]; ++k)
+                for (int c = 0; c < 3; ++c)
+                    force[c] += m_boundaryContacts[k].force[c];
+            pressureOnWater(b, force);
+            for (int c = 0; c < 3; ++c)
+                reaction[3*b + c] = reactionScale * force[c];
+        }
+    });
+
+    m_externalForces.assign(3 * n, 0.0f);
+    for (size_t k = 0; k < m_boundaryContacts.size(); ++k) {
+        const ForceSpill& contact = m_boundaryContacts[k];
+        for (int c = 0; c < 3; ++c)
+            m_externalForces[3*contact.particle + c] += contact.force[c];
+    }
+    // new boundary and external forces for an unchanged state
+    invalidateDerivativeCache();
+    ++m_couplings;
+}
+
+bool WaterSystem::removeSunkParticles() {
+    if (m_sinks.empty())
+        return false;
+
+    m_sunk.clear();
+    for (int i = 0; i < m_store.size(); ++i) {
+        Vector3f p = m_store.position(i);
+        for (size_t s = 0; s < m_sinks.size(); ++s) {
+            const WaterSink& sink = m_sinks[s];
+            if (p.x() >= sink.boxMin.x() && p.x() <= sink.boxMax.x() &&
+                p.y() >= sink.boxMin.y() && p.y() <= sink.boxMax.y() &&
+                p.z() >= sink.boxMin.z() && p.z() <= sink.boxMax.z()) {
+                m_sunk.push_back(i);
+                break;
+            }
+        }
+    }
+    m_store.removeParticles(m_sunk);
+    m_removed += m_sunk.size();
+    return !m_sunk.empty();
+}
+
+bool WaterSystem::emitParticles(float h) {
+    const float spacing = m_params.particleSpacing;
+    const bool volumetric = m_params.dimensions == 3;
+    const int first = m_store.size();
+    for (size_t e = 0; e < m_emitters.size(); ++e) {
+        const WaterEmitter& emitter = m_emitters[e];
+        float speed = emitter.velocity.abs();
+        if (speed == 0)
+            continue;
+
+        // directions across the nozzle: in 2D the one in the xy plane,
+        // in 3D two perpendicular ones
+        Vector3f direction = emitter.velocity / speed;
+        Vector3f across = volumetric ? Vector3f::cross(direction, Vector3f(0, 0, 1))
+                                     : Vector3f(-direction.y(), direction.x(), 0);
+        if (across.absSquared() == 0)
+            across = Vector3f::cross(direction, Vector3f(1, 0, 0));
+        across.normalize();
+        Vector3f across2 = Vector3f::cross(direction, across);
+        const int reach = (int) (emitter.radius / spacing);
+        const int reach2 = volumetric ? reach : 0;
+
+        auto inNozzle = [&](int a, int b) {
+            return (a * a + b * b) * spacing * spacing <= emitter.radius * emitter.radius;
+        };
+        int layerSize = 0;
+        for (int a = -reach; a <= reach; ++a)
+        for (int b = -reach2; b <= reach2; ++b)
+            layerSize += inNozzle(a, b);
+
+        float& travel = m_emitterTravel[e];
+        for (; travel >= spacing; travel -= spacing) {
+            // the layer has already moved travel - spacing since it left
+            Vector3f center = emitter.position + (travel - spacing) * direction;
+            int i = m_store.size();
+            m_store.resize(i + layerSize);
+            for (int a = -reach; a <= reach; ++a)
+            for (int b = -reach2; b <= reach2; ++b) {
+                if (!inNozzle(a, b))
+                    continue;
+                m_store.setPosition(i, center + a * spacing * across + b * spacing * across2);
+                m_store.setVelocity(i, emitter.velocity);
+                ++i;
+            }
+        }
+        travel += speed * h;
+    }
+    m_emitted += m_store.size() - first;
+    return m_store.size() != first;
+}
+
+// sorts the particles along a Morton (Z-order) curve of their grid cell,
+// so that particles close in space are close in memory. Cell coordinates
+// are taken relative to the lowest occupied cell and clamped to the bits
+// available per axis.
+template <int Dim>
+void WaterSystem::reorderParticles() {
+    const int n = m_store.size();
+    const int maxCoordinate = Dim == 3 ? (1 << 10) - 1 : (1 << 16) - 1;
+    StateView state = m_store.view();
+    int lowest[3] = { 0, 0, 0 };
+    for (int c = 0; c < Dim; ++c) {
+        lowest[c] = m_grid.cellCoordinate(n > 0 ? state.channel(PX + c)[0] : 0.0f, c);
+        for (int i = 1; i < n; ++i)
+            lowest[c] = min(lowest[c], m_grid.cellCoordinate(state.channel(PX + c)[i], c));
+    }
+    m_sortKeys.resize(n);
+    for (int i = 0; i < n; ++i) {
+        uint32_t code = 0;
+        for (int c = 0; c < Dim; ++c) {
+            int index = min(m_grid.cellCoordinate(state.channel(PX + c)[i], c) - lowest[c], maxCoordinate);
+            code |= (Dim == 3 ? spreadBits3(index) : spreadBits2(index)) << c;
+        }
+        // the slot breaks ties, keeping the order within a cell stable
+        m_sortKeys[i] = ((uint64_t) code << 32) | (uint32_t) i;
+    }
+    sort(m_sortKeys.begin(), m_sortKeys.end());
+
+    m_order.resize(n);
+    for (int k = 0; k < n; ++k)
+        m_order[k] = (int) (m_sortKeys[k] & 0xffffffffu);
+    m_store.permute(m_order);
+
+    // the cached lists refer to the old slots
+    m_buildPositions.clear();
+    ++m_reorders;
+}
+
+template <int Dim>
+bool WaterSystem::neighborListsStale(const StateView& state) const {
+    const int n = state.numParticles();
+    if ((int) m_buildPositions.size() != 3 * n)
+        return true;
+
+    const float limit = 0.25f * m_skin * m_skin;
+    atomic<bool> stale(false);
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end && !stale.load(memory_order_relaxed); ++i) {
+            float moved = 0;
+            for (int c = 0; c < Dim; ++c) {
+                float d = state.channel(PX + c)[i] - m_buildPositions[3*i + c];
+                moved += d * d;
+            }
+            if (moved > limit)
+                stale = true;
+        }
+    }, 1024);
+    return stale;
+}
+
+// Both list builders below run in two parallel passes: count each
+// particle's entries, prefix-sum the counts into offsets, then fill.
+// Every particle writes only its own range, so the lists are the same
+// for any thread count.
+
+template <int Dim>
+void WaterSystem::buildNeighborLists(const StateView& state) {
+    m_grid.build(state, Dim);
+
+    const int n = state.numParticles();
+    const float radius = m_neighborRadius + m_skin;
+    m_candidateStart.resize(n + 1);
+    m_buildPositions.resize(3 * n);
+
+    // visits the particles within radius of i in the occupied cells of
+    // the 3x3(x3) block around it. Writes them to out unless it is null;
+    // returns the count.
+    const vector<int>& cellParticles = m_grid.particles();
+    auto collect = [&](int i, int* out) {
+        int center[3] = { 0, 0, 0 };
+        for (int c = 0; c < Dim; ++c)
+            center[c] = m_grid.cellCoordinate(state.channel(PX + c)[i], c);
+        const int zRange = Dim == 3 ? 1 : 0;
+        int count = 0;
+        for (int x = center[0] - 1; x <= center[0] + 1; ++x)
+        for (int y = center[1] - 1; y <= center[1] + 1; ++y)
+        for (int z = center[2] - zRange; z <= center[2] + zRange; ++z) {
+            int cell = m_grid.findCell(x, y, z);
+            if (cell < 0)
+                continue;
+            for (int k = m_grid.cellStart(cell); k < m_grid.cellStart(cell + 1); ++k) {
+                int neighborIndex = cellParticles[k];
+                if (neighborIndex != i && sqrt(distanceSquared<Dim>(state, i, neighborIndex)) <= radius) {
+                    if (out)
+                        out[count] = neighborIndex;
+                    ++count;
+                }
+            }
+        }
+        return count;
+    };
+
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            for (int c = 0; c < 3; ++c)
+                m_buildPositions[3*i + c] = state.channel(PX + c)[i];
+            m_candidateStart[i + 1] = collect(i, nullptr);
+        }
+    });
+    m_candidateStart[0] = 0;
+    for (int i = 0; i < n; ++i)
+        m_candidateStart[i + 1] += m_candidateStart[i];
+
+    m_candidates.resize(m_candidateStart[n]);
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            collect(i, m_candidates.data() + m_candidateStart[i]);
+    });
+    if (m_symmetricForces)
+        buildHalfList(n);
+    ++m_rebuilds;
+}
+
+// The candidates j > i of each particle, and the particles split into
+// SYMMETRIC_FORCE_BLOCKS blocks of about equal candidate pairs. Only
+// changes with the candidates, so accumulateSymmetricForces reuses it
+// until the next rebuild.
+void WaterSystem::buildHalfList(int n) {
+    m_halfStart.resize(n + 1);
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            int count = 0;
+            for (int k = m_candidateStart[i]; k < m_candidateStart[i + 1]; ++k)
+                count += m_candidates[k] > i;
+            m_halfStart[i + 1] = count;
+        }
+    });
+    m_halfStart[0] = 0;
+    for (int i = 0; i < n; ++i)
+        m_halfStart[i + 1] += m_halfStart[i];
+    m_halfNeighbors.resize(m_halfStart[n]);
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            int* out = m_halfNeighbors.data() + m_halfStart[i];
+            for (int k = m_candidateStart[i]; k < m_candidateStart[i + 1]; ++k)
+                if (m_candidates[k] > i)
+                    *out++ = m_candidates[k];
+        }
+    });
+
+    const int blocks = SYMMETRIC_FORCE_BLOCKS;
+    m_blockStart.resize(blocks + 1);
+    for (int b = 0; b < blocks; ++b) {
+        long pairs = (long) m_halfStart[n] * b / blocks;
+        m_blockStart[b] = (int) (lower_bound(m_halfStart.begin(), m_halfStart.end() - 1, pairs) - m_halfStart.begin());
+    }
+    m_blockStart[blocks] = n;
+}
+
+// narrows the cached candidates down to the particles actually within
+// m_neighborRadius, rebuilding the lists first if they went stale
+template <int Dim>
+void WaterSystem::findNeighbors(const StateView& state) {
+    if (neighborListsStale<Dim>(state))
+        buildNeighborLists<Dim>(state);
+
+    const int n = state.numParticles();
+    m_neighborStart.resize(n + 1);
+
+    auto collect = [&](int i, int* out) {
+        int count = 0;
+        for (int k = m_candidateStart[i]; k < m_candidateStart[i + 1]; ++k) {
+            int neighborIndex = m_candidates[k];
+            float distance = sqrt(distanceSquared<Dim>(state, i, neighborIndex));
+            if (distance <= m_neighborRadius && distance > 0) {
+                if (out)
+                    out[count] = neighborIndex;
+                ++count;
+            }
+        }
+        return count;
+    };
+
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            m_neighborStart[i + 1] = collect(i, nullptr);
+    });
+    m_neighborStart[0] = 0;
+    for (int i = 0; i < n; ++i)
+        m_neighborStart[i + 1] += m_neighborStart[i];
+
+    m_neighbors.resize(m_neighborStart[n]);
+    parallelFor(0, n, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+            collect(i, m_neighbors.data() + m_neighborStart[i]);
+    });
+}
+
+void WaterSystem::printStats(ostream& out) const {
+    out << m_params.dimensions << "D water, " << m_store.size() << " particles in "
+        << m_grid.numOccupiedCells() << " grid cells (" << m_grid.memoryBytes() / 1024 << " KiB)" << endl;
+    out << "neighbor lists: rebuilt " << m_rebuilds << " times in " << m_evaluations
+        << " evaluations";
+    if (m_evaluations > 0)
+        out << " (" << 100.0 * m_rebuilds / m_evaluations << "%)";
+    out << ", skin " << m_skin << ", " << m_candidates.size() << " candidates" << endl;
+    if (m_forceSeconds > 0)
+        out << "WCSPH: " << 1000 * m_neighborSeconds / m_evaluations << " ms neighbor search, "
+            << 1000 * m_forceSeconds / m_evaluations << " ms " << (m_symmetricForces ? "half list" : "both sides")
+            << " forces per evaluation" << endl;
+    out << "Morton reorderings: " << m_reorders << " (every " << REORDER_INTERVAL << " steps)" << endl;
+    if (!m_emitters.empty() || !m_sinks.empty())
+        out << m_emitters.size() << " emitters, " << m_sinks.size() << " sinks: emitted "
+            << m_emitted << ", removed " << m_removed << " particles, room for " << m_store.stride() << endl;
+    out << "boundaries: " << m_boundaries.planes().size() << " planes, "
+        << m_boundaries.lastContacts() << " contacts in the last of " << m_boundaries.passes() << " passes" << endl;
+    if (m_couplings > 0)
+        out << "boundary coupling: " << m_boundaryContacts.size() << " contacts with "
+            << m_boundaryStart.size() - 1 << " boundary particles in the last of " << m_couplings << " steps" << endl;
+    if (m_surface.builds() > 0)
+        out << "surface: " << m_surface.numTriangles() << " triangles over " << m_surface.numBlocks()
+            << " blocks, " << m_surface.numInteriorBlocks() << " interior skipped (" << m_surface.memoryBytes() / 1024 << " KiB) in " << 1000 * m_surface.lastBuildSeconds()
+            << " ms, " << m_surface.builds() << " builds" << endl;
+    out << "CFL step: " << stableStepSize() << " (Courant factor " << m_params.courantFactor
+        << ", max acceleration " << m_maxAcceleration << ")" << endl;
+    if (m_solves > 0)
+        out << "PCISPH: " << (double) m_solverIterations / m_solves << " iterations per solve over "
+            << m_solves << " solves, last density error " << 100 * m_lastDensityError << "% (limit "
+            << 100 * m_params.maxDensityError << "%)" << endl;
 }
 
 //std::vector<Vector3f> WaterSystem::boundParticles(pos, velocity, acceleration) {
@@ -135,31 +791,119 @@ std::vector<int> WaterSystem::getNeighbors(int i, std::vector<Vector3f> state) {
 //    
 //}
 
-std::vector<Vector3f> WaterSystem::evalF(std::vector<Vector3f> state)
+void WaterSystem::evalF(const StateView& state, DerivativeView& f)
 {
-    WaterSystem::updateGrid(state);
+    ++m_evaluations;
+    const bool incompressible = m_params.solver == WaterParams::SOLVER_PCISPH;
+    if (m_params.dimensions == 3) {
+        if (incompressible)
+            evaluateIncompressible<3>(state, f);
+        else
+            evaluate<3>(state, f);
+    } else {
+        if (incompressible)
+            evaluateIncompressible<2>(state, f);
+        else
+            evaluate<2>(state, f);
+    }
+
+    float maxAcceleration2 = parallelMax(0, state.numParticles(), [&](int begin, int end) {
+        float largest = 0;
+        for (int i = begin; i < end; ++i) {
+            float a2 = 0;
+            for (int c = 0; c < 3; ++c)
+                a2 += f.channel(VX + c)[i] * f.channel(VX + c)[i];
+            largest = max(largest, a2);
+        }
+        return largest;
+    });
+    m_maxAcceleration = sqrt(maxAcceleration2);
+}
+
+float WaterSystem::stableStepSize() const
+{
+    const StateView state = m_store.view();
+    float maxSpeed2 = parallelMax(0, state.numParticles(), [&](int begin, int end) {
+        float largest = 0;
+        for (int i = begin; i < end; ++i) {
+            float v2 = 0;
+            for (int c = 0; c < 3; ++c)
+                v2 += state.channel(VX + c)[i] * state.channel(VX + c)[i];
+            largest = max(largest, v2);
+        }
+        return largest;
+    });
+
+    const float length = m_neighborRadius;
+    // kinematic viscosity, from the viscosity and the rest density
+    const float viscosity = MU / REST_DENSITY;
+    float limit = 0.125f * length * length / viscosity;
+    if (maxSpeed2 > 0)
+        limit = min(limit, length / sqrt(maxSpeed2));
+    if (m_maxAcceleration > 0)
+        limit = min(limit, sqrt(length / m_maxAcceleration));
+    return m_params.courantFactor * limit;
+}
+
+// the store keeps the densities of its own state only, not those of an
+// intermediate stage or of a state passed in from outside
+void WaterSystem::storeDensities(const StateView& state)
+{
+    const StateView own = m_store.view();
+    if (state.channel(PX) != own.channel(PX) || state.numParticles() != own.numParticles())
+        return;
+    copy(m_density.begin(), m_density.end(), m_store.attribute(ParticleStore::DENSITY));
+}
+
+template <int Dim>
+void WaterSystem::evaluate(const StateView& state, DerivativeView& f)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    WaterSystem::findNeighbors<Dim>(state);
+    m_neighborSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
   
-    std::vector<Vector3f> f;
     Vector3f fGravity = Vector3f(0.0, MASS * GRAVITY, 0.0);
-    std::vector<std::vector<int>> particleNeighbors;
-    std::vector<float> particleDensity;
+    m_density.resize(state.numParticles());
+    float* particleDensity = m_density.data();
     
+    // both passes are independent per particle and run on the thread pool
     // first pass: calculate density of all particles
-    for (int i=0; i<(int) state.size()/2; ++i) {
-        std::vector<int> nearestParticles = WaterSystem::getNeighbors(i, state);
-        float density = calculateDensityOfParticle(i, state, nearestParticles);
-        
-        particleNeighbors.push_back(nearestParticles);
-        particleDensity.push_back(density);
+    parallelFor(0, state.numParticles(), [&](int begin, int end) {
+      for (int i=begin; i<end; ++i) {
+        const int* nearestParticles = m_neighbors.data() + m_neighborStart[i];
+        int numNeighbors = m_neighborStart[i+1] - m_neighborStart[i];
+        particleDensity[i] = calculateDensityOfParticle<Dim>(i, state, nearestParticles, numNeighbors);
+      }
+    });
+    storeDensities(state);
+    start = chrono::steady_clock::now();
+    if (m_symmetricForces) {
+      accumulateSymmetricForces<Dim>(state, particleDensity);
+      parallelFor(0, state.numParticles(), [&](int begin, int end) {
+        for (int i=begin; i<end; ++i) {
+          Vector3f fPairs(m_pairForces[3*i], m_pairForces[3*i + 1], m_pairForces[3*i + 2]);
+          float position[3];
+          boundaryFramePosition<Dim>(state, i, position);
+          fPairs += 1000 * calculateBoundaryPressureForce<Dim>(position, particleDensity[i]);
+          Vector3f acceleration = (fPairs + fGravity + calculateExternalForceOnParticle(i, state.numParticles())) / MASS / 10;
+          f.set(i, state.velocityAt(i), acceleration);
+        }
+      });
+      m_forceSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      return;
     }
     // second pass: calculate forces
-    for (int i=0; i<(int) state.size()/2; ++i) {
-        Vector3f pos = state[2*i];
-        Vector3f velocity = state[2*i+1];
-        std::vector<int> nearestParticles = particleNeighbors.at(i);
-        Vector3f fPressure = calculatePressureForceOnParticle(i, state, nearestParticles, particleDensity);
-        Vector3f fViscosity = calculateViscosityForceOnParticle(i, state, nearestParticles, particleDensity);
-        Vector3f fExternal = calculateExternalForceOnParticle();
+    parallelFor(0, state.numParticles(), [&](int begin, int end) {
+      for (int i=begin; i<end; ++i) {
+        const Vector3f& velocity = state.velocityAt(i);
+        const int* nearestParticles = m_neighbors.data() + m_neighborStart[i];
+        int numNeighbors = m_neighborStart[i+1] - m_neighborStart[i];
+        Vector3f fPressure = calculatePressureForceOnParticle<Dim>(i, state, nearestParticles, numNeighbors, particleDensity);
+        float position[3];
+        boundaryFramePosition<Dim>(state, i, position);
+        fPressure += calculateBoundaryPressureForce<Dim>(position, particleDensity[i]);
+        Vector3f fViscosity = calculateViscosityForceOnParticle<Dim>(i, state, nearestParticles, numNeighbors, particleDensity);
+        Vector3f fExternal = calculateExternalForceOnParticle(i, state.numParticles());
 	
 //	cout << "Gravity ";
 //	fGravity.print();
@@ -174,11 +918,11 @@ std::vector<Vector3f> WaterSystem::evalF(std::vector<Vector3f> state)
       //  cout << velocity.x() << " " << velocity.y() << " " << velocity.z() << endl; 
       //  cout << acceleration.x() << " " << acceleration.y() << " " << acceleration.z() << endl; 
     
-        f.push_back(velocity);
         //acceleration += -1.0f * velocity;
-        f.push_back(acceleration);
-    }
-    return f;
+        f.set(i, velocity, acceleration);
+      }
+    });
+    m_forceSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
   
   //  vector<Vector3f> zeros;
   //  for (int i = 0; i < state.size() / 2; i++) {
@@ -188,6 +932,184 @@ std::vector<Vector3f> WaterSystem::evalF(std::vector<Vector3f> state)
   //  return zeros;
 }
 
+// Sets up PCISPH from a particle inside the initial lattice: its density
+// becomes the rest density, and its neighborhood gives the factor from
+// density error to pressure (Solenthaler and Pajarola 2009).
+template <int Dim>
+void WaterSystem::initializeIncompressible() {
+    m_cubicSpline = CubicSplineKernel(m_neighborRadius, Dim);
+
+    const float spacing = m_params.particleSpacing;
+    const int reach = (int) (m_neighborRadius / spacing);
+    const int zReach = Dim == 3 ? reach : 0;
+    float density = 0;
+    float gradientSum[3] = { 0, 0, 0 };
+    float gradientDots = 0;
+    for (int x = -reach; x <= reach; ++x)
+    for (int y = -reach; y <= reach; ++y)
+    for (int z = -zReach; z <= zReach; ++z) {
+        const float r[3] = { x * spacing, y * spacing, z * spacing };
+        float r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+        if (sqrt(r2) > m_neighborRadius)
+            continue;
+        density += MASS * m_cubicSpline(r2);
+        if (r2 == 0)
+            continue;
+        float g = m_cubicSpline.gradient(sqrt(r2));
+        for (int c = 0; c < 3; ++c) {
+            gradientSum[c] += g * r[c];
+            gradientDots += g * r[c] * g * r[c];
+        }
+    }
+    m_restDensity = density;
+
+    const float sumSquared = gradientSum[0] * gradientSum[0] + gradientSum[1] * gradientSum[1] +
+                             gradientSum[2] * gradientSum[2];
+    const float beta = 2 * (MASS / m_restDensity) * (MASS / m_restDensity);
+    m_pressureStiffness = 1.0f / (beta * (sumSquared + gradientDots));
+}
+
+// PCISPH: starting from zero pressure, repeatedly predicts the positions
+// after a step of m_stepSize, corrects each particle's pressure by its
+// predicted density error, and recomputes the pressure accelerations,
+// until the average compression is within maxDensityError.
+template <int Dim>
+void WaterSystem::evaluateIncompressible(const StateView& state, DerivativeView& f)
+{
+    findNeighbors<Dim>(state);
+
+    const int n = state.numParticles();
+    const float h = m_stepSize;
+    const float stiffness = m_pressureStiffness / (h * h);
+    const float selfDensity = MASS * m_cubicSpline(0);
+    // pressure terms are divided by the rest density rather than the
+    // predicted one, which is what the stiffness assumes and keeps lone
+    // compressed pairs from being flung apart
+    const float inverseRestDensity2 = 1.0f / (m_restDensity * m_restDensity);
+    m_density.resize(n);
+    float* particleDensity = m_density.data();
+    m_nonPressureAcceleration.resize(3 * n);
+    m_pressureAcceleration.assign(3 * n, 0.0f);
+    m_predictedPositions.resize(3 * n);
+    m_predictedDensity.resize(n);
+    m_pressure.assign(n, 0.0f);
+    m_densityError.resize(n);
+
+    // sum of the kernel over the neighbors of i and the boundary
+    // particles, with coordinate c of particle j at axes[c][j * step]
+    const float* currentAxes[3] = { state.channel(PX), state.channel(PY), state.channel(PZ) };
+    const float* predictedAxes[3] = { m_predictedPositions.data(), m_predictedPositions.data() + 1, m_predictedPositions.data() + 2 };
+    auto densityAt = [&](int i, const float* const* axes, int step) {
+        float density = selfDensity;
+        for (int k = m_neighborStart[i]; k < m_neighborStart[i + 1]; ++k) {
+            int j = m_neighbors[k];
+            float r2 = 0;
+            for (int c = 0; c < Dim; ++c) {
+                float d = axes[c][i * step] - axes[c][j * step];
+                r2 += d * d;
+            }
+            density += MASS * m_cubicSpline(r2);
+        }
+        float position[3] = { 0, 0, 0 };
+        for (int c = 0; c < Dim; ++c)
+            position[c] = axes[c][i * step];
+        return density + boundaryDensity(position);
+    };
+
+    // current densities, then everything but pressure
+    parallelFor(0, n, [&](int begin, int end) {
+      for (int i=begin; i<end; ++i)
+        particleDensity[i] = densityAt(i, currentAxes, 1);
+    });
+    storeDensities(state);
+    const Vector3f fGravity = Vector3f(0.0, MASS * GRAVITY, 0.0);
+    parallelFor(0, n, [&](int begin, int end) {
+      for (int i=begin; i<end; ++i) {
+        const int* nearestParticles = m_neighbors.data() + m_neighborStart[i];
+        int numNeighbors = m_neighborStart[i+1] - m_neighborStart[i];
+        Vector3f fViscosity = calculateViscosityForceOnParticle<Dim>(i, state, nearestParticles, numNeighbors, particleDensity);
+        Vector3f acceleration = (fViscosity + fGravity + calculateExternalForceOnParticle(i, state.numParticles())) / MASS / 10;
+        for (int c = 0; c < 3; ++c)
+          m_nonPressureAcceleration[3*i + c] = acceleration[c];
+      }
+    });
+
+    int iteration = 0;
+    float averageError = 0;
+    while (iteration < MAX_SOLVER_ITERATIONS) {
+        ++iteration;
+        parallelFor(0, n, [&](int begin, int end) {
+          for (int i=begin; i<end; ++i) {
+            for (int c = 0; c < Dim; ++c) {
+              float v = state.channel(VX + c)[i] + h * (m_nonPressureAcceleration[3*i + c] + m_pressureAcceleration[3*i + c]);
+              m_predictedPositions[3*i + c] = state.channel(PX + c)[i] + h * v;
+            }
+          }
+        });
+        parallelFor(0, n, [&](int begin, int end) {
+          for (int i=begin; i<end; ++i) {
+            float density = densityAt(i, predictedAxes, 3);
+            float error = density - m_restDensity;
+            m_predictedDensity[i] = density;
+            m_densityError[i] = max(error, 0.0f);
+            m_pressure[i] = max(m_pressure[i] + stiffness * error, 0.0f);
+          }
+        });
+        // summed serially, so the result does not depend on the threads
+        double totalError = 0;
+        for (int i = 0; i < n; ++i)
+            totalError += m_densityError[i];
+        averageError = n > 0 ? (float) (totalError / n) / m_restDensity : 0.0f;
+
+        parallelFor(0, n, [&](int begin, int end) {
+          for (int i=begin; i<end; ++i) {
+            float acceleration[3] = { 0, 0, 0 };
+            float pressureTerm_i = m_pressure[i] * inverseRestDensity2;
+            for (int k = m_neighborStart[i]; k < m_neighborStart[i + 1]; ++k) {
+              int j = m_neighbors[k];
+              float r_ij[3];
+              float r2 = 0;
+              for (int c = 0; c < Dim; ++c) {
+                r_ij[c] = state.channel(PX + c)[i] - state.channel(PX + c)[j];
+                r2 += r_ij[c] * r_ij[c];
+              }
+              float pressureTerm_j = m_pressure[j] * inverseRestDensity2;
+              float magnitude = -MASS * (pressureTerm_i + pressureTerm_j) * m_cubicSpline.gradient(sqrt(r2));
+              for (int c = 0; c < Dim; ++c)
+                acceleration[c] += magnitude * r_ij[c];
+            }
+            // the boundary particles push with the pressure of i alone
+            float position[3];
+            boundaryFramePosition<Dim>(state, i, position);
+            visitBoundaryNeighbors(position, [&](int b, float r2, const float* r_ib) {
+              if (r2 == 0)
+                return;
+              float magnitude = -m_boundaryMass[b] * pressureTerm_i * m_cubicSpline.gradient(sqrt(r2));
+              for (int c = 0; c < Dim; ++c)
+                acceleration[c] += magnitude * r_ib[c];
+            });
+            for (int c = 0; c < 3; ++c)
+              m_pressureAcceleration[3*i + c] = acceleration[c];
+          }
+        });
+
+        if (iteration >= MIN_SOLVER_ITERATIONS && averageError <= m_params.maxDensityError)
+            break;
+    }
+    ++m_solves;
+    m_solverIterations += iteration;
+    m_lastDensityError = averageError;
+
+    parallelFor(0, n, [&](int begin, int end) {
+      for (int i=begin; i<end; ++i) {
+        Vector3f acceleration;
+        for (int c = 0; c < 3; ++c)
+          acceleration[c] = m_nonPressureAcceleration[3*i + c] + m_pressureAcceleration[3*i + c];
+        f.set(i, state.velocityAt(i), acceleration);
+      }
+    });
+}
+
 // render the system (ie draw the particles)
 void WaterSystem::draw(GLProgram& gl)
 {
@@ -198,97 +1120,173 @@ void WaterSystem::draw(GLProgram& gl)
 
     // example code. Replace with your own drawing  code
     //gl.updateModelMatrix(Matrix4f::translation(Vector3f(-0.5, 1.0, 0)));
-    vector<Vector3f> currentState = getState();
-   
-    for (int i=0; i<(int) currentState.size()/2; ++i) {
-      gl.updateModelMatrix(Matrix4f::translation(getPositionAt(currentState, i)));
-      drawSphere(0.05f, 10, 10);
-    }
-}
+    StateView currentState = getRenderView();
 
-float WaterSystem::calculateKernel(WaterSystem::KernelType type, float r) {
-  if (r < 0 || r > H_KERNEL) {
-    return 0;
-  }
+    if (m_surfaceRendering) {
+      m_surface.build(currentState);
+      gl.updateModelMatrix(Matrix4f::identity());
+      const vector<Vector3f>& positions = m_surface.positions();
+      const vector<Vector3f>& normals = m_surface.normals();
+      VertexRecorder rec;
+      for (size_t v=0; v<positions.size(); ++v) {
+        rec.record(positions[v], normals[v]);
+      }
+      rec.draw(GL_TRIANGLES);
+      return;
+    }
 
-  float numerator = 0;
-  float denominator = 1;
-
-  if (type == Poly6) {
-    numerator = 315 * pow( pow(H_KERNEL, 2) - pow(r, 2), 3);
-    denominator = 64 * c_pi * pow(H_KERNEL, 9);
-  } else if (type == Spiky) {
-    numerator = 15 * pow(H_KERNEL - r, 3);
-    denominator = c_pi * pow(H_KERNEL, 6);
-  } else if (type == Viscosity) {
-    float term1 = -pow(r, 3) / (2 * pow(H_KERNEL, 3));
-    float term2 = pow(r, 2) / pow(H_KERNEL, 2);
-    float term3 = H_KERNEL / (2 * r);
-
-    numerator = 15 * (term1 + term2 + term3 - 1);
-    denominator = 2 * c_pi * pow(H_KERNEL, 3);
-  }
+    if (currentState.numParticles() <= MAX_DRAWN_SPHERES) {
+      for (int i=0; i<currentState.numParticles(); ++i) {
+        gl.updateModelMatrix(Matrix4f::translation(currentState.positionAt(i)));
+        drawSphere(0.625f * m_params.particleSpacing, 10, 10);
+      }
+      return;
+    }
 
-  return numerator / denominator;
+    // too many for spheres: one point each
+    gl.disableLighting();
+    gl.updateModelMatrix(Matrix4f::identity());
+    VertexRecorder rec;
+    for (int i=0; i<currentState.numParticles(); ++i) {
+      rec.record(currentState.positionAt(i), PENDULUM_COLOR);
+    }
+    glPointSize(2.0f);
+    rec.draw(GL_POINTS);
+    gl.enableLighting();
 }
 
-float WaterSystem::calculateDensityOfParticle(int i, std::vector<Vector3f> state, std::vector<int> nearestParticles) {
+template <int Dim>
+float WaterSystem::calculateDensityOfParticle(int i, const StateView& state, const int* nearestParticles, int numNeighbors) {
     float density = SINGLE_PARTICLE_DENSITY;
-    Vector3f x_i = getPositionAt(state, i);
 
-    for (int j = 0; j<(int) nearestParticles.size(); ++j) {
-      float index = nearestParticles.at(j);
-      Vector3f x_j = getPositionAt(state, index);
-      float r = (x_i - x_j).abs();
-      float W = calculateKernel(Poly6, r);
+    for (int j = 0; j<numNeighbors; ++j) {
+      int index = nearestParticles[j];
+      float W = m_poly6(distanceSquared<Dim>(state, i, index));
 
       density += MASS * W;
   }
     //cout << density << " " << endl;
 
-  return density;
+  float position[3];
+  boundaryFramePosition<Dim>(state, i, position);
+  return density + boundaryDensity(position);
 }
 
-Vector3f WaterSystem::calculatePressureForceOnParticle(int i, std::vector<Vector3f> state, std::vector<int> nearestParticles, std::vector<float> particleDensity) {
-  Vector3f force = Vector3f();
-  Vector3f x_i = getPositionAt(state, i);
-  float density_i = particleDensity.at(i);
+template <int Dim>
+Vector3f WaterSystem::calculatePressureForceOnParticle(int i, const StateView& state, const int* nearestParticles, int numNeighbors, const float* particleDensity) {
+  float force[3] = { 0, 0, 0 };
+  float density_i = particleDensity[i];
 
-  for (int j=0; j<(int) nearestParticles.size(); ++j) {
-    Vector3f x_j = getPositionAt(state, nearestParticles.at(j));
-    float density_j = particleDensity.at(j);
-    Vector3f r_ij = x_i - x_j;
-    float q_ij = r_ij.abs() / H_KERNEL;
+  for (int j=0; j<numNeighbors; ++j) {
+    int index = nearestParticles[j];
+    float density_j = particleDensity[index];
+    float r_ij[3];
+    float r2 = 0;
+    for (int c = 0; c < Dim; ++c) {
+      r_ij[c] = state.channel(PX + c)[i] - state.channel(PX + c)[index];
+      r2 += r_ij[c] * r_ij[c];
+    }
 
     float numerator1 = density_i + density_j - 2 * REST_DENSITY;
-    float numerator2 = pow((1 - q_ij), 2);
-    force += MASS * numerator1 * numerator2 * r_ij / (density_j * q_ij);
+    float magnitude = MASS * numerator1 * m_spikyGradient(sqrt(r2));
+    for (int c = 0; c < Dim; ++c)
+      force[c] += magnitude * r_ij[c] / density_j;
   }
 
-  force = force * K_GAS_CONSTANT / (c_pi * pow(H_KERNEL, 4));
-  return force;
+  return Vector3f(force[0], force[1], force[2]) * K_GAS_CONSTANT;
 }
 
-Vector3f WaterSystem::calculateViscosityForceOnParticle(int i, std::vector<Vector3f> state, std::vector<int> nearestParticles, std::vector<float> particleDensity) {
-  Vector3f force = Vector3f();
-  Vector3f x_i = getPositionAt(state, i);
-  Vector3f v_i = getVelocityAt(state, i);
+template <int Dim>
+Vector3f WaterSystem::calculateViscosityForceOnParticle(int i, const StateView& state, const int* nearestParticles, int numNeighbors, const float* particleDensity) {
+  float force[3] = { 0, 0, 0 };
 
-  for (int j=0; j<(int) nearestParticles.size(); ++j) {
-    float index = nearestParticles.at(j);
-    Vector3f x_j = getPositionAt(state, index);
-    Vector3f v_j = getVelocityAt(state, index);
-    float density_j = particleDensity.at(index);
-    Vector3f r_ij = x_i - x_j;
-    float q_ij = r_ij.abs() / H_KERNEL;
+  for (int j=0; j<numNeighbors; ++j) {
+    int index = nearestParticles[j];
+    float density_j = particleDensity[index];
+    float r2 = distanceSquared<Dim>(state, i, index);
+    float laplacian = m_tabulatedKernels ? m_viscosityTable(r2) : m_viscosityLaplacian(sqrt(r2));
 
-    force += MASS * (v_i - v_j) * (1 - q_ij) / density_j;
+    for (int c = 0; c < Dim; ++c) {
+      float dv = state.channel(VX + c)[i] - state.channel(VX + c)[index];
+      force[c] += MASS * dv * laplacian / density_j;
+    }
   }
 
-  force = force * 40 * MU / (c_pi * pow(H_KERNEL, 4));
-  return force;
+  return Vector3f(force[0], force[1], force[2]) * MU;
+}
+
+// Pressure and viscosity over the half candidate list: each pair (i, j),
+// j > i, within the neighbor radius is evaluated once. The pressure and viscosity terms share the
+// factor MASS / density of the other particle, so one pair value t goes
+// to i as t / density_j and to j as -t / density_i, scaled like the
+// sides of evaluate() (1000 * K_GAS_CONSTANT for pressure, MU for
+// viscosity).
+//
+// The blocks run in parallel. A block adds directly to its own particles
+// and defers contributions to later blocks' particles to its spill list,
+// and the spills are added serially in block order afterwards, so every
+// sum has the same order for any thread count.
+template <int Dim>
+void WaterSystem::accumulateSymmetricForces(const StateView& state, const float* particleDensity) {
+    const int n = state.numParticles();
+    const int blocks = SYMMETRIC_FORCE_BLOCKS;
+    m_pairForces.assign(3 * n, 0.0f);
+    m_spills.resize(blocks);
+
+    const float pressureScale = 1000 * K_GAS_CONSTANT * MASS;
+    const float viscosityScale = MU * MASS;
+    parallelFor(0, blocks, [&](int firstBlock, int lastBlock) {
+      for (int b = firstBlock; b < lastBlock; ++b) {
+        const int blockEnd = m_blockStart[b + 1];
+        vector<ForceSpill>& spills = m_spills[b];
+        spills.clear();
+        for (int i = m_blockStart[b]; i < blockEnd; ++i) {
+          const float density_i = particleDensity[i];
+          float force_i[3] = { 0, 0, 0 };
+          for (int k = m_halfStart[i]; k < m_halfStart[i + 1]; ++k) {
+            int j = m_halfNeighbors[k];
+            const float density_j = particleDensity[j];
+            float r_ij[3];
+            float r2 = 0;
+            for (int c = 0; c < Dim; ++c) {
+              r_ij[c] = state.channel(PX + c)[i] - state.channel(PX + c)[j];
+              r2 += r_ij[c] * r_ij[c];
+            }
+            float r = sqrt(r2);
+            // the same pairs findNeighbors keeps
+            if (r > m_neighborRadius || r == 0)
+              continue;
+            float pressure = pressureScale * (density_i + density_j - 2 * REST_DENSITY) * m_spikyGradient(r);
+            float viscosity = viscosityScale * (m_tabulatedKernels ? m_viscosityTable(r2) : m_viscosityLaplacian(r));
+
+            ForceSpill spill = { j, { 0, 0, 0 } };
+            float* force_j = j < blockEnd ? &m_pairForces[3*j] : spill.force;
+            for (int c = 0; c < Dim; ++c) {
+              float dv = state.channel(VX + c)[i] - state.channel(VX + c)[j];
+              float t = pressure * r_ij[c] + viscosity * dv;
+              force_i[c] += t / density_j;
+              force_j[c] -= t / density_i;
+            }
+            if (j >= blockEnd)
+              spills.push_back(spill);
+          }
+          for (int c = 0; c < Dim; ++c)
+            m_pairForces[3*i + c] += force_i[c];
+        }
+      }
+    }, 1);
+
+    for (int b = 0; b < blocks; ++b) {
+        for (size_t k = 0; k < m_spills[b].size(); ++k) {
+            const ForceSpill& spill = m_spills[b][k];
+            for (int c = 0; c < Dim; ++c)
+                m_pairForces[3*spill.particle + c] += spill.force[c];
+        }
+    }
 }
 
-Vector3f WaterSystem::calculateExternalForceOnParticle() {
-  return Vector3f();
+Vector3f WaterSystem::calculateExternalForceOnParticle(int i, int numParticles) {
+  if (!hasExternalForces(numParticles))
+    return Vector3f();
+  return Vector3f(m_externalForces[3*i], m_externalForces[3*i + 1], m_externalForces[3*i + 2]);
 }
@@ -1,43 +1,278 @@
 #ifndef WATERSYSTEM_H
 #define WATERSYSTEM_H
 
+#include <cstdint>
 #include <vector>
 
+#include "boundarystage.h"
 #include "particlesystem.h"
+#include "spatialhashgrid.h"
+#include "sphkernels.h"
+#include "surfacemesher.h"
+
+// Scene setup of a WaterSystem. The tank spans [-1, 1] in x and y, and
+// [-tankDepth/2, tankDepth/2] in z in 3D. A block of water starts in
+// x < 0, 0 <= y < 1, filling the tank's depth in 3D. The simulation
+// itself is not bounded by the tank.
+struct WaterParams
+{
+    WaterParams();
+
+    // WCSPH: weakly compressible, pressure from an equation of state.
+    // PCISPH: predictive-corrective incompressible SPH, which iterates the
+    // pressures until the predicted density error is below
+    // maxDensityError; it takes much larger steps, ideally with the
+    // symplectic Euler integrator.
+    enum Solver { SOLVER_WCSPH, SOLVER_PCISPH };
+
+    // 2 (all particles in the z = 0 plane) or 3
+    int dimensions;
+    // initial particle spacing. The neighbor radius is the spacing with
+    // WCSPH and twice the spacing with PCISPH.
+    float particleSpacing;
+    // extent of the tank along z; only used in 3D
+    float tankDepth;
+    Solver solver;
+    // average compression, relative to the rest density, that PCISPH
+    // iterates down to
+    float maxDensityError;
+    // fraction of the CFL limits that stableStepSize() suggests
+    float courantFactor;
+    // start with the block of water; otherwise start empty, e.g. to be
+    // filled by emitters
+    bool initialBlock;
+};
+
+// Inflow nozzle. Emits a layer of particles, spaced like the initial
+// block across a disc of the given radius around position (a segment in
+// 2D) perpendicular to velocity, every time the previous layer has moved
+// one particle spacing.
+struct WaterEmitter
+{
+    WaterEmitter(const Vector3f& position, const Vector3f& velocity, float radius);
+
+    Vector3f position;
+    Vector3f velocity;
+    float radius;
+};
+
+// Outflow region: particles inside the box are removed.
+struct WaterSink
+{
+    WaterSink(const Vector3f& boxMin, const Vector3f& boxMax);
+
+    Vector3f boxMin;
+    Vector3f boxMax;
+};
 
 class WaterSystem : public ParticleSystem
 {
 public:
-	enum KernelType {
-	  Poly6,
-	  Spiky,
-	  Viscosity
-	};
+    explicit WaterSystem(const WaterParams& params = WaterParams());
+
+    const WaterParams& params() const { return m_params; }
+
+    // evaluates the viscosity kernel from a table over squared distance
+    // instead of exactly, saving a square root per pair
+    void setTabulatedKernels(bool enabled) { m_tabulatedKernels = enabled; invalidateDerivativeCache(); }
+    // WCSPH: evaluates every neighbor pair once, from a half neighbor
+    // list, and applies it to both particles. Rounds differently from the
+    // default, which evaluates each pair from both sides. The half list is
+    // built with the neighbor lists, so switching rebuilds them.
+    void setSymmetricForces(bool enabled)
+    {
+        m_symmetricForces = enabled;
+        m_buildPositions.clear();
+        invalidateDerivativeCache();
+    }
+
+    // draws a marching-cubes mesh of the water surface instead of the
+    // particles, rebuilt from the render state on every draw
+    void setSurfaceRendering(bool enabled) { m_surfaceRendering = enabled; }
+    // the mesh of the last draw
+    const SurfaceMesher& surface() const { return m_surface; }
 
-    WaterSystem();
+    // walls applied at the start of every step; the tank by default
+    BoundaryStage& boundaries() { return m_boundaries; }
 
-    std::vector<Vector3f> evalF(std::vector<Vector3f> state) override;
+    // emitters and sinks act at the start of every step
+    void addEmitter(const WaterEmitter& emitter);
+    void addSink(const WaterSink& sink);
+
+    // Two-way coupling to the particles of another system, e.g. a cloth,
+    // acting as boundary particles (Akinci et al. 2012). Until the next
+    // call, each one adds to the density of the water around it as much
+    // fluid mass as it covers, and pushes that water back with its
+    // pressure, in every evalF, so the solvers see the boundary. Water
+    // within radius of one is also pushed out along the line between them
+    // and damped towards its velocity when approaching, which keeps it
+    // from slipping between sparse boundary particles. Distances are taken
+    // in 3D, including for 2D water. Sets the water's external forces for
+    // the next step and writes the opposite forces, with the pressure
+    // forces of the current state, on the boundary particles to reaction,
+    // (x, y, z) each, in the units of a system in which a water particle
+    // has mass particleMass. The boundary particles are looked up in the
+    // water's own grid and the other way round, so this takes time linear
+    // in both particle counts.
+    void coupleBoundary(const StateView& boundary, float radius, float particleMass,
+                        std::vector<float>& reaction);
+
+    void evalF(const StateView& state, DerivativeView& f) override;
+    using ParticleSystem::evalF;
     void draw(GLProgram&);
-	
-    // inherits 
-    // std::vector<Vector3f> m_vVecState;
+    // periodically reorders the particles for memory locality, runs the
+    // sinks and emitters, then resolves wall contacts. PCISPH predicts
+    // over steps of h.
+    void beginStep(float h) override;
+    // CFL step: courantFactor times the smallest of the times to cross
+    // the neighbor radius at the fastest speed, to cover it from rest at
+    // the largest acceleration of the last evalF, and to diffuse over it
+    float stableStepSize() const override;
+    void printStats(std::ostream& out) const override;
+
+    // WCSPH wall time so far in the neighbor search (list rebuilds
+    // included) and in the pressure and viscosity pass
+    double neighborSeconds() const { return m_neighborSeconds; }
+    double forceSeconds() const { return m_forceSeconds; }
+
+    // inherits
+    // ParticleStore m_store;
 private:
-    //list of state indices
-    std::vector<std::vector<int>> systemGrid;
+    WaterParams m_params;
+    float m_neighborRadius;
+    // Verlet list margin; grid cells are as wide as the list radius
+    float m_skin;
+
+    // sparse grid of cells as wide as the list radius, rebuilt with the
+    // neighbor lists
+    SpatialHashGrid m_grid;
+    BoundaryStage m_boundaries;
+
+    std::vector<WaterEmitter> m_emitters;
+    // distance each emitter's last layer has moved since it was emitted
+    std::vector<float> m_emitterTravel;
+    std::vector<WaterSink> m_sinks;
+    // reused by removeSunkParticles
+    std::vector<int> m_sunk;
+    long m_emitted;
+    long m_removed;
+
+    SurfaceMesher m_surface;
+    bool m_surfaceRendering;
+
+    // Verlet lists: every particle within m_neighborRadius + m_skin at the
+    // last rebuild, laid out the same way by particle. They stay valid
+    // until some particle has moved more than half the skin.
+    std::vector<int> m_candidateStart;
+    std::vector<int> m_candidates;
+    // positions (x, y, z per particle) at the last rebuild
+    std::vector<float> m_buildPositions;
+    long m_evaluations;
+    long m_rebuilds;
+    double m_neighborSeconds;
+    double m_forceSeconds;
+    // largest |dv/dt| of the last evalF, for the CFL step
+    float m_maxAcceleration;
 
+    int m_stepsSinceReorder;
+    long m_reorders;
+    // reused by reorderParticles: (Morton code << 32 | slot) per particle
+    std::vector<uint64_t> m_sortKeys;
+    std::vector<int> m_order;
+
+    Poly6Kernel m_poly6;
+    SpikyGradientKernel m_spikyGradient;
+    ViscosityLaplacianKernel m_viscosityLaplacian;
+    TabulatedKernel m_viscosityTable;
+    bool m_tabulatedKernels;
+    bool m_symmetricForces;
+
+    // the candidates within m_neighborRadius in the current evalF
+    std::vector<int> m_neighborStart;
+    std::vector<int> m_neighbors;
+
+    // symmetric forces: the candidates j > i of each particle and the
+    // first particle of each block of about equal pair work, both built
+    // with the Verlet lists; the force sums ((x, y, z) per particle); and
+    // per block the contributions to particles past the block's end, added
+    // after the parallel pass
+    struct ForceSpill { int particle; float force[3]; };
+    std::vector<int> m_halfStart;
+    std::vector<int> m_halfNeighbors;
+    std::vector<int> m_blockStart;
+    std::vector<float> m_pairForces;
+    std::vector<std::vector<ForceSpill> > m_spills;
+
+    // boundary coupling: the contacts of each boundary particle, with the
+    // force on the water particle
+    std::vector<int> m_boundaryStart;
+    std::vector<ForceSpill> m_boundaryContacts;
+    // and as seen by the SPH sums: positions ((x, y, z) per particle) at
+    // the last coupling, binned by cells of the neighbor radius, and the
+    // fluid mass each stands for; the density of a particle inside the
+    // initial lattice, which a boundary particle makes up with its
+    // neighbors
+    std::vector<float> m_boundaryPositions;
+    SpatialHashGrid m_boundaryGrid;
+    std::vector<float> m_boundaryMass;
+    float m_latticeDensity;
+    long m_couplings;
+
+    // densities of the state of the current evalF
+    std::vector<float> m_density;
+    void storeDensities(const StateView& state);
+
+    // PCISPH: the step predicted over, the kernel (with support
+    // m_neighborRadius), the density of a particle inside the initial
+    // lattice, and the pressure per unit density error times h^2
+    float m_stepSize;
+    CubicSplineKernel m_cubicSpline;
+    float m_restDensity;
+    float m_pressureStiffness;
+    // per-iteration state; vectors are (x, y, z) per particle
+    std::vector<float> m_nonPressureAcceleration;
+    std::vector<float> m_pressureAcceleration;
+    std::vector<float> m_predictedPositions;
+    std::vector<float> m_predictedDensity;
+    std::vector<float> m_pressure;
+    std::vector<float> m_densityError;
+    long m_solves;
+    long m_solverIterations;
+    float m_lastDensityError;
 
-	void setGrid(const std::vector<std::vector<int>>  & newGrid) { systemGrid = newGrid; };
 	void printGrid();
-	int posToGridIndex(float x, float y);
-	void clearGrid();
-	void updateGrid(std::vector<Vector3f> state);
-	std::vector<int> getNeighbors(int i, std::vector<Vector3f> state);
-
-	float calculateKernel(KernelType type, float r);
-	float calculateDensityOfParticle(int i, std::vector<Vector3f> state, std::vector<int> nearestParticles);
-	Vector3f calculatePressureForceOnParticle(int i, std::vector<Vector3f> state, std::vector<int> nearestParticles, std::vector<float> particleDensity);
-	Vector3f calculateViscosityForceOnParticle(int i, std::vector<Vector3f> state, std::vector<int> nearestParticles, std::vector<float> particleDensity);
-	Vector3f calculateExternalForceOnParticle();
+	// return whether particles were removed (added)
+	bool removeSunkParticles();
+	bool emitParticles(float h);
+
+	// everything below works on the first Dim coordinates only, so 2D
+	// runs skip the z channels
+	template <int Dim> void evaluate(const StateView& state, DerivativeView& f);
+	template <int Dim> void evaluateIncompressible(const StateView& state, DerivativeView& f);
+	template <int Dim> void initializeIncompressible();
+	template <int Dim> void reorderParticles();
+	template <int Dim> bool neighborListsStale(const StateView& state) const;
+	template <int Dim> void buildNeighborLists(const StateView& state);
+	void buildHalfList(int numParticles);
+	template <int Dim> void findNeighbors(const StateView& state);
+	template <int Dim> void accumulateSymmetricForces(const StateView& state, const float* particleDensity);
+	template <int Dim> void coupleBoundaryParticles(const StateView& boundary, float radius, float particleMass,
+	                                                std::vector<float>& reaction);
+	// the density kernel of the solver, and a particle's own share of its
+	// density
+	float densityKernel(float r2) const;
+	float selfDensity() const;
+	template <int Dim> float latticeDensity() const;
+	template <typename Visit> void visitBoundaryNeighbors(const float* position, Visit visit) const;
+	template <int Dim, typename Visit> void visitWaterNeighbors(const StateView& state, const float* position,
+	                                                            float radius, Visit visit) const;
+	float boundaryDensity(const float* position) const;
+	template <int Dim> Vector3f calculateBoundaryPressureForce(const float* position, float density_i);
+
+	template <int Dim> float calculateDensityOfParticle(int i, const StateView& state, const int* nearestParticles, int numNeighbors);
+	template <int Dim> Vector3f calculatePressureForceOnParticle(int i, const StateView& state, const int* nearestParticles, int numNeighbors, const float* particleDensity);
+	template <int Dim> Vector3f calculateViscosityForceOnParticle(int i, const StateView& state, const int* nearestParticles, int numNeighbors, const float* particleDensity);
+	Vector3f calculateExternalForceOnParticle(int i, int numParticles);
 };
 
 #endif
@@ -1,3 +1,6 @@
+// the inline operations of Quat4f.h are also compiled here, out of line
+#define QUAT4F_OUT_OF_LINE
+
 #define _USE_MATH_DEFINES
 #include <cmath>
 #ifndef M_PI
@@ -19,42 +22,6 @@ const Quat4f Quat4f::ZERO = Quat4f( 0, 0, 0, 0 );
 // static
 const Quat4f Quat4f::IDENTITY = Quat4f( 1, 0, 0, 0 );
 
-Quat4f::Quat4f()
-{
-	m_elements[ 0 ] = 0;
-	m_elements[ 1 ] = 0;
-	m_elements[ 2 ] = 0;
-	m_elements[ 3 ] = 0;
-}
-
-Quat4f::Quat4f( float w, float x, float y, float z )
-{
-	m_elements[ 0 ] = w;
-	m_elements[ 1 ] = x;
-	m_elements[ 2 ] = y;
-	m_elements[ 3 ] = z;
-}
-
-Quat4f::Quat4f( const Quat4f& rq )
-{
-	m_elements[ 0 ] = rq.m_elements[ 0 ];
-	m_elements[ 1 ] = rq.m_elements[ 1 ];
-	m_elements[ 2 ] = rq.m_elements[ 2 ];
-	m_elements[ 3 ] = rq.m_elements[ 3 ];
-}
-
-Quat4f& Quat4f::operator = ( const Quat4f& rq )
-{
-	if( this != ( &rq ) )
-	{
-		m_elements[ 0 ] = rq.m_elements[ 0 ];
-		m_elements[ 1 ] = rq.m_elements[ 1 ];
-		m_elements[ 2 ] = rq.m_elements[ 2 ];
-		m_elements[ 3 ] = rq.m_elements[ 3 ];
-	}
-    return( *this );
-}
-
 Quat4f::Quat4f( const Vector3f& v )
 {
 	m_elements[ 0 ] = 0;
@@ -71,36 +38,6 @@ Quat4f::Quat4f( const Vector4f& v )
 	m_elements[ 3 ] = v[ 3 ];
 }
 
-const float& Quat4f::operator [] ( int i ) const
-{
-	return m_elements[ i ];
-}
-
-float& Quat4f::operator [] ( int i )
-{
-	return m_elements[ i ];
-}
-
-float Quat4f::w() const
-{
-	return m_elements[ 0 ];
-}
-
-float Quat4f::x() const
-{
-	return m_elements[ 1 ];
-}
-
-float Quat4f::y() const
-{
-	return m_elements[ 2 ];
-}
-
-float Quat4f::z() const
-{
-	return m_elements[ 3 ];
-}
-
 Vector3f Quat4f::xyz() const
 {
 	return Vector3f
@@ -122,73 +59,6 @@ Vector4f Quat4f::wxyz() const
 	);
 }
 
-float Quat4f::abs() const
-{
-	return sqrt( absSquared() );	
-}
-
-float Quat4f::absSquared() const
-{
-	return
-	(
-		m_elements[ 0 ] * m_elements[ 0 ] +
-		m_elements[ 1 ] * m_elements[ 1 ] +
-		m_elements[ 2 ] * m_elements[ 2 ] +
-		m_elements[ 3 ] * m_elements[ 3 ]
-	);
-}
-
-void Quat4f::normalize()
-{
-	float reciprocalAbs = 1.f / abs();
-
-	m_elements[ 0 ] *= reciprocalAbs;
-	m_elements[ 1 ] *= reciprocalAbs;
-	m_elements[ 2 ] *= reciprocalAbs;
-	m_elements[ 3 ] *= reciprocalAbs;
-}
-
-Quat4f Quat4f::normalized() const
-{
-	Quat4f q( *this );
-	q.normalize();
-	return q;
-}
-
-void Quat4f::conjugate()
-{
-	m_elements[ 1 ] = -m_elements[ 1 ];
-	m_elements[ 2 ] = -m_elements[ 2 ];
-	m_elements[ 3 ] = -m_elements[ 3 ];
-}
-
-Quat4f Quat4f::conjugated() const
-{
-	return Quat4f
-	(
-		 m_elements[ 0 ],
-		-m_elements[ 1 ],
-		-m_elements[ 2 ],
-		-m_elements[ 3 ]
-	);
-}
-
-void Quat4f::invert()
-{
-	Quat4f inverse = conjugated() * ( 1.0f / absSquared() );
-
-	m_elements[ 0 ] = inverse.m_elements[ 0 ];
-	m_elements[ 1 ] = inverse.m_elements[ 1 ];
-	m_elements[ 2 ] = inverse.m_elements[ 2 ];
-	m_elements[ 3 ] = inverse.m_elements[ 3 ];
-}
-
-Quat4f Quat4f::inverse() const
-{
-	return conjugated() * ( 1.0f / absSquared() );
-}
-
-
 Quat4f Quat4f::log() const
 {
 	float len =
@@ -265,24 +135,6 @@ void Quat4f::print()
 		m_elements[ 0 ], m_elements[ 1 ], m_elements[ 2 ], m_elements[ 3 ] );
 }
 
-// static
-float Quat4f::dot( const Quat4f& q0, const Quat4f& q1 )
-{
-	return
-	(
-		q0.w() * q1.w() +
-		q0.x() * q1.x() +
-		q0.y() * q1.y() +
-		q0.z() * q1.z()
-	);
-}
-
-// static
-Quat4f Quat4f::lerp( const Quat4f& q0, const Quat4f& q1, float alpha )
-{
-	return( ( q0 + alpha * ( q1 - q0 ) ).normalized() );
-}
-
 // static
 Quat4f Quat4f::slerp( const Quat4f& a, const Quat4f& b, float t, bool allowFlip )
 {
@@ -443,62 +295,3 @@ Quat4f Quat4f::randomRotation( float u0, float u1, float u2 )
 		sin( w ) * z
 	);
 }
-
-//////////////////////////////////////////////////////////////////////////
-// Operators
-//////////////////////////////////////////////////////////////////////////
-
-Quat4f operator + ( const Quat4f& q0, const Quat4f& q1 )
-{
-	return Quat4f
-	(
-		q0.w() + q1.w(),
-		q0.x() + q1.x(),
-		q0.y() + q1.y(),
-		q0.z() + q1.z()
-	);
-}
-
-Quat4f operator - ( const Quat4f& q0, const Quat4f& q1 )
-{
-	return Quat4f
-	(
-		q0.w() - q1.w(),
-		q0.x() - q1.x(),
-		q0.y() - q1.y(),
-		q0.z() - q1.z()
-	);
-}
-
-Quat4f operator * ( const Quat4f& q0, const Quat4f& q1 )
-{
-	return Quat4f
-	(
-		q0.w() * q1.w() - q0.x() * q1.x() - q0.y() * q1.y() - q0.z() * q1.z(),
-		q0.w() * q1.x() + q0.x() * q1.w() + q0.y() * q1.z() - q0.z() * q1.y(),
-		q0.w() * q1.y() - q0.x() * q1.z() + q0.y() * q1.w() + q0.z() * q1.x(),
-		q0.w() * q1.z() + q0.x() * q1.y() - q0.y() * q1.x() + q0.z() * q1.w()
-	);
-}
-
-Quat4f operator * ( float f, const Quat4f& q )
-{
-	return Quat4f
-	(
-		f * q.w(),
-		f * q.x(),
-		f * q.y(),
-		f * q.z()
-	);
-}
-
-Quat4f operator * ( const Quat4f& q, float f )
-{
-	return Quat4f
-	(
-		f * q.w(),
-		f * q.x(),
-		f * q.y(),
-		f * q.z()
-	);
-}
@@ -2,10 +2,24 @@
 #define MATRIX3F_H
 
 #include <cstdio>
+#include <cstring>
+
+#include "Vector3f.h"
+
+// Element access, the constructors and the products are defined inline
+// at the end of this header (constexpr where C++11 allows), like the
+// vector operations. Matrix3f.cpp defines MATRIX3F_OUT_OF_LINE, so
+// they are still compiled into the library as well.
+#ifdef MATRIX3F_OUT_OF_LINE
+#define MATRIX3F_INLINE
+#define MATRIX3F_CONSTEXPR
+#else
+#define MATRIX3F_INLINE inline
+#define MATRIX3F_CONSTEXPR constexpr
+#endif
 
 class Matrix2f;
 class Quat4f;
-class Vector3f;
 
 // 3x3 Matrix, stored in column major order (OpenGL style)
 class Matrix3f
@@ -13,8 +27,8 @@ class Matrix3f
 public:
 
     // Fill a 3x3 matrix with "fill", default to 0.
-	Matrix3f( float fill = 0.f );
-	Matrix3f( float m00, float m01, float m02,
+	MATRIX3F_INLINE Matrix3f( float fill = 0.f );
+	MATRIX3F_CONSTEXPR Matrix3f( float m00, float m01, float m02,
 		float m10, float m11, float m12,
 		float m20, float m21, float m22 );
 
@@ -22,18 +36,18 @@ public:
 	// otherwise, sets the rows
 	Matrix3f( const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, bool setColumns = true );
 
-	Matrix3f( const Matrix3f& rm ); // copy constructor
-	Matrix3f& operator = ( const Matrix3f& rm ); // assignment operator
+	MATRIX3F_INLINE Matrix3f( const Matrix3f& rm ); // copy constructor
+	MATRIX3F_INLINE Matrix3f& operator = ( const Matrix3f& rm ); // assignment operator
 	// no destructor necessary
 
-	const float& operator () ( int i, int j ) const;
-	float& operator () ( int i, int j );
+	MATRIX3F_CONSTEXPR const float& operator () ( int i, int j ) const;
+	MATRIX3F_INLINE float& operator () ( int i, int j );
 
-	Vector3f getRow( int i ) const;
-	void setRow( int i, const Vector3f& v );
+	MATRIX3F_CONSTEXPR Vector3f getRow( int i ) const;
+	MATRIX3F_INLINE void setRow( int i, const Vector3f& v );
 
-	Vector3f getCol( int j ) const;
-	void setCol( int j, const Vector3f& v );
+	MATRIX3F_INLINE Vector3f getCol( int j ) const;
+	MATRIX3F_INLINE void setCol( int j, const Vector3f& v );
 
 	// gets the 2x2 submatrix of this matrix to m
 	// starting with upper left corner at (i0, j0)
@@ -51,7 +65,7 @@ public:
 	Matrix3f transposed() const;
 
 	// ---- Utility ----
-	operator float* (); // automatic type conversion for GL
+	MATRIX3F_INLINE operator float* (); // automatic type conversion for GL
 	void print();
 
 	static float determinant3x3( float m00, float m01, float m02,
@@ -79,9 +93,133 @@ private:
 
 // Matrix-Vector multiplication
 // 3x3 * 3x1 ==> 3x1
-Vector3f operator * ( const Matrix3f& m, const Vector3f& v );
+MATRIX3F_INLINE Vector3f operator * ( const Matrix3f& m, const Vector3f& v );
 
 // Matrix-Matrix multiplication
-Matrix3f operator * ( const Matrix3f& x, const Matrix3f& y );
+MATRIX3F_INLINE Matrix3f operator * ( const Matrix3f& x, const Matrix3f& y );
+
+//////////////////////////////////////////////////////////////////////////
+// Inline definitions
+//////////////////////////////////////////////////////////////////////////
+
+MATRIX3F_INLINE Matrix3f::Matrix3f( float fill )
+{
+	for( int i = 0; i < 9; ++i )
+	{
+		m_elements[ i ] = fill;
+	}
+}
+
+MATRIX3F_CONSTEXPR Matrix3f::Matrix3f( float m00, float m01, float m02,
+				   float m10, float m11, float m12,
+				   float m20, float m21, float m22 ) :
+	m_elements{ m00, m10, m20,
+				m01, m11, m21,
+				m02, m12, m22 }
+{
+}
+
+MATRIX3F_INLINE Matrix3f::Matrix3f( const Matrix3f& rm )
+{
+	memcpy( m_elements, rm.m_elements, sizeof(m_elements)  );
+}
+
+MATRIX3F_INLINE Matrix3f& Matrix3f::operator = ( const Matrix3f& rm )
+{
+	if( this != &rm )
+	{
+		memcpy( m_elements, rm.m_elements, sizeof(m_elements)  );
+	}
+	return *this;
+}
+
+MATRIX3F_CONSTEXPR const float& Matrix3f::operator () ( int i, int j ) const
+{
+	return m_elements[ j * 3 + i ];
+}
+
+MATRIX3F_INLINE float& Matrix3f::operator () ( int i, int j )
+{
+	return m_elements[ j * 3 + i ];
+}
+
+MATRIX3F_CONSTEXPR Vector3f Matrix3f::getRow( int i ) const
+{
+	return Vector3f
+	(
+		m_elements[ i ],
+		m_elements[ i + 3 ],
+		m_elements[ i + 6 ]
+	);
+}
+
+MATRIX3F_INLINE void Matrix3f::setRow( int i, const Vector3f& v )
+{
+	m_elements[ i ] = v.x();
+	m_elements[ i + 3 ] = v.y();
+	m_elements[ i + 6 ] = v.z();
+}
+
+MATRIX3F_INLINE Vector3f Matrix3f::getCol( int j ) const
+{
+	int colStart = 3 * j;
+
+	return Vector3f
+	(
+		m_elements[ colStart ],
+		m_elements[ colStart + 1 ],
+		m_elements[ colStart + 2 ]			
+	);
+}
+
+MATRIX3F_INLINE void Matrix3f::setCol( int j, const Vector3f& v )
+{
+	int colStart = 3 * j;
+
+	m_elements[ colStart ] = v.x();
+	m_elements[ colStart + 1 ] = v.y();
+	m_elements[ colStart + 2 ] = v.z();
+}
+
+MATRIX3F_INLINE Matrix3f::operator float* ()
+{
+	return m_elements;
+}
+
+MATRIX3F_INLINE Vector3f operator * ( const Matrix3f& m, const Vector3f& v )
+{
+	Vector3f output( 0, 0, 0 );
+
+	for( int i = 0; i < 3; ++i )
+	{
+		for( int j = 0; j < 3; ++j )
+		{
+			output[ i ] += m( i, j ) * v[ j ];
+		}
+	}
+
+	return output;
+}
+
+MATRIX3F_INLINE Matrix3f operator * ( const Matrix3f& x, const Matrix3f& y )
+{
+	Matrix3f product; // zeroes
+
+	for( int i = 0; i < 3; ++i )
+	{
+		for( int j = 0; j < 3; ++j )
+		{
+			for( int k = 0; k < 3; ++k )
+			{
+				product( i, k ) += x( i, j ) * y( j, k );
+			}
+		}
+	}
+
+	return product;
+}
+
+#undef MATRIX3F_INLINE
+#undef MATRIX3F_CONSTEXPR
 
 #endif // MATRIX3F_H
@@ -2,12 +2,25 @@
 #define MATRIX4F_H
 
 #include <cstdio>
+#include <cstring>
+
+#include "Vector4f.h"
+
+// As in Matrix3f.h, element access, the constructors and the products
+// are defined inline at the end of this header; Matrix4f.cpp defines
+// MATRIX4F_OUT_OF_LINE to keep compiling them into the library.
+#ifdef MATRIX4F_OUT_OF_LINE
+#define MATRIX4F_INLINE
+#define MATRIX4F_CONSTEXPR
+#else
+#define MATRIX4F_INLINE inline
+#define MATRIX4F_CONSTEXPR constexpr
+#endif
 
 class Matrix2f;
 class Matrix3f;
 class Quat4f;
 class Vector3f;
-class Vector4f;
 
 // 4x4 Matrix, stored in column major order (OpenGL style)
 class Matrix4f
@@ -15,8 +28,8 @@ class Matrix4f
 public:
 
     // Fill a 4x4 matrix with "fill".  Default to 0.
-	Matrix4f( float fill = 0.f );
-	Matrix4f( float m00, float m01, float m02, float m03,
+	MATRIX4F_INLINE Matrix4f( float fill = 0.f );
+	MATRIX4F_CONSTEXPR Matrix4f( float m00, float m01, float m02, float m03,
 		float m10, float m11, float m12, float m13,
 		float m20, float m21, float m22, float m23,
 		float m30, float m31, float m32, float m33 );
@@ -25,20 +38,20 @@ public:
 	// otherwise, sets the rows
 	Matrix4f( const Vector4f& v0, const Vector4f& v1, const Vector4f& v2, const Vector4f& v3, bool setColumns = true );
 	
-	Matrix4f( const Matrix4f& rm ); // copy constructor
-	Matrix4f& operator = ( const Matrix4f& rm ); // assignment operator
-	Matrix4f& operator/=(float d);
+	MATRIX4F_INLINE Matrix4f( const Matrix4f& rm ); // copy constructor
+	MATRIX4F_INLINE Matrix4f& operator = ( const Matrix4f& rm ); // assignment operator
+	MATRIX4F_INLINE Matrix4f& operator/=(float d);
 	// no destructor necessary
 
-	const float& operator () ( int i, int j ) const;
-	float& operator () ( int i, int j );
+	MATRIX4F_CONSTEXPR const float& operator () ( int i, int j ) const;
+	MATRIX4F_INLINE float& operator () ( int i, int j );
 
-	Vector4f getRow( int i ) const;
-	void setRow( int i, const Vector4f& v );
+	MATRIX4F_CONSTEXPR Vector4f getRow( int i ) const;
+	MATRIX4F_INLINE void setRow( int i, const Vector4f& v );
 
 	// get column j (mod 4)
-	Vector4f getCol( int j ) const;
-	void setCol( int j, const Vector4f& v );
+	MATRIX4F_INLINE Vector4f getCol( int j ) const;
+	MATRIX4F_INLINE void setCol( int j, const Vector4f& v );
 
 	// gets the 2x2 submatrix of this matrix to m
 	// starting with upper left corner at (i0, j0)
@@ -63,8 +76,8 @@ public:
 	Matrix4f transposed() const;
 
 	// ---- Utility ----
-	operator float* (); // automatic type conversion for GL
-	operator const float* () const; // automatic type conversion for GL
+	MATRIX4F_INLINE operator float* (); // automatic type conversion for GL
+	MATRIX4F_INLINE operator const float* () const; // automatic type conversion for GL
 	
 	void print();
 
@@ -101,9 +114,152 @@ private:
 
 // Matrix-Vector multiplication
 // 4x4 * 4x1 ==> 4x1
-Vector4f operator * ( const Matrix4f& m, const Vector4f& v );
+MATRIX4F_INLINE Vector4f operator * ( const Matrix4f& m, const Vector4f& v );
 
 // Matrix-Matrix multiplication
-Matrix4f operator * ( const Matrix4f& x, const Matrix4f& y );
+MATRIX4F_INLINE Matrix4f operator * ( const Matrix4f& x, const Matrix4f& y );
+
+//////////////////////////////////////////////////////////////////////////
+// Inline definitions
+//////////////////////////////////////////////////////////////////////////
+
+MATRIX4F_INLINE Matrix4f::Matrix4f( float fill )
+{
+	for( int i = 0; i < 16; ++i )
+	{
+		m_elements[ i ] = fill;
+	}
+}
+
+MATRIX4F_CONSTEXPR Matrix4f::Matrix4f( float m00, float m01, float m02, float m03,
+				   float m10, float m11, float m12, float m13,
+				   float m20, float m21, float m22, float m23,
+				   float m30, float m31, float m32, float m33 ) :
+	m_elements{ m00, m10, m20, m30,
+				m01, m11, m21, m31,
+				m02, m12, m22, m32,
+				m03, m13, m23, m33 }
+{
+}
+
+MATRIX4F_INLINE Matrix4f& Matrix4f::operator/=(float d)
+{
+	for(int ii=0;ii<16;ii++){
+		m_elements[ii]/=d;
+	}
+	return *this;
+}
+
+MATRIX4F_INLINE Matrix4f::Matrix4f( const Matrix4f& rm )
+{
+	memcpy( m_elements, rm.m_elements, sizeof(m_elements) );
+}
+
+MATRIX4F_INLINE Matrix4f& Matrix4f::operator = ( const Matrix4f& rm )
+{
+	if( this != &rm )
+	{
+		memcpy( m_elements, rm.m_elements, sizeof(m_elements)  );
+	}
+	return *this;
+}
+
+MATRIX4F_CONSTEXPR const float& Matrix4f::operator () ( int i, int j ) const
+{
+	return m_elements[ j * 4 + i ];
+}
+
+MATRIX4F_INLINE float& Matrix4f::operator () ( int i, int j )
+{
+	return m_elements[ j * 4 + i ];
+}
+
+MATRIX4F_CONSTEXPR Vector4f Matrix4f::getRow( int i ) const
+{
+	return Vector4f
+	(
+		m_elements[ i ],
+		m_elements[ i + 4 ],
+		m_elements[ i + 8 ],
+		m_elements[ i + 12 ]
+	);
+}
+
+MATRIX4F_INLINE void Matrix4f::setRow( int i, const Vector4f& v )
+{
+	m_elements[ i ] = v.x();
+	m_elements[ i + 4 ] = v.y();
+	m_elements[ i + 8 ] = v.z();
+	m_elements[ i + 12 ] = v.w();
+}
+
+MATRIX4F_INLINE Vector4f Matrix4f::getCol( int j ) const
+{
+	int colStart = 4 * j;
+
+	return Vector4f
+	(
+		m_elements[ colStart ],
+		m_elements[ colStart + 1 ],
+		m_elements[ colStart + 2 ],
+		m_elements[ colStart + 3 ]
+	);
+}
+
+MATRIX4F_INLINE void Matrix4f::setCol( int j, const Vector4f& v )
+{
+	int colStart = 4 * j;
+
+	m_elements[ colStart ] = v.x();
+	m_elements[ colStart + 1 ] = v.y();
+	m_elements[ colStart + 2 ] = v.z();
+	m_elements[ colStart + 3 ] = v.w();
+}
+
+MATRIX4F_INLINE Matrix4f::operator float* ()
+{
+	return m_elements;
+}
+
+MATRIX4F_INLINE Matrix4f::operator const float* ()const
+{
+	return m_elements;
+}
+
+MATRIX4F_INLINE Vector4f operator * ( const Matrix4f& m, const Vector4f& v )
+{
+	Vector4f output( 0, 0, 0, 0 );
+
+	for( int i = 0; i < 4; ++i )
+	{
+		for( int j = 0; j < 4; ++j )
+		{
+			output[ i ] += m( i, j ) * v[ j ];
+		}
+	}
+
+	return output;
+}
+
+MATRIX4F_INLINE Matrix4f operator * ( const Matrix4f& x, const Matrix4f& y )
+{
+	Matrix4f product; // zeroes
+
+	for( int i = 0; i < 4; ++i )
+	{
+		for( int j = 0; j < 4; ++j )
+		{
+			for( int k = 0; k < 4; ++k )
+			{
+				product( i, k ) += x( i, j ) * y( j, k );
+			}
+		}
+	}
+
+	return product;
+}
+
+#undef MATRIX4F_INLINE
+#undef MATRIX4F_CONSTEXPR
 
 #endif // MATRIX4F_H
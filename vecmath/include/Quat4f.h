@@ -1,6 +1,20 @@
 #ifndef QUAT4F_H
 #define QUAT4F_H
 
+#include <cmath>
+
+// The arithmetic, accessors and constructors are defined inline at the
+// end of this header, constexpr where C++11 allows. Quat4f.cpp defines
+// QUAT4F_OUT_OF_LINE so that they are also compiled into the library
+// as ordinary functions, keeping its symbols.
+#ifdef QUAT4F_OUT_OF_LINE
+#define QUAT4F_INLINE
+#define QUAT4F_CONSTEXPR
+#else
+#define QUAT4F_INLINE inline
+#define QUAT4F_CONSTEXPR constexpr
+#endif
+
 class Vector3f;
 class Vector4f;
 
@@ -13,13 +27,13 @@ public:
 	static const Quat4f ZERO;
 	static const Quat4f IDENTITY;
 
-	Quat4f();
+	QUAT4F_CONSTEXPR Quat4f();
 
 	// q = w + x * i + y * j + z * k
-	Quat4f( float w, float x, float y, float z );
+	QUAT4F_CONSTEXPR Quat4f( float w, float x, float y, float z );
 		
-	Quat4f( const Quat4f& rq ); // copy constructor
-	Quat4f& operator = ( const Quat4f& rq ); // assignment operator
+	QUAT4F_CONSTEXPR Quat4f( const Quat4f& rq ); // copy constructor
+	QUAT4F_INLINE Quat4f& operator = ( const Quat4f& rq ); // assignment operator
 	// no destructor necessary
 
 	// returns a quaternion with 0 real part
@@ -29,26 +43,26 @@ public:
 	Quat4f( const Vector4f& v );
 
 	// returns the ith element
-	const float& operator [] ( int i ) const;
-	float& operator [] ( int i );
+	QUAT4F_CONSTEXPR const float& operator [] ( int i ) const;
+	QUAT4F_INLINE float& operator [] ( int i );
 
-	float w() const;
-	float x() const;
-	float y() const;
-	float z() const;
+	QUAT4F_CONSTEXPR float w() const;
+	QUAT4F_CONSTEXPR float x() const;
+	QUAT4F_CONSTEXPR float y() const;
+	QUAT4F_CONSTEXPR float z() const;
 	Vector3f xyz() const;
 	Vector4f wxyz() const;
 
-	float abs() const;
-	float absSquared() const;
-	void normalize();
-	Quat4f normalized() const;
+	QUAT4F_INLINE float abs() const;
+	QUAT4F_CONSTEXPR float absSquared() const;
+	QUAT4F_INLINE void normalize();
+	QUAT4F_INLINE Quat4f normalized() const;
 
-	void conjugate();
-	Quat4f conjugated() const;
+	QUAT4F_INLINE void conjugate();
+	QUAT4F_CONSTEXPR Quat4f conjugated() const;
 
-	void invert();
-	Quat4f inverse() const;
+	QUAT4F_INLINE void invert();
+	QUAT4F_CONSTEXPR Quat4f inverse() const;
 
 	// log and exponential maps
 	Quat4f log() const;
@@ -64,10 +78,10 @@ public:
 	void print();
  
 	 // quaternion dot product (a la vector)
-	static float dot( const Quat4f& q0, const Quat4f& q1 );	
+	static QUAT4F_CONSTEXPR float dot( const Quat4f& q0, const Quat4f& q1 );
 	
 	// linear (stupid) interpolation
-	static Quat4f lerp( const Quat4f& q0, const Quat4f& q1, float alpha );
+	static QUAT4F_INLINE Quat4f lerp( const Quat4f& q0, const Quat4f& q1, float alpha );
 
 	// spherical linear interpolation
 	static Quat4f slerp( const Quat4f& a, const Quat4f& b, float t, bool allowFlip = true );
@@ -101,10 +115,213 @@ private:
 
 };
 
-Quat4f operator + ( const Quat4f& q0, const Quat4f& q1 );
-Quat4f operator - ( const Quat4f& q0, const Quat4f& q1 );
-Quat4f operator * ( const Quat4f& q0, const Quat4f& q1 );
-Quat4f operator * ( float f, const Quat4f& q );
-Quat4f operator * ( const Quat4f& q, float f );
+QUAT4F_CONSTEXPR Quat4f operator + ( const Quat4f& q0, const Quat4f& q1 );
+QUAT4F_CONSTEXPR Quat4f operator - ( const Quat4f& q0, const Quat4f& q1 );
+QUAT4F_CONSTEXPR Quat4f operator * ( const Quat4f& q0, const Quat4f& q1 );
+QUAT4F_CONSTEXPR Quat4f operator * ( float f, const Quat4f& q );
+QUAT4F_CONSTEXPR Quat4f operator * ( const Quat4f& q, float f );
+
+//////////////////////////////////////////////////////////////////////////
+// Inline definitions
+//////////////////////////////////////////////////////////////////////////
+
+QUAT4F_CONSTEXPR Quat4f::Quat4f() :
+	m_elements{ 0, 0, 0, 0 }
+{
+}
+
+QUAT4F_CONSTEXPR Quat4f::Quat4f( float w, float x, float y, float z ) :
+	m_elements{ w, x, y, z }
+{
+}
+
+QUAT4F_CONSTEXPR Quat4f::Quat4f( const Quat4f& rq ) :
+	m_elements{ rq.m_elements[ 0 ], rq.m_elements[ 1 ], rq.m_elements[ 2 ], rq.m_elements[ 3 ] }
+{
+}
+
+QUAT4F_INLINE Quat4f& Quat4f::operator = ( const Quat4f& rq )
+{
+	if( this != ( &rq ) )
+	{
+		m_elements[ 0 ] = rq.m_elements[ 0 ];
+		m_elements[ 1 ] = rq.m_elements[ 1 ];
+		m_elements[ 2 ] = rq.m_elements[ 2 ];
+		m_elements[ 3 ] = rq.m_elements[ 3 ];
+	}
+    return( *this );
+}
+
+QUAT4F_CONSTEXPR const float& Quat4f::operator [] ( int i ) const
+{
+	return m_elements[ i ];
+}
+
+QUAT4F_INLINE float& Quat4f::operator [] ( int i )
+{
+	return m_elements[ i ];
+}
+
+QUAT4F_CONSTEXPR float Quat4f::w() const
+{
+	return m_elements[ 0 ];
+}
+
+QUAT4F_CONSTEXPR float Quat4f::x() const
+{
+	return m_elements[ 1 ];
+}
+
+QUAT4F_CONSTEXPR float Quat4f::y() const
+{
+	return m_elements[ 2 ];
+}
+
+QUAT4F_CONSTEXPR float Quat4f::z() const
+{
+	return m_elements[ 3 ];
+}
+
+QUAT4F_INLINE float Quat4f::abs() const
+{
+	return std::sqrt( absSquared() );	
+}
+
+QUAT4F_CONSTEXPR float Quat4f::absSquared() const
+{
+	return
+	(
+		m_elements[ 0 ] * m_elements[ 0 ] +
+		m_elements[ 1 ] * m_elements[ 1 ] +
+		m_elements[ 2 ] * m_elements[ 2 ] +
+		m_elements[ 3 ] * m_elements[ 3 ]
+	);
+}
+
+QUAT4F_INLINE void Quat4f::normalize()
+{
+	float reciprocalAbs = 1.f / abs();
+
+	m_elements[ 0 ] *= reciprocalAbs;
+	m_elements[ 1 ] *= reciprocalAbs;
+	m_elements[ 2 ] *= reciprocalAbs;
+	m_elements[ 3 ] *= reciprocalAbs;
+}
+
+QUAT4F_INLINE Quat4f Quat4f::normalized() const
+{
+	Quat4f q( *this );
+	q.normalize();
+	return q;
+}
+
+QUAT4F_INLINE void Quat4f::conjugate()
+{
+	m_elements[ 1 ] = -m_elements[ 1 ];
+	m_elements[ 2 ] = -m_elements[ 2 ];
+	m_elements[ 3 ] = -m_elements[ 3 ];
+}
+
+QUAT4F_CONSTEXPR Quat4f Quat4f::conjugated() const
+{
+	return Quat4f
+	(
+		 m_elements[ 0 ],
+		-m_elements[ 1 ],
+		-m_elements[ 2 ],
+		-m_elements[ 3 ]
+	);
+}
+
+QUAT4F_INLINE void Quat4f::invert()
+{
+	Quat4f inverse = conjugated() * ( 1.0f / absSquared() );
+
+	m_elements[ 0 ] = inverse.m_elements[ 0 ];
+	m_elements[ 1 ] = inverse.m_elements[ 1 ];
+	m_elements[ 2 ] = inverse.m_elements[ 2 ];
+	m_elements[ 3 ] = inverse.m_elements[ 3 ];
+}
+
+QUAT4F_CONSTEXPR Quat4f Quat4f::inverse() const
+{
+	return conjugated() * ( 1.0f / absSquared() );
+}
+
+// static
+QUAT4F_CONSTEXPR float Quat4f::dot( const Quat4f& q0, const Quat4f& q1 )
+{
+	return
+	(
+		q0.w() * q1.w() +
+		q0.x() * q1.x() +
+		q0.y() * q1.y() +
+		q0.z() * q1.z()
+	);
+}
+
+// static
+QUAT4F_INLINE Quat4f Quat4f::lerp( const Quat4f& q0, const Quat4f& q1, float alpha )
+{
+	return( ( q0 + alpha * ( q1 - q0 ) ).normalized() );
+}
+
+QUAT4F_CONSTEXPR Quat4f operator + ( const Quat4f& q0, const Quat4f& q1 )
+{
+	return Quat4f
+	(
+		q0.w() + q1.w(),
+		q0.x() + q1.x(),
+		q0.y() + q1.y(),
+		q0.z() + q1.z()
+	);
+}
+
+QUAT4F_CONSTEXPR Quat4f operator - ( const Quat4f& q0, const Quat4f& q1 )
+{
+	return Quat4f
+	(
+		q0.w() - q1.w(),
+		q0.x() - q1.x(),
+		q0.y() - q1.y(),
+		q0.z() - q1.z()
+	);
+}
+
+QUAT4F_CONSTEXPR Quat4f operator * ( const Quat4f& q0, const Quat4f& q1 )
+{
+	return Quat4f
+	(
+		q0.w() * q1.w() - q0.x() * q1.x() - q0.y() * q1.y() - q0.z() * q1.z(),
+		q0.w() * q1.x() + q0.x() * q1.w() + q0.y() * q1.z() - q0.z() * q1.y(),
+		q0.w() * q1.y() - q0.x() * q1.z() + q0.y() * q1.w() + q0.z() * q1.x(),
+		q0.w() * q1.z() + q0.x() * q1.y() - q0.y() * q1.x() + q0.z() * q1.w()
+	);
+}
+
+QUAT4F_CONSTEXPR Quat4f operator * ( float f, const Quat4f& q )
+{
+	return Quat4f
+	(
+		f * q.w(),
+		f * q.x(),
+		f * q.y(),
+		f * q.z()
+	);
+}
+
+QUAT4F_CONSTEXPR Quat4f operator * ( const Quat4f& q, float f )
+{
+	return Quat4f
+	(
+		f * q.w(),
+		f * q.x(),
+		f * q.y(),
+		f * q.z()
+	);
+}
+
+#undef QUAT4F_INLINE
+#undef QUAT4F_CONSTEXPR
 
 #endif // QUAT4F_H
@@ -3,6 +3,17 @@
 
 #include <cmath>
 
+// As in Vector3f.h, the small operations are defined inline (constexpr
+// where C++11 allows) at the end of this header; Vector2f.cpp defines
+// VECTOR2F_OUT_OF_LINE to keep compiling them into the library.
+#ifdef VECTOR2F_OUT_OF_LINE
+#define VECTOR2F_INLINE
+#define VECTOR2F_CONSTEXPR
+#else
+#define VECTOR2F_INLINE inline
+#define VECTOR2F_CONSTEXPR constexpr
+#endif
+
 class Vector3f;
 
 class Vector2f
@@ -13,57 +24,57 @@ public:
 	static const Vector2f UP;
 	static const Vector2f RIGHT;
 
-    explicit Vector2f( float f = 0.f );
-    Vector2f( float x, float y );
+    explicit VECTOR2F_CONSTEXPR Vector2f( float f = 0.f );
+    VECTOR2F_CONSTEXPR Vector2f( float x, float y );
 
 	// copy constructors
-    Vector2f( const Vector2f& rv );
+    VECTOR2F_CONSTEXPR Vector2f( const Vector2f& rv );
 
 	// assignment operators
-	Vector2f& operator = ( const Vector2f& rv );
+	VECTOR2F_INLINE Vector2f& operator = ( const Vector2f& rv );
 
 	// no destructor necessary
 
 	// returns the ith element
-    const float& operator [] ( int i ) const;
-	float& operator [] ( int i );
+    VECTOR2F_CONSTEXPR const float& operator [] ( int i ) const;
+	VECTOR2F_INLINE float& operator [] ( int i );
 
-    float& x();
-	float& y();
+    VECTOR2F_INLINE float& x();
+	VECTOR2F_INLINE float& y();
 
-	float x() const;
-	float y() const;
+	VECTOR2F_CONSTEXPR float x() const;
+	VECTOR2F_CONSTEXPR float y() const;
 
-    Vector2f xy() const;
-	Vector2f yx() const;
-	Vector2f xx() const;
-	Vector2f yy() const;
+    VECTOR2F_CONSTEXPR Vector2f xy() const;
+	VECTOR2F_CONSTEXPR Vector2f yx() const;
+	VECTOR2F_CONSTEXPR Vector2f xx() const;
+	VECTOR2F_CONSTEXPR Vector2f yy() const;
 
 	// returns ( -y, x )
-    Vector2f normal() const;
+    VECTOR2F_CONSTEXPR Vector2f normal() const;
 
-    float abs() const;
-    float absSquared() const;
-    void normalize();
-    Vector2f normalized() const;
+    VECTOR2F_INLINE float abs() const;
+    VECTOR2F_CONSTEXPR float absSquared() const;
+    VECTOR2F_INLINE void normalize();
+    VECTOR2F_INLINE Vector2f normalized() const;
 
-    void negate();
+    VECTOR2F_INLINE void negate();
 
 	// ---- Utility ----
-    operator const float* () const; // automatic type conversion for OpenGL 
-    operator float* (); // automatic type conversion for OpenGL 
+    VECTOR2F_INLINE operator const float* () const; // automatic type conversion for OpenGL
+    VECTOR2F_INLINE operator float* (); // automatic type conversion for OpenGL
 	void print() const;
 
-	Vector2f& operator += ( const Vector2f& v );
-	Vector2f& operator -= ( const Vector2f& v );
-	Vector2f& operator *= ( float f );
+	VECTOR2F_INLINE Vector2f& operator += ( const Vector2f& v );
+	VECTOR2F_INLINE Vector2f& operator -= ( const Vector2f& v );
+	VECTOR2F_INLINE Vector2f& operator *= ( float f );
 
-    static float dot( const Vector2f& v0, const Vector2f& v1 );
+    static VECTOR2F_CONSTEXPR float dot( const Vector2f& v0, const Vector2f& v1 );
 
 	static Vector3f cross( const Vector2f& v0, const Vector2f& v1 );
 
 	// returns v0 * ( 1 - alpha ) * v1 * alpha
-	static Vector2f lerp( const Vector2f& v0, const Vector2f& v1, float alpha );
+	static VECTOR2F_CONSTEXPR Vector2f lerp( const Vector2f& v0, const Vector2f& v1, float alpha );
 
 private:
 
@@ -72,20 +83,229 @@ private:
 };
 
 // component-wise operators
-Vector2f operator + ( const Vector2f& v0, const Vector2f& v1 );
-Vector2f operator - ( const Vector2f& v0, const Vector2f& v1 );
-Vector2f operator * ( const Vector2f& v0, const Vector2f& v1 );
-Vector2f operator / ( const Vector2f& v0, const Vector2f& v1 );
+VECTOR2F_CONSTEXPR Vector2f operator + ( const Vector2f& v0, const Vector2f& v1 );
+VECTOR2F_CONSTEXPR Vector2f operator - ( const Vector2f& v0, const Vector2f& v1 );
+VECTOR2F_CONSTEXPR Vector2f operator * ( const Vector2f& v0, const Vector2f& v1 );
+VECTOR2F_CONSTEXPR Vector2f operator / ( const Vector2f& v0, const Vector2f& v1 );
 
 // unary negation
-Vector2f operator - ( const Vector2f& v );
+VECTOR2F_CONSTEXPR Vector2f operator - ( const Vector2f& v );
 
 // multiply and divide by scalar
-Vector2f operator * ( float f, const Vector2f& v );
-Vector2f operator * ( const Vector2f& v, float f );
-Vector2f operator / ( const Vector2f& v, float f );
+VECTOR2F_CONSTEXPR Vector2f operator * ( float f, const Vector2f& v );
+VECTOR2F_CONSTEXPR Vector2f operator * ( const Vector2f& v, float f );
+VECTOR2F_CONSTEXPR Vector2f operator / ( const Vector2f& v, float f );
+
+VECTOR2F_CONSTEXPR bool operator == ( const Vector2f& v0, const Vector2f& v1 );
+VECTOR2F_CONSTEXPR bool operator != ( const Vector2f& v0, const Vector2f& v1 );
+
+//////////////////////////////////////////////////////////////////////////
+// Inline definitions
+//////////////////////////////////////////////////////////////////////////
+
+VECTOR2F_CONSTEXPR Vector2f::Vector2f( float f ) :
+    m_elements{ f, f }
+{
+}
+
+VECTOR2F_CONSTEXPR Vector2f::Vector2f( float x, float y ) :
+    m_elements{ x, y }
+{
+}
+
+VECTOR2F_CONSTEXPR Vector2f::Vector2f( const Vector2f& rv ) :
+    m_elements{ rv.m_elements[0], rv.m_elements[1] }
+{
+}
+
+VECTOR2F_INLINE Vector2f& Vector2f::operator = ( const Vector2f& rv )
+{
+ 	if( this != &rv )
+	{
+        m_elements[0] = rv[0];
+        m_elements[1] = rv[1];
+    }
+    return *this;
+}
+
+VECTOR2F_CONSTEXPR const float& Vector2f::operator [] ( int i ) const
+{
+    return m_elements[i];
+}
+
+VECTOR2F_INLINE float& Vector2f::operator [] ( int i )
+{
+    return m_elements[i];
+}
+
+VECTOR2F_INLINE float& Vector2f::x()
+{
+    return m_elements[0];
+}
+
+VECTOR2F_INLINE float& Vector2f::y()
+{
+    return m_elements[1];
+}
+
+VECTOR2F_CONSTEXPR float Vector2f::x() const
+{
+    return m_elements[0];
+}	
+
+VECTOR2F_CONSTEXPR float Vector2f::y() const
+{
+    return m_elements[1];
+}
+
+VECTOR2F_CONSTEXPR Vector2f Vector2f::xy() const
+{
+    return *this;
+}
+
+VECTOR2F_CONSTEXPR Vector2f Vector2f::yx() const
+{
+    return Vector2f( m_elements[1], m_elements[0] );
+}
+
+VECTOR2F_CONSTEXPR Vector2f Vector2f::xx() const
+{
+    return Vector2f( m_elements[0], m_elements[0] );
+}
+
+VECTOR2F_CONSTEXPR Vector2f Vector2f::yy() const
+{
+    return Vector2f( m_elements[1], m_elements[1] );
+}
+
+VECTOR2F_CONSTEXPR Vector2f Vector2f::normal() const
+{
+    return Vector2f( -m_elements[1], m_elements[0] );
+}
+
+VECTOR2F_INLINE float Vector2f::abs() const
+{
+    return std::sqrt(absSquared());
+}
+
+VECTOR2F_CONSTEXPR float Vector2f::absSquared() const
+{
+    return m_elements[0] * m_elements[0] + m_elements[1] * m_elements[1];
+}
+
+VECTOR2F_INLINE void Vector2f::normalize()
+{
+    float norm = abs();
+    m_elements[0] /= norm;
+    m_elements[1] /= norm;
+}
+
+VECTOR2F_INLINE Vector2f Vector2f::normalized() const
+{
+    float norm = abs();
+    return Vector2f( m_elements[0] / norm, m_elements[1] / norm );
+}
+
+VECTOR2F_INLINE void Vector2f::negate()
+{
+    m_elements[0] = -m_elements[0];
+    m_elements[1] = -m_elements[1];
+}
+
+VECTOR2F_INLINE Vector2f::operator const float* () const
+{
+    return m_elements;
+}
+
+VECTOR2F_INLINE Vector2f::operator float* ()
+{
+    return m_elements;
+}
+
+VECTOR2F_INLINE Vector2f& Vector2f::operator += ( const Vector2f& v )
+{
+	m_elements[ 0 ] += v.m_elements[ 0 ];
+	m_elements[ 1 ] += v.m_elements[ 1 ];
+	return *this;
+}
+
+VECTOR2F_INLINE Vector2f& Vector2f::operator -= ( const Vector2f& v )
+{
+	m_elements[ 0 ] -= v.m_elements[ 0 ];
+	m_elements[ 1 ] -= v.m_elements[ 1 ];
+	return *this;
+}
+
+VECTOR2F_INLINE Vector2f& Vector2f::operator *= ( float f )
+{
+	m_elements[ 0 ] *= f;
+	m_elements[ 1 ] *= f;
+	return *this;
+}
+
+// static
+VECTOR2F_CONSTEXPR float Vector2f::dot( const Vector2f& v0, const Vector2f& v1 )
+{
+    return v0[0] * v1[0] + v0[1] * v1[1];
+}
+
+// static
+VECTOR2F_CONSTEXPR Vector2f Vector2f::lerp( const Vector2f& v0, const Vector2f& v1, float alpha )
+{
+	return alpha * ( v1 - v0 ) + v0;
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator + ( const Vector2f& v0, const Vector2f& v1 )
+{
+    return Vector2f( v0.x() + v1.x(), v0.y() + v1.y() );
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator - ( const Vector2f& v0, const Vector2f& v1 )
+{
+    return Vector2f( v0.x() - v1.x(), v0.y() - v1.y() );
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator * ( const Vector2f& v0, const Vector2f& v1 )
+{
+    return Vector2f( v0.x() * v1.x(), v0.y() * v1.y() );
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator / ( const Vector2f& v0, const Vector2f& v1 )
+{
+    return Vector2f( v0.x() * v1.x(), v0.y() * v1.y() );
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator - ( const Vector2f& v )
+{
+    return Vector2f( -v.x(), -v.y() );
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator * ( float f, const Vector2f& v )
+{
+    return Vector2f( f * v.x(), f * v.y() );
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator * ( const Vector2f& v, float f )
+{
+    return Vector2f( f * v.x(), f * v.y() );
+}
+
+VECTOR2F_CONSTEXPR Vector2f operator / ( const Vector2f& v, float f )
+{
+    return Vector2f( v.x() / f, v.y() / f );
+}
+
+VECTOR2F_CONSTEXPR bool operator == ( const Vector2f& v0, const Vector2f& v1 )
+{
+    return( v0.x() == v1.x() && v0.y() == v1.y() );
+}
+
+VECTOR2F_CONSTEXPR bool operator != ( const Vector2f& v0, const Vector2f& v1 )
+{
+    return !( v0 == v1 );
+}
 
-bool operator == ( const Vector2f& v0, const Vector2f& v1 );
-bool operator != ( const Vector2f& v0, const Vector2f& v1 );
+#undef VECTOR2F_INLINE
+#undef VECTOR2F_CONSTEXPR
 
 #endif // VECTOR_2F_H
@@ -1,6 +1,23 @@
 #ifndef VECTOR_3F_H
 #define VECTOR_3F_H
 
+#include <cmath>
+
+// The small operations are defined inline at the end of this header, so
+// that they inline into the loops that use them, and are constexpr where
+// C++11 allows. Vector3f.cpp defines VECTOR3F_OUT_OF_LINE before
+// including it, which compiles the same definitions there as ordinary
+// functions: the library still exports every symbol it did when they
+// were all out of line, and the copy constructor stays user-provided,
+// so Vector3f is passed and returned exactly as before.
+#ifdef VECTOR3F_OUT_OF_LINE
+#define VECTOR3F_INLINE
+#define VECTOR3F_CONSTEXPR
+#else
+#define VECTOR3F_INLINE inline
+#define VECTOR3F_CONSTEXPR constexpr
+#endif
+
 class Vector2f;
 
 class Vector3f
@@ -12,66 +29,66 @@ public:
 	static const Vector3f RIGHT;
 	static const Vector3f FORWARD;
 
-    explicit Vector3f( float f = 0.f );
-    Vector3f( float x, float y, float z );
+    explicit VECTOR3F_CONSTEXPR Vector3f( float f = 0.f );
+    VECTOR3F_CONSTEXPR Vector3f( float x, float y, float z );
 
 	Vector3f( const Vector2f& xy, float z );
 	Vector3f( float x, const Vector2f& yz );
 
 	// copy constructors
-    Vector3f( const Vector3f& rv );
+    VECTOR3F_CONSTEXPR Vector3f( const Vector3f& rv );
 
 	// assignment operators
-    Vector3f& operator = ( const Vector3f& rv );
+    VECTOR3F_INLINE Vector3f& operator = ( const Vector3f& rv );
 
 	// no destructor necessary
 
 	// returns the ith element
-    const float& operator [] ( int i ) const;
-    float& operator [] ( int i );
+    VECTOR3F_CONSTEXPR const float& operator [] ( int i ) const;
+    VECTOR3F_INLINE float& operator [] ( int i );
 
-    float& x();
-	float& y();
-	float& z();
+    VECTOR3F_INLINE float& x();
+	VECTOR3F_INLINE float& y();
+	VECTOR3F_INLINE float& z();
 
-	float x() const;
-	float y() const;
-	float z() const;
+	VECTOR3F_CONSTEXPR float x() const;
+	VECTOR3F_CONSTEXPR float y() const;
+	VECTOR3F_CONSTEXPR float z() const;
 
 	Vector2f xy() const;
 	Vector2f xz() const;
 	Vector2f yz() const;
 
-	Vector3f xyz() const;
-	Vector3f yzx() const;
-	Vector3f zxy() const;
+	VECTOR3F_CONSTEXPR Vector3f xyz() const;
+	VECTOR3F_CONSTEXPR Vector3f yzx() const;
+	VECTOR3F_CONSTEXPR Vector3f zxy() const;
 
-	float abs() const;
-    float absSquared() const;
+	VECTOR3F_INLINE float abs() const;
+    VECTOR3F_CONSTEXPR float absSquared() const;
 
-	void normalize();
-	Vector3f normalized() const;
+	VECTOR3F_INLINE void normalize();
+	VECTOR3F_INLINE Vector3f normalized() const;
 
 	Vector2f homogenized() const;
 
-	void negate();
+	VECTOR3F_INLINE void negate();
 
 	// ---- Utility ----
-    operator const float* () const; // automatic type conversion for OpenGL
-    operator float* (); // automatic type conversion for OpenGL 
+    VECTOR3F_INLINE operator const float* () const; // automatic type conversion for OpenGL
+    VECTOR3F_INLINE operator float* (); // automatic type conversion for OpenGL
 	void print() const;	
 
-	Vector3f& operator += ( const Vector3f& v );
-	Vector3f& operator -= ( const Vector3f& v );
-  Vector3f& operator *= ( float f );
-  Vector3f& operator /= (float f );
+	VECTOR3F_INLINE Vector3f& operator += ( const Vector3f& v );
+	VECTOR3F_INLINE Vector3f& operator -= ( const Vector3f& v );
+  VECTOR3F_INLINE Vector3f& operator *= ( float f );
+  VECTOR3F_INLINE Vector3f& operator /= (float f );
 
-  static float dot( const Vector3f& v0, const Vector3f& v1 );
-	static Vector3f cross( const Vector3f& v0, const Vector3f& v1 );
+  static VECTOR3F_CONSTEXPR float dot( const Vector3f& v0, const Vector3f& v1 );
+	static VECTOR3F_CONSTEXPR Vector3f cross( const Vector3f& v0, const Vector3f& v1 );
     
     // computes the linear interpolation between v0 and v1 by alpha \in [0,1]
 	// returns v0 * ( 1 - alpha ) * v1 * alpha
-	static Vector3f lerp( const Vector3f& v0, const Vector3f& v1, float alpha );
+	static VECTOR3F_CONSTEXPR Vector3f lerp( const Vector3f& v0, const Vector3f& v1, float alpha );
 
 	// computes the cubic catmull-rom interpolation between p0, p1, p2, p3
     // by t \in [0,1].  Guarantees that at t = 0, the result is p0 and
@@ -85,21 +102,265 @@ private:
 };
 
 // component-wise operators
-Vector3f operator + ( const Vector3f& v0, const Vector3f& v1 );
-Vector3f operator - ( const Vector3f& v0, const Vector3f& v1 );
-Vector3f operator * ( const Vector3f& v0, const Vector3f& v1 );
-Vector3f operator / ( const Vector3f& v0, const Vector3f& v1 );
+VECTOR3F_CONSTEXPR Vector3f operator + ( const Vector3f& v0, const Vector3f& v1 );
+VECTOR3F_CONSTEXPR Vector3f operator - ( const Vector3f& v0, const Vector3f& v1 );
+VECTOR3F_CONSTEXPR Vector3f operator * ( const Vector3f& v0, const Vector3f& v1 );
+VECTOR3F_CONSTEXPR Vector3f operator / ( const Vector3f& v0, const Vector3f& v1 );
 
 // unary negation
-Vector3f operator - ( const Vector3f& v );
+VECTOR3F_CONSTEXPR Vector3f operator - ( const Vector3f& v );
 
 // multiply and divide by scalar
-Vector3f operator * ( float f, const Vector3f& v );
-Vector3f operator * ( const Vector3f& v, float f );
-Vector3f operator / ( const Vector3f& v, float f );
+VECTOR3F_CONSTEXPR Vector3f operator * ( float f, const Vector3f& v );
+VECTOR3F_CONSTEXPR Vector3f operator * ( const Vector3f& v, float f );
+VECTOR3F_CONSTEXPR Vector3f operator / ( const Vector3f& v, float f );
+
+
+VECTOR3F_CONSTEXPR bool operator == ( const Vector3f& v0, const Vector3f& v1 );
+VECTOR3F_CONSTEXPR bool operator != ( const Vector3f& v0, const Vector3f& v1 );
+
+//////////////////////////////////////////////////////////////////////////
+// Inline definitions
+//////////////////////////////////////////////////////////////////////////
+
+VECTOR3F_CONSTEXPR Vector3f::Vector3f( float f ) :
+    m_elements{ f, f, f }
+{
+}
+
+VECTOR3F_CONSTEXPR Vector3f::Vector3f( float x, float y, float z ) :
+    m_elements{ x, y, z }
+{
+}
+
+VECTOR3F_CONSTEXPR Vector3f::Vector3f( const Vector3f& rv ) :
+    m_elements{ rv.m_elements[0], rv.m_elements[1], rv.m_elements[2] }
+{
+}
+
+VECTOR3F_INLINE Vector3f& Vector3f::operator = ( const Vector3f& rv )
+{
+    if( this != &rv )
+    {
+        m_elements[0] = rv[0];
+        m_elements[1] = rv[1];
+        m_elements[2] = rv[2];
+    }
+    return *this;
+}
+
+VECTOR3F_CONSTEXPR const float& Vector3f::operator [] ( int i ) const
+{
+    return m_elements[i];
+}
+
+VECTOR3F_INLINE float& Vector3f::operator [] ( int i )
+{
+    return m_elements[i];
+}
+
+VECTOR3F_INLINE float& Vector3f::x()
+{
+    return m_elements[0];
+}
+
+VECTOR3F_INLINE float& Vector3f::y()
+{
+    return m_elements[1];
+}
+
+VECTOR3F_INLINE float& Vector3f::z()
+{
+    return m_elements[2];
+}
+
+VECTOR3F_CONSTEXPR float Vector3f::x() const
+{
+    return m_elements[0];
+}
+
+VECTOR3F_CONSTEXPR float Vector3f::y() const
+{
+    return m_elements[1];
+}
+
+VECTOR3F_CONSTEXPR float Vector3f::z() const
+{
+    return m_elements[2];
+}
+
+VECTOR3F_CONSTEXPR Vector3f Vector3f::xyz() const
+{
+	return Vector3f( m_elements[0], m_elements[1], m_elements[2] );
+}
+
+VECTOR3F_CONSTEXPR Vector3f Vector3f::yzx() const
+{
+	return Vector3f( m_elements[1], m_elements[2], m_elements[0] );
+}
+
+VECTOR3F_CONSTEXPR Vector3f Vector3f::zxy() const
+{
+	return Vector3f( m_elements[2], m_elements[0], m_elements[1] );
+}
+
+VECTOR3F_INLINE float Vector3f::abs() const
+{
+	return std::sqrt( m_elements[0] * m_elements[0] + m_elements[1] * m_elements[1] + m_elements[2] * m_elements[2] );
+}
+
+VECTOR3F_CONSTEXPR float Vector3f::absSquared() const
+{
+    return
+        (
+            m_elements[0] * m_elements[0] +
+            m_elements[1] * m_elements[1] +
+            m_elements[2] * m_elements[2]
+        );
+}
+
+VECTOR3F_INLINE void Vector3f::normalize()
+{
+	float norm = abs();
+	m_elements[0] /= norm;
+	m_elements[1] /= norm;
+	m_elements[2] /= norm;
+}
 
+VECTOR3F_INLINE Vector3f Vector3f::normalized() const
+{
+	float norm = abs();
+	return Vector3f
+		(
+			m_elements[0] / norm,
+			m_elements[1] / norm,
+			m_elements[2] / norm
+		);
+}
+
+VECTOR3F_INLINE void Vector3f::negate()
+{
+	m_elements[0] = -m_elements[0];
+	m_elements[1] = -m_elements[1];
+	m_elements[2] = -m_elements[2];
+}
+
+VECTOR3F_INLINE Vector3f::operator const float* () const
+{
+    return m_elements;
+}
+
+VECTOR3F_INLINE Vector3f::operator float* ()
+{
+    return m_elements;
+}
+
+VECTOR3F_INLINE Vector3f& Vector3f::operator += ( const Vector3f& v )
+{
+	m_elements[ 0 ] += v.m_elements[ 0 ];
+	m_elements[ 1 ] += v.m_elements[ 1 ];
+	m_elements[ 2 ] += v.m_elements[ 2 ];
+	return *this;
+}
+
+VECTOR3F_INLINE Vector3f& Vector3f::operator -= ( const Vector3f& v )
+{
+	m_elements[ 0 ] -= v.m_elements[ 0 ];
+	m_elements[ 1 ] -= v.m_elements[ 1 ];
+	m_elements[ 2 ] -= v.m_elements[ 2 ];
+	return *this;
+}
+
+VECTOR3F_INLINE Vector3f& Vector3f::operator *= ( float f )
+{
+	m_elements[ 0 ] *= f;
+	m_elements[ 1 ] *= f;
+	m_elements[ 2 ] *= f;
+	return *this;
+}
+
+VECTOR3F_INLINE Vector3f& Vector3f::operator /= ( float f )
+{
+  m_elements[ 0 ] /= f;
+  m_elements[ 1 ] /= f;
+  m_elements[ 2 ] /= f;
+  return *this;
+}
+
+// static
+VECTOR3F_CONSTEXPR float Vector3f::dot( const Vector3f& v0, const Vector3f& v1 )
+{
+    return v0[0] * v1[0] + v0[1] * v1[1] + v0[2] * v1[2];
+}
+
+// static
+VECTOR3F_CONSTEXPR Vector3f Vector3f::cross( const Vector3f& v0, const Vector3f& v1 )
+{
+    return Vector3f
+        (
+            v0.y() * v1.z() - v0.z() * v1.y(),
+            v0.z() * v1.x() - v0.x() * v1.z(),
+            v0.x() * v1.y() - v0.y() * v1.x()
+        );
+}
+
+// static
+VECTOR3F_CONSTEXPR Vector3f Vector3f::lerp( const Vector3f& v0, const Vector3f& v1, float alpha )
+{
+	return alpha * ( v1 - v0 ) + v0;
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator + ( const Vector3f& v0, const Vector3f& v1 )
+{
+    return Vector3f( v0[0] + v1[0], v0[1] + v1[1], v0[2] + v1[2] );
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator - ( const Vector3f& v0, const Vector3f& v1 )
+{
+    return Vector3f( v0[0] - v1[0], v0[1] - v1[1], v0[2] - v1[2] );
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator * ( const Vector3f& v0, const Vector3f& v1 )
+{
+    return Vector3f( v0[0] * v1[0], v0[1] * v1[1], v0[2] * v1[2] );
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator / ( const Vector3f& v0, const Vector3f& v1 )
+{
+    return Vector3f( v0[0] / v1[0], v0[1] / v1[1], v0[2] / v1[2] );
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator - ( const Vector3f& v )
+{
+    return Vector3f( -v[0], -v[1], -v[2] );
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator * ( float f, const Vector3f& v )
+{
+    return Vector3f( v[0] * f, v[1] * f, v[2] * f );
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator * ( const Vector3f& v, float f )
+{
+    return Vector3f( v[0] * f, v[1] * f, v[2] * f );
+}
+
+VECTOR3F_CONSTEXPR Vector3f operator / ( const Vector3f& v, float f )
+{
+    return Vector3f( v[0] / f, v[1] / f, v[2] / f );
+}
+
+VECTOR3F_CONSTEXPR bool operator == ( const Vector3f& v0, const Vector3f& v1 )
+{
+    return( v0.x() == v1.x() && v0.y() == v1.y() && v0.z() == v1.z() );
+}
+
+VECTOR3F_CONSTEXPR bool operator != ( const Vector3f& v0, const Vector3f& v1 )
+{
+    return !( v0 == v1 );
+}
 
-bool operator == ( const Vector3f& v0, const Vector3f& v1 );
-bool operator != ( const Vector3f& v0, const Vector3f& v1 );
+#undef VECTOR3F_INLINE
+#undef VECTOR3F_CONSTEXPR
 
 #endif // VECTOR_3F_H
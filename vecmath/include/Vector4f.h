@@ -1,6 +1,20 @@
 #ifndef VECTOR_4F_H
 #define VECTOR_4F_H
 
+#include <cmath>
+
+// The small operations are defined inline (constexpr where C++11 allows)
+// at the end of this header. Vector4f.cpp defines VECTOR4F_OUT_OF_LINE,
+// which compiles them there as ordinary functions, so the library keeps
+// its out-of-line symbols.
+#ifdef VECTOR4F_OUT_OF_LINE
+#define VECTOR4F_INLINE
+#define VECTOR4F_CONSTEXPR
+#else
+#define VECTOR4F_INLINE inline
+#define VECTOR4F_CONSTEXPR constexpr
+#endif
+
 class Vector2f;
 class Vector3f;
 
@@ -8,9 +22,9 @@ class Vector4f
 {
 public:
 
-	explicit Vector4f( float f = 0.f );
-	Vector4f( float fx, float fy, float fz, float fw );
-	Vector4f( float buffer[ 4 ] );
+	explicit VECTOR4F_CONSTEXPR Vector4f( float f = 0.f );
+	VECTOR4F_CONSTEXPR Vector4f( float fx, float fy, float fz, float fw );
+	VECTOR4F_INLINE Vector4f( float buffer[ 4 ] );
 
 	Vector4f( const Vector2f& xy, float z, float w );
 	Vector4f( float x, const Vector2f& yz, float w );
@@ -21,26 +35,26 @@ public:
 	Vector4f( float x, const Vector3f& yzw );
 
 	// copy constructors
-	Vector4f( const Vector4f& rv );
+	VECTOR4F_CONSTEXPR Vector4f( const Vector4f& rv );
 
 	// assignment operators
-	Vector4f& operator = ( const Vector4f& rv );
+	VECTOR4F_INLINE Vector4f& operator = ( const Vector4f& rv );
 
 	// no destructor necessary
 
 	// returns the ith element
-	const float& operator [] ( int i ) const;
-	float& operator [] ( int i );
+	VECTOR4F_CONSTEXPR const float& operator [] ( int i ) const;
+	VECTOR4F_INLINE float& operator [] ( int i );
 
-	float& x();
-	float& y();
-	float& z();
-	float& w();
+	VECTOR4F_INLINE float& x();
+	VECTOR4F_INLINE float& y();
+	VECTOR4F_INLINE float& z();
+	VECTOR4F_INLINE float& w();
 
-	float x() const;
-	float y() const;
-	float z() const;
-	float w() const;
+	VECTOR4F_CONSTEXPR float x() const;
+	VECTOR4F_CONSTEXPR float y() const;
+	VECTOR4F_CONSTEXPR float z() const;
+	VECTOR4F_CONSTEXPR float w() const;
 
 	Vector2f xy() const;
 	Vector2f yz() const;
@@ -57,24 +71,24 @@ public:
 	Vector3f zwy() const;
 	Vector3f wxz() const;
 
-	float abs() const;
-	float absSquared() const;
-	void normalize();
-	Vector4f normalized() const;
+	VECTOR4F_INLINE float abs() const;
+	VECTOR4F_CONSTEXPR float absSquared() const;
+	VECTOR4F_INLINE void normalize();
+	VECTOR4F_INLINE Vector4f normalized() const;
 
 	// if v.z != 0, v = v / v.w
-	void homogenize();
-	Vector4f homogenized() const;
+	VECTOR4F_INLINE void homogenize();
+	VECTOR4F_INLINE Vector4f homogenized() const;
 
-	void negate();
+	VECTOR4F_INLINE void negate();
 
 	// ---- Utility ----
-	operator const float* () const; // automatic type conversion for OpenGL
-	operator float* (); // automatic type conversion for OpenG
+	VECTOR4F_INLINE operator const float* () const; // automatic type conversion for OpenGL
+	VECTOR4F_INLINE operator float* (); // automatic type conversion for OpenG
 	void print() const; 
 
-	static float dot( const Vector4f& v0, const Vector4f& v1 );
-	static Vector4f lerp( const Vector4f& v0, const Vector4f& v1, float alpha );
+	static VECTOR4F_CONSTEXPR float dot( const Vector4f& v0, const Vector4f& v1 );
+	static VECTOR4F_CONSTEXPR Vector4f lerp( const Vector4f& v0, const Vector4f& v1, float alpha );
 
 private:
 
@@ -83,20 +97,258 @@ private:
 };
 
 // component-wise operators
-Vector4f operator + ( const Vector4f& v0, const Vector4f& v1 );
-Vector4f operator - ( const Vector4f& v0, const Vector4f& v1 );
-Vector4f operator * ( const Vector4f& v0, const Vector4f& v1 );
-Vector4f operator / ( const Vector4f& v0, const Vector4f& v1 );
+VECTOR4F_CONSTEXPR Vector4f operator + ( const Vector4f& v0, const Vector4f& v1 );
+VECTOR4F_CONSTEXPR Vector4f operator - ( const Vector4f& v0, const Vector4f& v1 );
+VECTOR4F_CONSTEXPR Vector4f operator * ( const Vector4f& v0, const Vector4f& v1 );
+VECTOR4F_CONSTEXPR Vector4f operator / ( const Vector4f& v0, const Vector4f& v1 );
 
 // unary negation
-Vector4f operator - ( const Vector4f& v );
+VECTOR4F_CONSTEXPR Vector4f operator - ( const Vector4f& v );
 
 // multiply and divide by scalar
-Vector4f operator * ( float f, const Vector4f& v );
-Vector4f operator * ( const Vector4f& v, float f );
-Vector4f operator / ( const Vector4f& v, float f );
+VECTOR4F_CONSTEXPR Vector4f operator * ( float f, const Vector4f& v );
+VECTOR4F_CONSTEXPR Vector4f operator * ( const Vector4f& v, float f );
+VECTOR4F_CONSTEXPR Vector4f operator / ( const Vector4f& v, float f );
+
+VECTOR4F_CONSTEXPR bool operator == ( const Vector4f& v0, const Vector4f& v1 );
+VECTOR4F_CONSTEXPR bool operator != ( const Vector4f& v0, const Vector4f& v1 );
+
+//////////////////////////////////////////////////////////////////////////
+// Inline definitions
+//////////////////////////////////////////////////////////////////////////
+
+VECTOR4F_CONSTEXPR Vector4f::Vector4f( float f ) :
+	m_elements{ f, f, f, f }
+{
+}
+
+VECTOR4F_CONSTEXPR Vector4f::Vector4f( float fx, float fy, float fz, float fw ) :
+	m_elements{ fx, fy, fz, fw }
+{
+}
+
+VECTOR4F_INLINE Vector4f::Vector4f( float buffer[ 4 ] )
+{
+	m_elements[ 0 ] = buffer[ 0 ];
+	m_elements[ 1 ] = buffer[ 1 ];
+	m_elements[ 2 ] = buffer[ 2 ];
+	m_elements[ 3 ] = buffer[ 3 ];
+}
+
+VECTOR4F_CONSTEXPR Vector4f::Vector4f( const Vector4f& rv ) :
+	m_elements{ rv.m_elements[0], rv.m_elements[1], rv.m_elements[2], rv.m_elements[3] }
+{
+}
+
+VECTOR4F_INLINE Vector4f& Vector4f::operator = ( const Vector4f& rv )
+{
+	if( this != &rv )
+	{
+		m_elements[0] = rv.m_elements[0];
+		m_elements[1] = rv.m_elements[1];
+		m_elements[2] = rv.m_elements[2];
+		m_elements[3] = rv.m_elements[3];
+	}
+	return *this;
+}
+
+VECTOR4F_CONSTEXPR const float& Vector4f::operator [] ( int i ) const
+{
+	return m_elements[ i ];
+}
+
+VECTOR4F_INLINE float& Vector4f::operator [] ( int i )
+{
+	return m_elements[ i ];
+}
+
+VECTOR4F_INLINE float& Vector4f::x()
+{
+	return m_elements[ 0 ];
+}
+
+VECTOR4F_INLINE float& Vector4f::y()
+{
+	return m_elements[ 1 ];
+}
+
+VECTOR4F_INLINE float& Vector4f::z()
+{
+	return m_elements[ 2 ];
+}
+
+VECTOR4F_INLINE float& Vector4f::w()
+{
+	return m_elements[ 3 ];
+}
+
+VECTOR4F_CONSTEXPR float Vector4f::x() const
+{
+	return m_elements[0];
+}
+
+VECTOR4F_CONSTEXPR float Vector4f::y() const
+{
+	return m_elements[1];
+}
+
+VECTOR4F_CONSTEXPR float Vector4f::z() const
+{
+	return m_elements[2];
+}
+
+VECTOR4F_CONSTEXPR float Vector4f::w() const
+{
+	return m_elements[3];
+}
+
+VECTOR4F_INLINE float Vector4f::abs() const
+{
+	return std::sqrt( m_elements[0] * m_elements[0] + m_elements[1] * m_elements[1] + m_elements[2] * m_elements[2] + m_elements[3] * m_elements[3] );
+}
+
+VECTOR4F_CONSTEXPR float Vector4f::absSquared() const
+{
+	return( m_elements[0] * m_elements[0] + m_elements[1] * m_elements[1] + m_elements[2] * m_elements[2] + m_elements[3] * m_elements[3] );
+}
+
+VECTOR4F_INLINE void Vector4f::normalize()
+{
+	float norm = std::sqrt( m_elements[0] * m_elements[0] + m_elements[1] * m_elements[1] + m_elements[2] * m_elements[2] + m_elements[3] * m_elements[3] );
+	m_elements[0] = m_elements[0] / norm;
+	m_elements[1] = m_elements[1] / norm;
+	m_elements[2] = m_elements[2] / norm;
+	m_elements[3] = m_elements[3] / norm;
+}
+
+VECTOR4F_INLINE Vector4f Vector4f::normalized() const
+{
+	float length = abs();
+	return Vector4f
+		(
+			m_elements[0] / length,
+			m_elements[1] / length,
+			m_elements[2] / length,
+			m_elements[3] / length
+		);
+}
+
+VECTOR4F_INLINE void Vector4f::homogenize()
+{
+	if( m_elements[3] != 0 )
+	{
+		m_elements[0] /= m_elements[3];
+		m_elements[1] /= m_elements[3];
+		m_elements[2] /= m_elements[3];
+		m_elements[3] = 1;
+	}
+}
+
+VECTOR4F_INLINE Vector4f Vector4f::homogenized() const
+{
+	if( m_elements[3] != 0 )
+	{
+		return Vector4f
+			(
+				m_elements[0] / m_elements[3],
+				m_elements[1] / m_elements[3],
+				m_elements[2] / m_elements[3],
+				1
+			);
+	}
+	else
+	{
+		return Vector4f
+			(
+				m_elements[0],
+				m_elements[1],
+				m_elements[2],
+				m_elements[3]
+			);
+	}
+}
+
+VECTOR4F_INLINE void Vector4f::negate()
+{
+	m_elements[0] = -m_elements[0];
+	m_elements[1] = -m_elements[1];
+	m_elements[2] = -m_elements[2];
+	m_elements[3] = -m_elements[3];
+}
+
+VECTOR4F_INLINE Vector4f::operator const float* () const
+{
+	return m_elements;
+}
+
+VECTOR4F_INLINE Vector4f::operator float* ()
+{
+	return m_elements;
+}
+
+// static
+VECTOR4F_CONSTEXPR float Vector4f::dot( const Vector4f& v0, const Vector4f& v1 )
+{
+	return v0.x() * v1.x() + v0.y() * v1.y() + v0.z() * v1.z() + v0.w() * v1.w();
+}
+
+// static
+VECTOR4F_CONSTEXPR Vector4f Vector4f::lerp( const Vector4f& v0, const Vector4f& v1, float alpha )
+{
+	return alpha * ( v1 - v0 ) + v0;
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator + ( const Vector4f& v0, const Vector4f& v1 )
+{
+	return Vector4f( v0.x() + v1.x(), v0.y() + v1.y(), v0.z() + v1.z(), v0.w() + v1.w() );
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator - ( const Vector4f& v0, const Vector4f& v1 )
+{
+	return Vector4f( v0.x() - v1.x(), v0.y() - v1.y(), v0.z() - v1.z(), v0.w() - v1.w() );
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator * ( const Vector4f& v0, const Vector4f& v1 )
+{
+	return Vector4f( v0.x() * v1.x(), v0.y() * v1.y(), v0.z() * v1.z(), v0.w() * v1.w() );
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator / ( const Vector4f& v0, const Vector4f& v1 )
+{
+	return Vector4f( v0.x() / v1.x(), v0.y() / v1.y(), v0.z() / v1.z(), v0.w() / v1.w() );
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator - ( const Vector4f& v )
+{
+	return Vector4f( -v.x(), -v.y(), -v.z(), -v.w() );
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator * ( float f, const Vector4f& v )
+{
+	return Vector4f( f * v.x(), f * v.y(), f * v.z(), f * v.w() );
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator * ( const Vector4f& v, float f )
+{
+	return Vector4f( f * v.x(), f * v.y(), f * v.z(), f * v.w() );
+}
+
+VECTOR4F_CONSTEXPR Vector4f operator / ( const Vector4f& v, float f )
+{
+    return Vector4f( v[0] / f, v[1] / f, v[2] / f, v[3] / f );
+}
+
+VECTOR4F_CONSTEXPR bool operator == ( const Vector4f& v0, const Vector4f& v1 )
+{
+    return( v0.x() == v1.x() && v0.y() == v1.y() && v0.z() == v1.z() && v0.w() == v1.w() );
+}
+
+VECTOR4F_CONSTEXPR bool operator != ( const Vector4f& v0, const Vector4f& v1 )
+{
+    return !( v0 == v1 );
+}
 
-bool operator == ( const Vector4f& v0, const Vector4f& v1 );
-bool operator != ( const Vector4f& v0, const Vector4f& v1 );
+#undef VECTOR4F_INLINE
+#undef VECTOR4F_CONSTEXPR
 
 #endif // VECTOR_4F_H